@@ -0,0 +1,798 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+
+// httpdに負荷をかけ、スループットと応答時間の分布を測るベンチマーク
+// スレッドごとにepollで多数の接続を回し、各接続は1つずつリクエストを送って応答を待つ
+
+#define DEFAULT_CONNECTIONS 64
+#define DEFAULT_THREADS 1
+#define DEFAULT_DURATION 10
+#define DEFAULT_SMALL_FILES 100
+#define DEFAULT_LARGE_FILES 10
+#define DEFAULT_MIX "small"
+#define RANGE_LENGTH 4096
+#define MAX_EPOLL_EVENTS 256
+#define RECV_BUF_SIZE (64 * 1024)
+#define MAX_REQUEST_SIZE 1024
+#define MAX_HEADER_SIZE (16 * 1024)
+#define TIME_BUF_SIZE 64
+
+// 応答時間のヒストグラム。httpdの/_statsと同じく、マイクロ秒の値を2の冪ごとにHIST_SUB_BUCKETS個へ等分して数える
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 30
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB_BUCKETS)
+
+struct Histogram {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long count;
+    unsigned long sum;
+};
+
+// リクエストの種類
+#define REQ_SMALL 0     // 小さいファイルのGET
+#define REQ_LARGE 1     // 大きいファイルのGET
+#define REQ_NOT_FOUND 2 // 存在しないファイルのGET
+#define REQ_HEAD 3      // 小さいファイルのHEAD
+#define REQ_RANGE 4     // 大きいファイルの一部のGET
+#define REQ_COND 5      // If-Modified-Since付きの小さいファイルのGET
+#define NUM_REQ_TYPES 6
+
+static char *req_type_names[NUM_REQ_TYPES] = { "small", "large", "404", "head", "range", "cond" };
+
+// 種類ごとの結果
+struct TypeResult {
+    unsigned long requests;
+    struct Histogram latency;
+};
+
+// スレッドごとの結果。終わってから足し合わせる
+struct Result {
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long connects;
+    unsigned long bytes;
+    unsigned long status[6];
+    struct TypeResult types[NUM_REQ_TYPES];
+};
+
+// 接続の状態
+#define CLIENT_CONNECTING 0
+#define CLIENT_WRITING 1
+#define CLIENT_READING_HEADER 2
+#define CLIENT_READING_BODY 3
+
+// 1本の接続
+struct Client {
+    int fd;
+    int state;
+    int type;
+    int head;
+    int keep_alive;
+    int status;
+    long long start;
+    char req[MAX_REQUEST_SIZE];
+    size_t reqlen;
+    size_t sent;
+    char *buf;
+    size_t len;
+    long long body_left;
+};
+
+// スレッドごとの状態
+struct Worker {
+    pthread_t thread;
+    int id;
+    int epfd;
+    int nclients;
+    struct Client *clients;
+    unsigned int seed;
+    struct Result result;
+};
+
+static void* worker_main(void *arg);
+static void start_client(struct Worker *w, struct Client *c);
+static void handle_client_event(struct Worker *w, struct Client *c, uint32_t events);
+static void prepare_request(struct Worker *w, struct Client *c);
+static int flush_request(struct Client *c);
+static int read_response(struct Worker *w, struct Client *c);
+static int parse_response_header(struct Client *c, size_t header_len);
+static void finish_response(struct Worker *w, struct Client *c);
+static void restart_client(struct Worker *w, struct Client *c, int error);
+static int choose_request_type(struct Worker *w);
+static void parse_mix(char *spec);
+static void resolve_address(char *addr);
+static void record_histogram(struct Histogram *hist, long long usec);
+static void merge_histogram(struct Histogram *dst, struct Histogram *src);
+static unsigned long histogram_quantile(struct Histogram *hist, double q);
+static void merge_results(struct Result *dst, struct Result *src);
+static void print_results(struct Result *r, double elapsed);
+static void print_json_results(struct Result *r, double elapsed);
+static long long current_usec(void);
+static void* checked_malloc(size_t sz);
+static void log_exit(char *fmt, ...);
+
+// 接続先
+static struct sockaddr_storage server_addr;
+static socklen_t server_addrlen;
+static char *host_header;
+
+// リクエストの混ぜ方。weights[i]の割合でi番目の種類を送る
+static int weights[NUM_REQ_TYPES];
+static int total_weight;
+
+static int nconnections = DEFAULT_CONNECTIONS;
+static int nthreads = DEFAULT_THREADS;
+static int duration = DEFAULT_DURATION;
+static int small_files = DEFAULT_SMALL_FILES;
+static int large_files = DEFAULT_LARGE_FILES;
+static int close_connections = 0;
+static int json_output = 0;
+
+// 測定を終える時刻と、If-Modified-Sinceに使う開始時刻
+static long long deadline;
+static char start_date[TIME_BUF_SIZE];
+
+#define USAGE "Usage: %s [--connections N] [--threads N] [--duration SEC] [--close]\n" \
+              "          [--mix TYPE:WEIGHT,...] [--small-files N] [--large-files N] [--json] host:port\n" \
+              "TYPE is one of small, large, 404, head, range and cond.\n"
+
+static struct option longopts[] = {
+    {"connections", required_argument, NULL, 'c'},
+    {"threads", required_argument, NULL, 't'},
+    {"duration", required_argument, NULL, 'd'},
+    {"close", no_argument, NULL, 'C'},
+    {"mix", required_argument, NULL, 'm'},
+    {"small-files", required_argument, NULL, 's'},
+    {"large-files", required_argument, NULL, 'l'},
+    {"json", no_argument, NULL, 'j'},
+    {"help", no_argument, NULL, 'h'},
+    {0, 0, 0, 0}
+};
+
+int
+main(int argc, char *argv[])
+{
+    struct Worker *workers;
+    struct Result total;
+    char *mix = DEFAULT_MIX;
+    long long started;
+    time_t now;
+    int opt, i, per_thread, err;
+
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'c':
+                nconnections = atoi(optarg);
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'C':
+                close_connections = 1;
+                break;
+            case 'm':
+                mix = optarg;
+                break;
+            case 's':
+                small_files = atoi(optarg);
+                break;
+            case 'l':
+                large_files = atoi(optarg);
+                break;
+            case 'j':
+                json_output = 1;
+                break;
+            case 'h':
+                fprintf(stdout, USAGE, argv[0]);
+                exit(0);
+            case '?':
+                fprintf(stderr, USAGE, argv[0]);
+                exit(1);
+        }
+    }
+    if (optind != argc - 1 || nconnections < 1 || nthreads < 1 || duration < 1
+        || small_files < 1 || large_files < 1) {
+        fprintf(stderr, USAGE, argv[0]);
+        exit(1);
+    }
+    if (nthreads > nconnections) {
+        nthreads = nconnections;
+    }
+    parse_mix(mix);
+    resolve_address(argv[optind]);
+    host_header = argv[optind];
+    now = time(NULL);
+    strftime(start_date, sizeof start_date, "%a, %d %b %Y %H:%M:%S GMT", gmtime(&now));
+
+    workers = checked_malloc(sizeof(struct Worker) * nthreads);
+    memset(workers, 0, sizeof(struct Worker) * nthreads);
+    started = current_usec();
+    deadline = started + duration * 1000000LL;
+    per_thread = nconnections / nthreads;
+    for (i = 0; i < nthreads; i++) {
+        workers[i].id = i;
+        workers[i].nclients = per_thread + (i < nconnections % nthreads ? 1 : 0);
+        workers[i].seed = (unsigned int)(started + i);
+        err = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        if (err != 0) {
+            log_exit("pthread_create(3) failed: %s", strerror(err));
+        }
+    }
+    memset(&total, 0, sizeof total);
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        merge_results(&total, &workers[i].result);
+    }
+    if (json_output) {
+        print_json_results(&total, (current_usec() - started) / 1e6);
+    } else {
+        print_results(&total, (current_usec() - started) / 1e6);
+    }
+    exit(0);
+}
+
+static void*
+worker_main(void *arg)
+{
+    struct Worker *w = arg;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    long long now;
+    int i, n;
+
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epfd < 0) {
+        log_exit("epoll_create1(2) failed: %s", strerror(errno));
+    }
+    w->clients = checked_malloc(sizeof(struct Client) * w->nclients);
+    for (i = 0; i < w->nclients; i++) {
+        w->clients[i].buf = checked_malloc(RECV_BUF_SIZE);
+        start_client(w, &w->clients[i]);
+    }
+    for (;;) {
+        now = current_usec();
+        if (now >= deadline) {
+            break;
+        }
+        n = epoll_wait(w->epfd, events, MAX_EPOLL_EVENTS, (int)((deadline - now + 999) / 1000));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_exit("epoll_wait(2) failed: %s", strerror(errno));
+        }
+        for (i = 0; i < n; i++) {
+            handle_client_event(w, events[i].data.ptr, events[i].events);
+        }
+    }
+    for (i = 0; i < w->nclients; i++) {
+        if (w->clients[i].fd >= 0) {
+            close(w->clients[i].fd);
+        }
+        free(w->clients[i].buf);
+    }
+    free(w->clients);
+    close(w->epfd);
+    return NULL;
+}
+
+static void
+start_client(struct Worker *w, struct Client *c)
+{
+    struct epoll_event ev;
+
+    c->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        log_exit("socket(2) failed: %s", strerror(errno));
+    }
+    w->result.connects++;
+    prepare_request(w, c);
+    c->state = CLIENT_CONNECTING;
+    if (connect(c->fd, (struct sockaddr*)&server_addr, server_addrlen) < 0 && errno != EINPROGRESS) {
+        log_exit("connect(2) failed: %s", strerror(errno));
+    }
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+    }
+}
+
+static void
+handle_client_event(struct Worker *w, struct Client *c, uint32_t events)
+{
+    struct epoll_event ev;
+    socklen_t len;
+    int err, ret;
+
+    if (c->state == CLIENT_CONNECTING) {
+        len = sizeof err;
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            restart_client(w, c, 1);
+            return;
+        }
+        c->state = CLIENT_WRITING;
+    }
+    if (c->state == CLIENT_WRITING) {
+        ret = flush_request(c);
+        if (ret < 0) {
+            restart_client(w, c, 1);
+        }
+        if (ret <= 0) {
+            return;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+            log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+        }
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        return;
+    }
+    ret = read_response(w, c);
+    if (ret < 0) {
+        restart_client(w, c, 1);
+    } else if (ret > 0) {
+        finish_response(w, c);
+    }
+}
+
+static void
+prepare_request(struct Worker *w, struct Client *c)
+{
+    char *conn = close_connections ? "close" : "keep-alive";
+    long long offset;
+    int n;
+
+    c->type = choose_request_type(w);
+    c->head = c->type == REQ_HEAD;
+    switch (c->type) {
+        case REQ_SMALL:
+        case REQ_HEAD:
+            n = snprintf(c->req, MAX_REQUEST_SIZE, "%s /small/%d.html HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                         c->head ? "HEAD" : "GET", rand_r(&w->seed) % small_files, host_header, conn);
+            break;
+        case REQ_LARGE:
+            n = snprintf(c->req, MAX_REQUEST_SIZE, "GET /large/%d.bin HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                         rand_r(&w->seed) % large_files, host_header, conn);
+            break;
+        case REQ_NOT_FOUND:
+            n = snprintf(c->req, MAX_REQUEST_SIZE, "GET /missing/%d.html HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                         rand_r(&w->seed), host_header, conn);
+            break;
+        case REQ_RANGE:
+            // 大きいファイルは1MiB以上ある前提で、その中の一部を取る
+            offset = (long long)(rand_r(&w->seed) % 256) * RANGE_LENGTH;
+            n = snprintf(c->req, MAX_REQUEST_SIZE,
+                         "GET /large/%d.bin HTTP/1.1\r\nHost: %s\r\nRange: bytes=%lld-%lld\r\nConnection: %s\r\n\r\n",
+                         rand_r(&w->seed) % large_files, host_header, offset, offset + RANGE_LENGTH - 1, conn);
+            break;
+        default:
+            // ファイルは測定の前に作られているので、開始時刻以降に変わっていなければ304になる
+            n = snprintf(c->req, MAX_REQUEST_SIZE,
+                         "GET /small/%d.html HTTP/1.1\r\nHost: %s\r\nIf-Modified-Since: %s\r\nConnection: %s\r\n\r\n",
+                         rand_r(&w->seed) % small_files, host_header, start_date, conn);
+            break;
+    }
+    c->reqlen = n;
+    c->sent = 0;
+    c->len = 0;
+    c->start = current_usec();
+}
+
+static int
+flush_request(struct Client *c)
+{
+    ssize_t n;
+
+    while (c->sent < c->reqlen) {
+        n = write(c->fd, c->req + c->sent, c->reqlen - c->sent);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->sent += n;
+    }
+    c->state = CLIENT_READING_HEADER;
+    return 1;
+}
+
+static int
+read_response(struct Worker *w, struct Client *c)
+{
+    char *end;
+    ssize_t n;
+
+    for (;;) {
+        if (c->state == CLIENT_READING_HEADER) {
+            n = read(c->fd, c->buf + c->len, RECV_BUF_SIZE - c->len);
+        } else {
+            // ボディは数えるだけなので、バッファの先頭に読み捨てる
+            n = read(c->fd, c->buf, RECV_BUF_SIZE);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        w->result.bytes += n;
+        if (c->state == CLIENT_READING_BODY) {
+            c->body_left -= n;
+        } else {
+            c->len += n;
+            end = memmem(c->buf, c->len, "\r\n\r\n", 4);
+            if (!end) {
+                if (c->len >= MAX_HEADER_SIZE) {
+                    return -1;
+                }
+                continue;
+            }
+            if (parse_response_header(c, end + 4 - c->buf) < 0) {
+                return -1;
+            }
+            c->state = CLIENT_READING_BODY;
+        }
+        if (c->body_left < 0) {
+            // 応答を1つずつしか待たないので、余分なデータは来ないはず
+            return -1;
+        }
+        if (c->body_left == 0) {
+            return 1;
+        }
+    }
+}
+
+static int
+parse_response_header(struct Client *c, size_t header_len)
+{
+    char *p, *line, *next, *value;
+    int minor;
+
+    c->buf[header_len - 2] = '\0';
+    if (sscanf(c->buf, "HTTP/1.%d %d", &minor, &c->status) != 2) {
+        return -1;
+    }
+    c->keep_alive = minor >= 1;
+    c->body_left = -1;
+    for (line = strstr(c->buf, "\r\n") + 2; *line; line = next) {
+        next = strstr(line, "\r\n");
+        if (!next) {
+            break;
+        }
+        *next = '\0';
+        next += 2;
+        p = strchr(line, ':');
+        if (!p) {
+            return -1;
+        }
+        *p = '\0';
+        for (value = p + 1; *value == ' ' || *value == '\t'; value++)
+            ;
+        if (strcasecmp(line, "Content-Length") == 0) {
+            c->body_left = atoll(value);
+        } else if (strcasecmp(line, "Connection") == 0) {
+            c->keep_alive = strcasecmp(value, "close") != 0;
+        } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+            // 静的なファイルの応答しか測らないので、chunkedには対応しない
+            return -1;
+        }
+    }
+    if (c->head || c->status == 304 || c->status == 204 || (c->status >= 100 && c->status < 200)) {
+        c->body_left = 0;
+    }
+    if (c->body_left < 0) {
+        return -1;
+    }
+    // ヘッダと同時に届いたボディの分
+    c->body_left -= c->len - header_len;
+    return 0;
+}
+
+static void
+finish_response(struct Worker *w, struct Client *c)
+{
+    struct epoll_event ev;
+    int klass;
+
+    record_histogram(&w->result.types[c->type].latency, current_usec() - c->start);
+    w->result.types[c->type].requests++;
+    w->result.requests++;
+    klass = c->status / 100;
+    w->result.status[klass >= 1 && klass <= 5 ? klass : 0]++;
+    if (close_connections || !c->keep_alive) {
+        restart_client(w, c, 0);
+        return;
+    }
+    prepare_request(w, c);
+    c->state = CLIENT_WRITING;
+    if (flush_request(c) < 0) {
+        restart_client(w, c, 1);
+        return;
+    }
+    if (c->state == CLIENT_WRITING) {
+        ev.events = EPOLLOUT;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+            log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+        }
+    }
+}
+
+static void
+restart_client(struct Worker *w, struct Client *c, int error)
+{
+    if (error) {
+        w->result.errors++;
+    }
+    close(c->fd);
+    c->fd = -1;
+    if (current_usec() < deadline) {
+        start_client(w, c);
+    }
+}
+
+static int
+choose_request_type(struct Worker *w)
+{
+    int r, i;
+
+    r = rand_r(&w->seed) % total_weight;
+    for (i = 0; i < NUM_REQ_TYPES - 1; i++) {
+        if (r < weights[i]) {
+            break;
+        }
+        r -= weights[i];
+    }
+    return i;
+}
+
+static void
+parse_mix(char *spec)
+{
+    char *buf, *item, *colon, *save;
+    int i;
+
+    buf = checked_malloc(strlen(spec) + 1);
+    strcpy(buf, spec);
+    for (item = strtok_r(buf, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        colon = strchr(item, ':');
+        if (colon) {
+            *colon = '\0';
+        }
+        for (i = 0; i < NUM_REQ_TYPES; i++) {
+            if (strcmp(item, req_type_names[i]) == 0) {
+                break;
+            }
+        }
+        if (i == NUM_REQ_TYPES) {
+            log_exit("unknown request type: %s", item);
+        }
+        weights[i] = colon ? atoi(colon + 1) : 1;
+        if (weights[i] < 0) {
+            log_exit("invalid weight for %s", item);
+        }
+        total_weight += weights[i];
+    }
+    free(buf);
+    if (total_weight == 0) {
+        log_exit("empty request mix: %s", spec);
+    }
+}
+
+static void
+resolve_address(char *addr)
+{
+    struct addrinfo hints, *res;
+    char *buf, *host, *port, *p;
+    int err;
+
+    buf = checked_malloc(strlen(addr) + 1);
+    strcpy(buf, addr);
+    p = strrchr(buf, ':');
+    if (!p) {
+        log_exit("server address must be host:port: %s", addr);
+    }
+    *p = '\0';
+    port = p + 1;
+    host = buf;
+    if (host[0] == '[' && p > host + 1 && p[-1] == ']') {
+        p[-1] = '\0';
+        host++;
+    }
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(host, port, &hints, &res)) != 0) {
+        log_exit("%s", gai_strerror(err));
+    }
+    memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+    server_addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+    free(buf);
+}
+
+static void
+record_histogram(struct Histogram *hist, long long usec)
+{
+    unsigned long v;
+    int e, idx;
+
+    v = usec > 0 ? usec : 0;
+    if (v < HIST_SUB_BUCKETS) {
+        idx = v;
+    } else {
+        e = 63 - __builtin_clzl(v);
+        if (e > HIST_MAX_EXP) {
+            idx = HIST_BUCKETS - 1;
+        } else {
+            idx = (e - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+        }
+    }
+    hist->counts[idx]++;
+    hist->count++;
+    hist->sum += v;
+}
+
+static void
+merge_histogram(struct Histogram *dst, struct Histogram *src)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->count += src->count;
+    dst->sum += src->sum;
+}
+
+static unsigned long
+histogram_quantile(struct Histogram *hist, double q)
+{
+    unsigned long cumulative = 0;
+    int idx, e;
+
+    if (hist->count == 0) {
+        return 0;
+    }
+    for (idx = 0; idx < HIST_BUCKETS - 1; idx++) {
+        cumulative += hist->counts[idx];
+        if (cumulative >= q * hist->count) {
+            break;
+        }
+    }
+    // バケットの範囲の上限を返す
+    if (idx < HIST_SUB_BUCKETS) {
+        return idx + 1;
+    }
+    e = idx / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    return (unsigned long)(HIST_SUB_BUCKETS + idx % HIST_SUB_BUCKETS + 1) << (e - HIST_SUB_BITS);
+}
+
+static void
+merge_results(struct Result *dst, struct Result *src)
+{
+    int i;
+
+    dst->requests += src->requests;
+    dst->errors += src->errors;
+    dst->connects += src->connects;
+    dst->bytes += src->bytes;
+    for (i = 0; i < 6; i++) {
+        dst->status[i] += src->status[i];
+    }
+    for (i = 0; i < NUM_REQ_TYPES; i++) {
+        dst->types[i].requests += src->types[i].requests;
+        merge_histogram(&dst->types[i].latency, &src->types[i].latency);
+    }
+}
+
+static void
+print_results(struct Result *r, double elapsed)
+{
+    struct Histogram all;
+    int i;
+
+    memset(&all, 0, sizeof all);
+    printf("%lu requests in %.2fs, %.1f req/s, %.2f MB/s\n",
+           r->requests, elapsed, r->requests / elapsed, r->bytes / elapsed / 1e6);
+    printf("connections: %lu opened, errors: %lu\n", r->connects, r->errors);
+    printf("status: 2xx=%lu 3xx=%lu 4xx=%lu 5xx=%lu other=%lu\n",
+           r->status[2], r->status[3], r->status[4], r->status[5], r->status[0] + r->status[1]);
+    printf("%-8s %10s %10s %10s %10s %10s\n", "type", "requests", "mean(us)", "p50(us)", "p99(us)", "p999(us)");
+    for (i = 0; i < NUM_REQ_TYPES; i++) {
+        if (!r->types[i].requests) {
+            continue;
+        }
+        merge_histogram(&all, &r->types[i].latency);
+        printf("%-8s %10lu %10.1f %10lu %10lu %10lu\n", req_type_names[i], r->types[i].requests,
+               (double)r->types[i].latency.sum / r->types[i].latency.count,
+               histogram_quantile(&r->types[i].latency, 0.5), histogram_quantile(&r->types[i].latency, 0.99),
+               histogram_quantile(&r->types[i].latency, 0.999));
+    }
+    if (all.count) {
+        printf("%-8s %10lu %10.1f %10lu %10lu %10lu\n", "all", all.count, (double)all.sum / all.count,
+               histogram_quantile(&all, 0.5), histogram_quantile(&all, 0.99), histogram_quantile(&all, 0.999));
+    }
+}
+
+static void
+print_json_results(struct Result *r, double elapsed)
+{
+    struct Histogram all;
+    int i;
+
+    // コミットごとの結果を1行ずつ溜めて比べられるよう、1行のJSONで出す
+    memset(&all, 0, sizeof all);
+    printf("{\"connections\":%d,\"threads\":%d,\"close\":%s,\"elapsed\":%.3f,\"requests\":%lu,"
+           "\"rps\":%.1f,\"bytes\":%lu,\"errors\":%lu,\"types\":{",
+           nconnections, nthreads, close_connections ? "true" : "false", elapsed, r->requests,
+           r->requests / elapsed, r->bytes, r->errors);
+    for (i = 0; i < NUM_REQ_TYPES; i++) {
+        merge_histogram(&all, &r->types[i].latency);
+    }
+    for (i = 0; i < NUM_REQ_TYPES; i++) {
+        if (!r->types[i].requests) {
+            continue;
+        }
+        printf("\"%s\":{\"requests\":%lu,\"p50_us\":%lu,\"p99_us\":%lu,\"p999_us\":%lu},", req_type_names[i],
+               r->types[i].requests, histogram_quantile(&r->types[i].latency, 0.5),
+               histogram_quantile(&r->types[i].latency, 0.99), histogram_quantile(&r->types[i].latency, 0.999));
+    }
+    printf("\"all\":{\"requests\":%lu,\"p50_us\":%lu,\"p99_us\":%lu,\"p999_us\":%lu}}}\n", all.count,
+           histogram_quantile(&all, 0.5), histogram_quantile(&all, 0.99), histogram_quantile(&all, 0.999));
+}
+
+static long long
+current_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void*
+checked_malloc(size_t sz)
+{
+    void *p;
+    p = malloc(sz);
+    if (!p) {
+        log_exit("failed to allocate memory");
+    }
+    return p;
+}
+
+static void
+log_exit(char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(1);
+}
@@ -1,47 +1,1147 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <sched.h>
+#include <netdb.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <ctype.h>
 #include <signal.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <zlib.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define SERVER_NAME "LittleHTTP"
 #define SERVER_VERSION "1.0"
-#define HTTP_MINOR_VERSION 0
+#define HTTP_MINOR_VERSION 1
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
+
+// ステータス行とServerヘッダをあらかじめ連結した雛形
+#define RESPONSE_HEAD(status) \
+    "HTTP/1." TO_STRING(HTTP_MINOR_VERSION) " " status "\r\nServer: " SERVER_NAME "/" SERVER_VERSION "\r\n"
+#define STATUS_101 RESPONSE_HEAD("101 Switching Protocols")
+#define STATUS_200 RESPONSE_HEAD("200 OK")
+#define STATUS_206 RESPONSE_HEAD("206 Partial Content")
+#define STATUS_301 RESPONSE_HEAD("301 Moved Permanently")
+#define STATUS_304 RESPONSE_HEAD("304 Not Modified")
+#define STATUS_400 RESPONSE_HEAD("400 Bad Request")
+#define STATUS_404 RESPONSE_HEAD("404 Not Found")
+#define STATUS_405 RESPONSE_HEAD("405 Method Not Allowed")
+#define STATUS_416 RESPONSE_HEAD("416 Range Not Satisfiable")
+#define STATUS_501 RESPONSE_HEAD("501 Not Implemented")
+#define STATUS_502 RESPONSE_HEAD("502 Bad Gateway")
 #define BLOCK_BUF_SIZE 1024
 #define LINE_BUF_SIZE 4096
-#define MAX_REQUEST_BODY_LENGTH (1024 * 1024)
+#define MAX_CHUNK_LINE_LENGTH 4096
+#define MAX_REQUEST_HEADER_LENGTH (64 * 1024)
+#define MAX_HEADER_FIELDS 64
+#define MAX_RANGES 16
+#define INITIAL_BUF_SIZE 4096
+#define MAX_EPOLL_EVENTS 256
+#define MAX_BACKLOG SOMAXCONN
+#define MAX_PIPELINED_OUTPUT (64 * 1024)
+#define MAX_SENDFILE_SIZE 0x7ffff000
+#define PIPE_BUF_SIZE (64 * 1024)
+#define DEFAULT_KEEPALIVE_TIMEOUT 5
+#define DEFAULT_HEADER_TIMEOUT 10
+#define DEFAULT_BODY_TIMEOUT 30
+#define DEFAULT_WRITE_TIMEOUT 30
+#define DEFAULT_MAX_KEEPALIVE_REQUESTS 100
+#define MAX_PIPELINED_SEGMENTS 64
+#define MAX_WRITEV_SEGMENTS 64
+#define URING_ENTRIES 1024
+#define URING_BUF_SLOTS 256
+#define URING_MAX_FILES 65536
+#define DEFAULT_FILE_CACHE_ENTRIES 1024
+#define DEFAULT_CONTENT_CACHE_SIZE (64 * 1024 * 1024)
+#define DEFAULT_CONTENT_CACHE_MAX_FILE (64 * 1024)
+#define DEFAULT_CACHE_REVALIDATE 1
+#define DEFAULT_COMPRESS_MAX_FILE (1024 * 1024)
+#define MIN_COMPRESS_SIZE 256
+#define INOTIFY_BUF_SIZE (64 * 1024)
+#define TIME_BUF_SIZE 64
+#define ETAG_BUF_SIZE 64
+#define ACCESS_LOG_RING_SIZE 8192
+#define ACCESS_LOG_BUF_SIZE (64 * 1024)
+#define ACCESS_LOG_MAX_LINE 4096
+#define ACCESS_LOG_FLUSH_USEC 10000
+#define LOG_METHOD_LEN 16
+#define LOG_PATH_LEN 256
+#define LOG_REFERER_LEN 128
+#define LOG_AGENT_LEN 128
+#define STATS_PATH "/_stats"
+#define DIR_CACHE_SIZE 64
+#define INDEX_FILE_NAME "index.html"
+#define LISTING_JSON_KEY "?format=json"
+#define GETDENTS_BUF_SIZE (64 * 1024)
+#define DEFAULT_PROXY_TIMEOUT 60
+#define DEFAULT_SEND_QUANTUM (256 * 1024)
+#define RATE_BURST_DIVISOR 4
+#define RATE_RESUME_DIVISOR 10
+#define PROXY_POOL_SIZE 32
+#define PROXY_BUF_SIZE (16 * 1024)
+#define MIN_STATUS_CODE 100
+#define MAX_STATUS_CODE 599
+
+// 受信バッファ内のバイト列の範囲を、リクエストの先頭からのオフセットと長さで表現する構造体
+struct Slice {
+    unsigned int off;
+    unsigned int len;
+};
 
 // HTTPヘッダを表現する構造体
 struct HTTPHeaderField {
+    struct Slice name;
+    struct Slice value;
+};
+
+// 解析のときに見分けておくヘッダの番号
+enum {
+    HDR_CONTENT_LENGTH,
+    HDR_HOST,
+    HDR_RANGE,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_ACCEPT_ENCODING,
+    HDR_CONNECTION,
+    HDR_IF_RANGE,
+    HDR_TRANSFER_ENCODING,
+    HDR_EXPECT,
+    HDR_USER_AGENT,
+    HDR_REFERER,
+    HDR_UPGRADE,
+    HDR_HTTP2_SETTINGS,
+    NUM_KNOWN_HEADERS
+};
+
+// 見分けるヘッダの表の1項目
+struct KnownHeader {
     char *name;
-    char *value;
-    struct HTTPHeaderField *next;
+    size_t len;
+    int id;
+};
+
+// ヘッダ名の長さと先頭・末尾の文字から、known_headersの位置を求めるハッシュ関数
+// 見分けるヘッダの間で衝突しないように係数を選んである。衝突すれば表の初期化子が重なり、-Woverride-initで警告される
+#define HEADER_HASH_SIZE 32
+#define HEADER_HASH(len, first, last) \
+    (((len) * 7 + ((first) | 0x20) + ((last) | 0x20)) & (HEADER_HASH_SIZE - 1))
+#define KNOWN_HEADER(name, first, last, id) \
+    [HEADER_HASH(sizeof(name) - 1, first, last)] = { name, sizeof(name) - 1, id }
+
+static const struct KnownHeader known_headers[HEADER_HASH_SIZE] = {
+    KNOWN_HEADER("Content-Length", 'C', 'h', HDR_CONTENT_LENGTH),
+    KNOWN_HEADER("Host", 'H', 't', HDR_HOST),
+    KNOWN_HEADER("Range", 'R', 'e', HDR_RANGE),
+    KNOWN_HEADER("If-None-Match", 'I', 'h', HDR_IF_NONE_MATCH),
+    KNOWN_HEADER("If-Modified-Since", 'I', 'e', HDR_IF_MODIFIED_SINCE),
+    KNOWN_HEADER("Accept-Encoding", 'A', 'g', HDR_ACCEPT_ENCODING),
+    KNOWN_HEADER("Connection", 'C', 'n', HDR_CONNECTION),
+    KNOWN_HEADER("If-Range", 'I', 'e', HDR_IF_RANGE),
+    KNOWN_HEADER("Transfer-Encoding", 'T', 'g', HDR_TRANSFER_ENCODING),
+    KNOWN_HEADER("Expect", 'E', 't', HDR_EXPECT),
+    KNOWN_HEADER("User-Agent", 'U', 't', HDR_USER_AGENT),
+    KNOWN_HEADER("Referer", 'R', 'r', HDR_REFERER),
+    KNOWN_HEADER("Upgrade", 'U', 'e', HDR_UPGRADE),
+    KNOWN_HEADER("HTTP2-Settings", 'H', 's', HDR_HTTP2_SETTINGS),
 };
 
 // HTTPリクエストを表現する構造体
+// 受信バッファの中を指す範囲だけを記録し、リクエストごとのヒープ確保はしない
+// 解析中に受信バッファが伸びても困らないよう範囲はオフセットで持ち、bufは解析のたびに指し直す
+// 解析を終えるとmethod、path、queryと各ヘッダは受信バッファの中でNUL終端され、文字列として使える
+// known_headersにあるヘッダはknownにheader[]内の位置+1を持ち、名前を比べずに引ける
 struct HTTPRequest {
+    int state;
+    size_t pos;
+    size_t line;
+    size_t header_len;
+    char *buf;
     int protocol_minor_version;
+    struct Slice method_range;
+    struct Slice path_range;
+    struct Slice query_range;
+    struct HTTPHeaderField header[MAX_HEADER_FIELDS];
+    int nheaders;
+    unsigned char known[NUM_KNOWN_HEADERS];
     char *method;
     char *path;
-    struct HTTPHeaderField *header;
-    char *body;
+    char *query;
     long length;
+    int chunked;
+};
+
+// リクエストの解析の進み具合
+#define PARSE_REQUEST_LINE 0
+#define PARSE_HEADER 1
+#define PARSE_BODY 2
+
+// リクエストボディの読み込みの進み具合
+#define BODY_NONE 0         // ボディを読んでいない
+#define BODY_LENGTH 1       // Content-Lengthで長さの決まったボディ
+#define BODY_CHUNK_SIZE 2   // チャンクの大きさの行
+#define BODY_CHUNK_DATA 3   // チャンクのデータ
+#define BODY_CHUNK_END 4    // チャンクのデータの後の改行
+#define BODY_TRAILER 5      // 最後のチャンクの後のトレイラー
+
+struct Connection;
+struct H2Session;
+struct ProxyExchange;
+
+// リクエストボディの受け取り手。届いたdataのlenバイトごとに呼ばれ、最後にlenを0として呼ばれる
+typedef void (*body_sink_t)(struct Connection *conn, char *data, size_t len);
+
+// あらかじめ組み立てておくエラーレスポンス
+// fieldsはContent-Lengthからヘッダの終わりの空行までで、init_error_responsesで埋める
+struct ErrorResponse {
+    char *head;
+    char *body;
+    size_t head_len;
+    size_t body_len;
+    char fields[LINE_BUF_SIZE];
+    size_t fields_len;
+};
+
+#define ERR_BAD_REQUEST 0
+#define ERR_NOT_FOUND 1
+#define ERR_METHOD_NOT_ALLOWED 2
+#define ERR_NOT_IMPLEMENTED 3
+#define ERR_BAD_GATEWAY 4
+#define NUM_ERRORS 5
+
+#define ERROR_RESPONSE(status, title, message)                          \
+    { status, "<html>\r\n"                                              \
+              "<header><title>" title "</title><header>\r\n"            \
+              "<body><p>" message "</p></body>\r\n"                     \
+              "</html>\r\n",                                            \
+      sizeof(status) - 1, 0, "", 0 }
+
+static struct ErrorResponse error_responses[NUM_ERRORS] = {
+    [ERR_BAD_REQUEST] = ERROR_RESPONSE(STATUS_400, "Bad Request", "Your request could not be understood"),
+    [ERR_NOT_FOUND] = ERROR_RESPONSE(STATUS_404, "Not Found", "File not found"),
+    [ERR_METHOD_NOT_ALLOWED] = ERROR_RESPONSE(STATUS_405, "Method Not Allowed",
+                                              "The request method is not allowed"),
+    [ERR_NOT_IMPLEMENTED] = ERROR_RESPONSE(STATUS_501, "Not Implemented",
+                                           "The request method is not implemented"),
+    [ERR_BAD_GATEWAY] = ERROR_RESPONSE(STATUS_502, "Bad Gateway", "The upstream server did not respond"),
 };
 
+// 1秒ごとに作り直すDateヘッダ
+static char date_header[TIME_BUF_SIZE];
+static size_t date_header_len;
+static time_t date_header_time = -1;
+
 // ファイルの情報を保持する構造体
 struct FileInfo {
     char *path;
+    int fd;
     long size;
+    struct timespec mtime;
+    ino_t ino;
     int ok;
 };
 
+// よく使うサブディレクトリを開いたfdのキャッシュの1項目。pathはdocrootからの相対パス
+// ディレクトリの置き換えに気づけるよう、開いたときのデバイスとinode番号を覚えておく
+struct DirCacheEntry {
+    char *path;
+    size_t len;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    time_t validated;
+};
+
+// docrootを開いたfd。URLのパスはここを起点にopenat2(2)のRESOLVE_BENEATHで解決し、docrootの外へは出られない
+// openat2(2)のないカーネルでは、..を含むパスを拒んでからopenat(2)で開く
+static int docroot_fd = -1;
+static int use_openat2 = 1;
+
+// ディレクトリ部分のハッシュで直接引くサブディレクトリのfdのキャッシュ
+static struct DirCacheEntry dir_cache[DIR_CACHE_SIZE];
+
+// getdents64(2)が返すディレクトリエントリ
+struct LinuxDirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// ディレクトリの一覧の1項目。nameは読み込んだ名前を詰めたバッファの中を指す
+// バッファは読む間に伸びて動くので、読み終えるまではname_offを使う
+struct ListingEntry {
+    char *name;
+    size_t name_off;
+    int dir;
+    off_t size;
+    time_t mtime;
+};
+
+// index.htmlのないディレクトリの一覧を自動生成するか
+static int autoindex = 0;
+
+// Content-Encodingの種類。値の小さいものほど優先して選ぶ
+#define ENC_IDENTITY 0
+#define ENC_BR 1
+#define ENC_ZSTD 2
+#define ENC_GZIP 3
+#define NUM_ENCODINGS 4
+
+// Content-Encodingの名前と、圧縮済みのファイルを探すときの拡張子
+struct ContentEncoding {
+    char *name;
+    char *suffix;
+};
+
+static struct ContentEncoding content_encodings[NUM_ENCODINGS] = {
+    [ENC_IDENTITY] = { "identity", "" },
+    [ENC_BR] = { "br", ".br" },
+    [ENC_ZSTD] = { "zstd", ".zst" },
+    [ENC_GZIP] = { "gzip", ".gz" },
+};
+
+// 開いたファイルとそのメタデータを保持する構造体
+// URLのパスとContent-Encodingの組をキーにファイルキャッシュに載り、送信中の接続からも参照される
+// 小さなファイルはステータス行からボディまでを組み立て済みのレスポンスとしてresponseに持つ
+// 符号化したエントリは、隣の圧縮済みファイル（sidecar）を開いたものか、元のファイルをその場で圧縮したもの
+// 後者はfdを持たず、ino、source_size、mtimeは元のファイルのものを持つ
+// listingが真のものは自動生成したディレクトリの一覧で、ino、mtimeはディレクトリのもの
+// fspathはディレクトリ自体を指して/で終わり、その中のどの変更でも捨てられる
+struct CachedFile {
+    char *urlpath;
+    char *fspath;
+    unsigned int hash;
+    int encoding;
+    int sidecar;
+    int listing;
+    int fd;
+    off_t size;
+    off_t source_size;
+    struct timespec mtime;
+    ino_t ino;
+    char *content_type;
+    int encodings;
+    int vary;
+    char etag[ETAG_BUF_SIZE];
+    char last_modified[TIME_BUF_SIZE];
+    char *response;
+    size_t header_len;
+    time_t validated;
+    int refcount;
+    struct CacheWatch *watch;
+    char *name;
+    struct CachedFile *hnext;
+    struct CachedFile *lru_prev;
+    struct CachedFile *lru_next;
+    struct CachedFile *content_prev;
+    struct CachedFile *content_next;
+    struct CachedFile *wnext;
+};
+
+// キャッシュしたファイルの親ディレクトリに対するinotifyの監視を表現する構造体
+struct CacheWatch {
+    int wd;
+    struct CachedFile *files;
+    struct CacheWatch *next;
+};
+
+// URLのパスから開いたファイルを引くLRUキャッシュ
+// docroot以下の変更はinotifyで受け取って該当するエントリを捨てる
+// 組み立て済みレスポンスを持つエントリは別のLRUリストにも並べ、その合計をcontent_sizeに収める
+struct FileCache {
+    long max_entries;
+    long nentries;
+    unsigned int nbuckets;
+    struct CachedFile **buckets;
+    struct CachedFile *lru_head;
+    struct CachedFile *lru_tail;
+    size_t content_size;
+    size_t content_bytes;
+    struct CachedFile *content_head;
+    struct CachedFile *content_tail;
+    struct CacheWatch *watches;
+    int inotify_fd;
+};
+
+// --packで作るアーカイブの形式。数値はすべて作ったマシンのバイト順で書く
+// 先頭のPackHeaderに続いて、ページ境界から各表現のレスポンスヘッダとボディを並べる
+// ボディはページ境界に揃え、render_response_headerで組み立てたヘッダをその直前に置く
+// その後ろにパスとContent-Typeの文字列、最後にパスと符号化の順に並べた索引を置く
+#define PACK_MAGIC "HTTPDPAK"
+#define PACK_VERSION 1
+#define PACK_ALIGN 4096
+
+struct PackHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nentries;
+    uint64_t index_offset;
+    uint64_t strings_offset;
+    uint64_t size;
+};
+
+// アーカイブの索引の1項目。符号化ごとに別の項目になる
+// ETagとLast-Modifiedは元のファイルから作っておき、header_offsetから始まるヘッダにも書き込み済み
+struct PackEntry {
+    uint64_t header_offset;
+    uint64_t size;
+    uint64_t source_size;
+    int64_t mtime;
+    uint32_t path_offset;
+    uint32_t path_len;
+    uint32_t type_offset;
+    uint32_t header_len;
+    uint16_t encoding;
+    uint16_t encodings;
+    char etag[ETAG_BUF_SIZE];
+    char last_modified[TIME_BUF_SIZE];
+};
+
+// mmapしたアーカイブ。filesは索引の各項目を表すCachedFileで、参照を持ち続けて解放させない
+struct Archive {
+    char *map;
+    size_t size;
+    struct PackEntry *entries;
+    char *strings;
+    uint32_t nentries;
+    struct CachedFile **files;
+};
+
+// アーカイブを作る間の状態。entriesのpath_offsetなどはstringsの中を指す
+struct Packer {
+    char *docroot;
+    int fd;
+    uint64_t offset;
+    struct PackEntry *entries;
+    size_t nentries;
+    size_t entries_cap;
+    char *strings;
+    size_t strings_len;
+    size_t strings_cap;
+};
+
+// Rangeヘッダで指定されたバイト範囲を表現する構造体。lastも範囲に含む
+struct ByteRange {
+    off_t first;
+    off_t last;
+};
+
+// 送信待ちのデータの断片
+// SEG_BUFはobuf内の範囲、SEG_MEMはfileの持つメモリ、SEG_FILEはfdの範囲を指す
+struct OutputSegment {
+    int type;
+    char *data;
+    int fd;
+    off_t offset;
+    off_t len;
+    struct CachedFile *file;
+};
+
+#define SEG_BUF 0
+#define SEG_MEM 1
+#define SEG_FILE 2
+
+// タイマーホイールに登録するタイマー。expiresはタイマーホイールの刻みで数えた期限
+// nextがNULLなら登録されていない
+struct Timer {
+    long long expires;
+    int kind;
+    void *data;
+    struct Timer *prev;
+    struct Timer *next;
+};
+
+// 接続のタイマーの種類
+#define TIMEOUT_NONE 0
+#define TIMEOUT_HEADER 1    // リクエストヘッダを読み終わるまで。途中で届いても延ばさない
+#define TIMEOUT_BODY 2      // リクエストボディの続きが届くまで
+#define TIMEOUT_IDLE 3      // 持続的接続で次のリクエストが来るまで
+#define TIMEOUT_WRITE 4     // レスポンスの送信が進むまで
+#define TIMEOUT_PROXY 5     // 転送先とのやりとりが進むまで
+#define TIMEOUT_THROTTLE 6  // 帯域の上限で止めた送信を再開するまで。期限が来ても閉じない
+
+#define TIMER_TICK_MSEC 100
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+// 階層化タイマーホイール。currentは次に処理する刻みで、各スロットは番兵を先頭とする環状リスト
+// 段lのスロットはTIMER_WHEEL_SLOTSのl乗の刻みをまとめて持ち、遠い期限ほど上の段に置く
+// 下の段が一周するたびに上の段の次のスロットを下の段へ振り分け直す
+struct TimerWheel {
+    long long current;
+    long count;
+    struct Timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+// 送信の帯域を絞るトークンバケット。rateは毎秒のバイト数で、0なら絞らない
+// tokensは送ってよい残りのバイト数で、送りすぎた分は負になる。updatedは最後に足した時刻（マイクロ秒）
+struct RateLimit {
+    long long rate;
+    long long tokens;
+    long long updated;
+};
+
+// クライアントとの接続を表現する構造体
+// リクエストはibufに溜めてから解析し、レスポンスはsegsに並べた断片を順に送り出す
+// ヘッダなどその場で組み立てる部分はobufに書き、SEG_BUFの断片から参照する
+struct Connection {
+    int fd;
+    int outfd;
+    int state;
+    char *ibuf;
+    size_t ihead;
+    size_t ilen;
+    size_t icap;
+    struct HTTPRequest req;
+    char *obuf;
+    size_t olen;
+    size_t ocap;
+    struct OutputSegment *segs;
+    int nsegs;
+    int segcap;
+    int seghead;
+    int out_type;
+    int pipefd[2];
+    size_t piped;
+    int keep_alive;
+    int eof;
+    long nrequests;
+    int body_state;
+    long long body_remaining;
+    body_sink_t body_sink;
+    uint32_t events;
+    struct Timer timer;
+    int status;
+    long long body_bytes;
+    int peer_family;
+    unsigned char peer_addr[16];
+    long long parse_usec;
+    long long send_start;
+    int islot;
+    int fixed;
+    int inflight;
+    int closing;
+    int uerror;
+    struct msghdr umsg;
+    struct iovec *uiov;
+    struct H2Session *h2;
+    struct ProxyExchange *proxy;
+    struct RateLimit rate;
+    int throttled;
+    int ready;
+    struct Connection *ready_next;
+};
+
+// 接続の状態
+#define CONN_READING 0
+#define CONN_WRITING 1
+
+// 出力先の種別。ボディをカーネル内でコピーする方法が変わる
+#define OUT_SOCKET 0    // sendfile(2)で送る
+#define OUT_PIPE 1      // splice(2)で直接送る
+#define OUT_OTHER 2     // パイプを経由してsplice(2)で送る
+#define OUT_COPY 3      // spliceできないのでバッファを通してコピーする
+
+// 持続的接続のアイドルタイムアウト（秒）と、1接続で受け付けるリクエスト数の上限
+static int keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+static long max_keepalive_requests = DEFAULT_MAX_KEEPALIVE_REQUESTS;
+
+// リクエストヘッダ、リクエストボディ、レスポンスの送信のタイムアウト（秒）
+static int header_timeout = DEFAULT_HEADER_TIMEOUT;
+static int body_timeout = DEFAULT_BODY_TIMEOUT;
+static int write_timeout = DEFAULT_WRITE_TIMEOUT;
+
+// リバースプロキシで転送先とのやりとりが進まないときのタイムアウト（秒）
+static int proxy_timeout = DEFAULT_PROXY_TIMEOUT;
+
+// 1つの接続が1回の順番で送るバイト数の上限（0なら送れるだけ送る）。大きなファイルの送信が他の接続を待たせないよう、送れる接続を順に回る
+static size_t send_quantum = DEFAULT_SEND_QUANTUM;
+
+// 接続ごとと全体の送信帯域の上限（毎秒のバイト数、0なら絞らない）。全体の上限はワーカーで等分する
+static long long conn_rate_limit = 0;
+static long long global_rate_limit = 0;
+static struct RateLimit global_rate;
+
+// 帯域の上限で止めていて再開できるようになった接続。タイマーの期限で積み、イベントループが順に送信を続ける
+static struct Connection *ready_head = NULL;
+static struct Connection *ready_tail = NULL;
+
+// ファイルキャッシュ。inotify_fdが負なら無効
+// content_cache_max_file以下のファイルはレスポンスごとメモリに載せ、cache_revalidate秒ごとにmtimeを確かめる
+static long file_cache_entries = DEFAULT_FILE_CACHE_ENTRIES;
+static size_t content_cache_size = DEFAULT_CONTENT_CACHE_SIZE;
+static off_t content_cache_max_file = DEFAULT_CONTENT_CACHE_MAX_FILE;
+static off_t compress_max_file = DEFAULT_COMPRESS_MAX_FILE;
+static int cache_revalidate = DEFAULT_CACHE_REVALIDATE;
+static struct FileCache file_cache = { .inotify_fd = -1 };
+
+// --archiveで開いたアーカイブ。mapがNULLでなければdocrootの代わりにここから送る
+static struct Archive archive;
+
+// io_uringのリング
+// SQ、CQとSQEの配列はカーネルと共有するメモリで、sqe_tailはまだカーネルに渡していないSQEの末尾
+// 接続の入力バッファの初期分はbufの中のスロットから割り当て、登録済みバッファとしてREAD_FIXEDで読む
+// 接続のソケットはfd番目の固定ファイルとして登録し、SQEからはその番号で指す
+struct Ring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    int nfiles;
+    char *buf;
+    int *free_slots;
+    int nfree_slots;
+    int timeout_armed;
+    long long timeout_deadline;
+    struct __kernel_timespec timeout;
+};
+
+// SQEのuser_dataの下位ビットで表す操作の種類。上位は接続へのポインタ
+// malloc(3)の返すポインタは16バイト境界に揃うので、下位4ビットを使える
+#define UOP_ACCEPT 0
+#define UOP_RECV 1
+#define UOP_SEND 2
+#define UOP_SPLICE_IN 3
+#define UOP_SPLICE_OUT 4
+#define UOP_INOTIFY 5
+#define UOP_TIMEOUT 6
+#define UOP_TIMEOUT_UPDATE 7
+#define UOP_PROXY 8
+#define UOP_CANCEL 9
+#define UOP_MASK 15
+
+// io_uringを使うかどうか。使えなければepollで動く
+static int use_io_uring = 0;
+static struct Ring ring = { .fd = -1 };
+
+// ワーカープロセスの数（0ならマスターを置かず1プロセスで動く）と、ワーカーをCPUに固定するかどうか
+static int nworkers = -1;
+static int cpu_affinity = 0;
+
+// マスタープロセスが管理するワーカーのpid
+static pid_t *worker_pids;
+
+// 新しいバイナリへ待ち受けソケットのfdを渡す環境変数。値はfdの番号をカンマで区切ったもの
+#define LISTEN_FDS_ENV "LITTLEHTTP_LISTEN_FDS"
+
+// 新しいバイナリを同じ引数で起動し直すために取っておくargv
+static char **saved_argv;
+
+// 前のバイナリから引き継いだ待ち受けソケットのうち、まだ取り出していないもの
+static char *inherited_fds;
+
+// シグナルで頼まれた処理。ハンドラは印をつけるだけで、処理はイベントループの合間に行う
+static volatile sig_atomic_t quit_requested = 0;
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
+
+// 接続の受け付けをやめ、今ある接続が応答し終えるのを待って終わろうとしているか
+static int draining = 0;
+
+// イベントを待つ間だけ使うシグナルマスク。普段はSIGQUITなどを止めておき、待つ直前に届いたものを取りこぼさない
+static sigset_t wait_mask;
+
+// 接続のタイムアウトを管理するタイマーホイール
+static struct TimerWheel timer_wheel;
+
+// 所要時間のヒストグラム。マイクロ秒の値を2の冪ごとにHIST_SUB_BUCKETS個へ等分して数えるので、誤差は1/HIST_SUB_BUCKETS以内に収まる
+// HIST_SUB_BUCKETS未満の値はそのまま添字にする。2のHIST_MAX_EXP+1乗マイクロ秒以上は最後に入れる
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 30
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB_BUCKETS)
+
+struct Histogram {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long count;
+    unsigned long sum;
+};
+
+// 所要時間を計るリクエストの処理の段階
+#define PHASE_PARSE 0   // リクエストヘッダの解析
+#define PHASE_STAT 1    // ファイルを探して開く
+#define PHASE_SEND 2    // レスポンスを積んでから送り終えるまで
+#define NUM_PHASES 3
+
+static char *phase_names[NUM_PHASES] = { "parse", "stat", "send" };
+
+// 数え分けるリクエストのメソッド
+#define METHOD_GET 0
+#define METHOD_HEAD 1
+#define METHOD_POST 2
+#define METHOD_OTHER 3
+#define NUM_METHODS 4
+
+static char *method_names[NUM_METHODS] = { "GET", "HEAD", "POST", "other" };
+
+// ワーカーごとの統計。全ワーカーの分を共有メモリに並べ、各ワーカーは自分の分だけを書く
+// 読むときにだけ全ワーカーの分を足し合わせる。隣のワーカーとキャッシュラインを取り合わないよう64バイト境界に揃える
+struct WorkerStats {
+    unsigned long requests[NUM_METHODS][MAX_STATUS_CODE - MIN_STATUS_CODE + 1];
+    unsigned long bad_requests;
+    unsigned long sent_bytes;
+    unsigned long accepted;
+    long open_connections;
+    unsigned long file_cache_hits;
+    unsigned long file_cache_misses;
+    unsigned long content_cache_hits;
+    unsigned long log_dropped;
+    unsigned long upstream_connects;
+    unsigned long upstream_reused;
+    unsigned long upstream_errors;
+    unsigned long throttled;
+    struct Histogram phases[NUM_PHASES];
+} __attribute__((aligned(64)));
+
+// 書くのは1ワーカーだけなので、他のワーカーから読んでも値が裂けなければよい
+#define STAT_ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+// 全ワーカーの統計と、このプロセスの書く統計。stats_enabledならSTATS_PATHで読める
+static struct WorkerStats *all_stats;
+static int nstats;
+static struct WorkerStats *stats;
+static int stats_enabled = 0;
+
+// アクセスログの1リクエスト分の記録。書き出すときに整形するので、リクエストの処理中は文字列を写すだけで済む
+// 長すぎる文字列は切り詰める。peer_familyが0なら相手のアドレスはわからない
+struct AccessLogRecord {
+    struct timespec time;
+    long long bytes;
+    unsigned short status;
+    unsigned char protocol_major_version;
+    unsigned char protocol_minor_version;
+    unsigned char peer_family;
+    unsigned char peer_addr[16];
+    unsigned char method_len;
+    unsigned char referer_len;
+    unsigned char agent_len;
+    unsigned short path_len;
+    char method[LOG_METHOD_LEN];
+    char path[LOG_PATH_LEN];
+    char referer[LOG_REFERER_LEN];
+    char agent[LOG_AGENT_LEN];
+};
+
+// アクセスログの書式
+#define LOG_COMMON 0
+#define LOG_COMBINED 1
+#define LOG_JSON 2
+
+// アクセスログ。fdが負なら記録しない
+// recordsはイベントループが書き込み書き出しスレッドが読むワーカーごとのリングで、tailとheadはそれぞれの側しか進めない
+// 両者が同じキャッシュラインを取り合わないよう、tailとheadは離して置く
+// リングが一杯なら待たずに捨て、統計のlog_droppedに数える
+// pathはSIGHUPで開き直すときのパスで、stoppingが立つと書き出しスレッドは残りを書いて終わる
+struct AccessLog {
+    int fd;
+    int format;
+    char *path;
+    struct AccessLogRecord *records;
+    int running;
+    int stopping;
+    pthread_t thread;
+    unsigned long tail __attribute__((aligned(64)));
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long reported;
+};
+
+static struct AccessLog access_log = { .fd = -1, .format = LOG_COMMON };
+
+// HTTP/2（h2c）のコネクションプリフェイスとフレームの定数
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN (sizeof(H2_PREFACE) - 1)
+#define H2_FRAME_HEADER_SIZE 9
+#define H2_DEFAULT_FRAME_SIZE 16384
+#define H2_MAX_FRAME_SIZE 0xffffff
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffffL
+#define H2_MAX_STREAMS 100
+#define H2_SEND_QUANTUM (128 * 1024)
+#define H2_MAX_INPUT_BACKLOG (256 * 1024)
+#define H2_MAX_UPGRADE_SETTINGS 256
+
+// フレームの種類
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+// フレームのフラグ
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+// SETTINGSの項目
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+// RST_STREAMとGOAWAYのエラーコード
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_COMPRESSION_ERROR 0x9
+#define H2_ENHANCE_YOUR_CALM 0xb
+
+// HPACKの動的テーブルの大きさ。項目は最小でも32バイトと数えるので、entriesはこれだけあれば溢れない
+#define HPACK_TABLE_SIZE 4096
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_TABLE_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+#define HPACK_STATIC_ENTRIES 61
+#define HUFFMAN_SYMBOLS 257
+#define HUFFMAN_EOS 256
+
+// HPACKのヘッダフィールド。静的テーブルと動的テーブルの項目に使う
+// 動的テーブルではnameとvalueを1つの領域に続けて確保し、nameを解放すればよい
+struct HpackField {
+    char *name;
+    char *value;
+    size_t name_len;
+    size_t value_len;
+};
+
+#define HPACK_FIELD(name, value) { name, value, sizeof(name) - 1, sizeof(value) - 1 }
+
+// HPACKの動的テーブル。entriesを環状に使い、headに最も新しい項目を置く
+// sizeはRFC 7541の数え方による項目の大きさの合計で、max_sizeを超えた分は古い項目から捨てる
+struct HpackTable {
+    struct HpackField entries[HPACK_TABLE_ENTRIES];
+    int head;
+    int count;
+    size_t size;
+    size_t max_size;
+};
+
+// ストリームのリクエストの擬似ヘッダ
+#define PSEUDO_METHOD 0
+#define PSEUDO_PATH 1
+#define PSEUDO_SCHEME 2
+#define PSEUDO_AUTHORITY 3
+#define NUM_PSEUDO_HEADERS 4
+
+static char *pseudo_header_names[NUM_PSEUDO_HEADERS] = { ":method", ":path", ":scheme", ":authority" };
+
+// HTTP/2のストリーム
+// リクエストはHPACKを解いたヘッダをHTTP/1の形でhbufに組み立て、HTTP/1と同じ関数で解析して応答する
+// 応答は接続の出力の代わりにストリームのobufとsegsへ積ませ、ヘッダをHEADERSに、残りをDATAに詰め替えて送る
+// windowは送ってよいDATAの残りで、相手がSETTINGSで初期値を下げると負にもなる
+struct H2Stream {
+    unsigned int id;
+    int end_stream;
+    int malformed;
+    int regular;
+    int has_host;
+    long window;
+    char *pseudo[NUM_PSEUDO_HEADERS];
+    struct HTTPRequest req;
+    char *hbuf;
+    size_t hlen;
+    size_t hcap;
+    char *obuf;
+    size_t olen;
+    size_t ocap;
+    struct OutputSegment *segs;
+    int nsegs;
+    int segcap;
+    int seghead;
+    struct H2Stream *next;
+};
+
+// HTTP/2の接続の状態
+// headからtailはボディを送り終えていないストリームの待ち行列で、先頭から1フレームずつ送っては末尾へ回す
+// hstreamはCONTINUATIONで続きの届くヘッダブロックのストリームで、届いた分はhblockに溜める
+// scratchはハフマン符号を解いた名前と値を置く場所
+struct H2Session {
+    int preface;
+    int goaway;
+    unsigned int last_stream_id;
+    long window;
+    long initial_window;
+    size_t max_frame_size;
+    size_t unacked;
+    int table_size_update;
+    unsigned int hstream;
+    int hflags;
+    char *hblock;
+    size_t hblock_len;
+    size_t hblock_cap;
+    char *scratch[2];
+    size_t scratch_cap[2];
+    struct HpackTable decoder;
+    struct HpackTable encoder;
+    struct H2Stream *head;
+    struct H2Stream *tail;
+    int nstreams;
+};
+
+// h2cを受け付けるか
+static int http2_enabled = 0;
+
+// HPACKのハフマン符号を解く二分木。huffman_tree[node][bit]は子の節の番号か、葉なら-(記号+1)
+// 節は根の0番から順に使い、最初に使うときにhuffman_codesから組み立てる
+static short huffman_tree[HUFFMAN_SYMBOLS - 1][2];
+static int huffman_tree_built = 0;
+
+// 転送先の接続。使い終えて空いたものはrouteのidleにつないでおき、次のリクエストで使い回す
+struct Upstream {
+    int fd;
+    int reused;
+    struct Upstream *next;
+};
+
+// --proxyで指定した転送先。パスがprefixで始まるリクエストをaddrへ送る
+struct ProxyRoute {
+    char *prefix;
+    size_t prefix_len;
+    char *name;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    struct Upstream *idle;
+    int nidle;
+};
+
+// 転送中のリクエスト1つ分の状態。Connectionのproxyから指す
+// reqはログのために写したリクエストで、outは転送先へ送るヘッダとボディ、inは転送先から読んだヘッダ
+// wait_fdとwait_eventsは、proxy_advanceが0を返したときに待つべきfdと事象。wait_fdが負なら帯域の上限で止めていて、再開のタイマーを待つ
+struct ProxyExchange {
+    struct ProxyRoute *route;
+    struct Upstream *up;
+    int state;
+    int wait_fd;
+    short wait_events;
+    int error;
+    struct HTTPRequest req;
+    char *out;
+    size_t olen;
+    size_t ooff;
+    size_t ocap;
+    char *in;
+    size_t ilen;
+    size_t icap;
+    int connect_waited;
+    int body_spliced;
+    int replayable;
+    int received;
+    int head_only;
+    int head_sent;
+    int reusable;
+    int chunked_body;
+    int framing;
+    long long remaining;
+    int chunk_state;
+    int chunk_digits;
+};
+
+// 転送の進み具合
+#define PX_CONNECT 0    // 転送先へ接続している
+#define PX_SEND 1       // リクエストヘッダか、受信バッファにあったボディを送っている
+#define PX_BODY 2       // クライアントからのボディを転送先へ流している
+#define PX_HEADER 3     // レスポンスヘッダを待っている
+#define PX_RELAY 4      // レスポンスボディをクライアントへ流している
+#define PX_DONE 5       // 終わった
+
+// 転送先のレスポンスボディの区切り方
+#define FRAME_NONE 0    // ボディがない
+#define FRAME_LENGTH 1  // Content-Lengthの分だけ
+#define FRAME_CHUNKED 2 // チャンク形式
+#define FRAME_EOF 3     // 転送先が閉じるまで
+
+// 転送先から届くチャンクを読む進み具合。中身はそのままクライアントへ流し、終わりだけを見つける
+#define CHUNK_SIZE 0
+#define CHUNK_EXT 1
+#define CHUNK_DATA 2
+#define CHUNK_DATA_END 3
+#define CHUNK_TRAILER 4
+#define CHUNK_TRAILER_LINE 5
+#define CHUNK_DONE 6
+
+// 転送先の一覧。main()で組み立ててからワーカーを起こす
+static struct ProxyRoute *proxy_routes = NULL;
+static int nproxy_routes = 0;
+
+// epollに登録する転送先のfdのdataには、接続へのポインタにこのビットを立てて区別する
+#define EPOLL_UPSTREAM 1UL
+
+// RFC 7541 Appendix Aの静的テーブル。添字がそのままインデックスになるよう0番は空けてある
+static const struct HpackField hpack_static_table[HPACK_STATIC_ENTRIES + 1] = {
+    { NULL, NULL, 0, 0 },
+    HPACK_FIELD(":authority", ""),
+    HPACK_FIELD(":method", "GET"),
+    HPACK_FIELD(":method", "POST"),
+    HPACK_FIELD(":path", "/"),
+    HPACK_FIELD(":path", "/index.html"),
+    HPACK_FIELD(":scheme", "http"),
+    HPACK_FIELD(":scheme", "https"),
+    HPACK_FIELD(":status", "200"),
+    HPACK_FIELD(":status", "204"),
+    HPACK_FIELD(":status", "206"),
+    HPACK_FIELD(":status", "304"),
+    HPACK_FIELD(":status", "400"),
+    HPACK_FIELD(":status", "404"),
+    HPACK_FIELD(":status", "500"),
+    HPACK_FIELD("accept-charset", ""),
+    HPACK_FIELD("accept-encoding", "gzip, deflate"),
+    HPACK_FIELD("accept-language", ""),
+    HPACK_FIELD("accept-ranges", ""),
+    HPACK_FIELD("accept", ""),
+    HPACK_FIELD("access-control-allow-origin", ""),
+    HPACK_FIELD("age", ""),
+    HPACK_FIELD("allow", ""),
+    HPACK_FIELD("authorization", ""),
+    HPACK_FIELD("cache-control", ""),
+    HPACK_FIELD("content-disposition", ""),
+    HPACK_FIELD("content-encoding", ""),
+    HPACK_FIELD("content-language", ""),
+    HPACK_FIELD("content-length", ""),
+    HPACK_FIELD("content-location", ""),
+    HPACK_FIELD("content-range", ""),
+    HPACK_FIELD("content-type", ""),
+    HPACK_FIELD("cookie", ""),
+    HPACK_FIELD("date", ""),
+    HPACK_FIELD("etag", ""),
+    HPACK_FIELD("expect", ""),
+    HPACK_FIELD("expires", ""),
+    HPACK_FIELD("from", ""),
+    HPACK_FIELD("host", ""),
+    HPACK_FIELD("if-match", ""),
+    HPACK_FIELD("if-modified-since", ""),
+    HPACK_FIELD("if-none-match", ""),
+    HPACK_FIELD("if-range", ""),
+    HPACK_FIELD("if-unmodified-since", ""),
+    HPACK_FIELD("last-modified", ""),
+    HPACK_FIELD("link", ""),
+    HPACK_FIELD("location", ""),
+    HPACK_FIELD("max-forwards", ""),
+    HPACK_FIELD("proxy-authenticate", ""),
+    HPACK_FIELD("proxy-authorization", ""),
+    HPACK_FIELD("range", ""),
+    HPACK_FIELD("referer", ""),
+    HPACK_FIELD("refresh", ""),
+    HPACK_FIELD("retry-after", ""),
+    HPACK_FIELD("server", ""),
+    HPACK_FIELD("set-cookie", ""),
+    HPACK_FIELD("strict-transport-security", ""),
+    HPACK_FIELD("transfer-encoding", ""),
+    HPACK_FIELD("user-agent", ""),
+    HPACK_FIELD("vary", ""),
+    HPACK_FIELD("via", ""),
+    HPACK_FIELD("www-authenticate", ""),
+};
+
+// RFC 7541 Appendix Bのハフマン符号。huffman_codesの下位huffman_code_lengthsビットが記号の符号
+static const unsigned int huffman_codes[HUFFMAN_SYMBOLS] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+
+static const unsigned char huffman_code_lengths[HUFFMAN_SYMBOLS] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
 // シグナルハンドラ
 typedef void (*sighandler_t)(int);
 
@@ -54,406 +1154,8201 @@ static void trap_signal(int sig, sighandler_t handler);
 // シグナルを表示して強制終了するヘルパー関数
 static void signal_exit(int sig);
 
-// docrootを頂点とするディレクトリツリーに対してinからのリクエストを読み込んでレスポンスを生成しoutに出力する関数
-static void service(FILE *in, FILE *out, char *docroot);
+// docrootを頂点とするディレクトリツリーに対してinfdからのリクエストを読み込んでレスポンスを生成しoutfdに出力する関数
+static void service(int infd, int outfd, char *docroot);
+
+// addrで指定されたアドレスで待ち受けるノンブロッキングなソケットを作って返す関数
+// reuseportが真ならSO_REUSEPORTをつけ、同じアドレスに複数のソケットをbindできるようにする
+static int listen_socket(char *addr, int reuseport);
+
+// host:portの形のbufを書き換えてhostとportに分ける関数。[::1]:80のように括弧で囲んだIPv6アドレスも受け付ける
+static int split_host_port(char *buf, char **host, char **port);
+
+// ワーカーごとにSO_REUSEPORTのソケットを作ってワーカーを起動し、死んだワーカーを起動し直し続ける関数
+// SIGQUITでは受け付けをやめさせて全ワーカーの終わるのを待ち、SIGHUPはワーカーに伝え、SIGUSR2では新しいバイナリを起動する
+static void master_main(char *addr, char *docroot);
+
+// socks[id]で待ち受けるid番目のワーカープロセスを起動してそのpidを返す関数
+static pid_t spawn_worker(int id, int *socks, char *docroot);
+
+// id番目のワーカーを、使ってよいCPUのうちの1つに固定する関数
+static void pin_worker(int id);
+
+// 全てのワーカーを終了させてからマスターを終了するシグナルハンドラ
+static void terminate_workers(int sig);
+
+// SIGQUIT、SIGHUP、SIGUSR2が届いたことを覚えておくシグナルハンドラ
+static void record_signal(int sig);
+
+// 頼まれた再読み込みとバイナリの入れ替えを行い、受け付けをやめるべきときに真を返す関数。server_fdは待ち受けソケット
+static int check_server_signals(int server_fd, char *docroot);
+
+// n個の待ち受けソケットsocksを引き継がせて、同じ引数で新しいバイナリを起動しそのpidを返す関数
+static pid_t exec_new_binary(int *socks, int n);
+
+// 前のバイナリから引き継いだ待ち受けソケットを1つ取り出して返す関数。残っていなければ-1を返す
+static int inherited_socket(void);
+
+// 引き継いだが使わなかった待ち受けソケットを閉じる関数
+static void close_inherited_sockets(void);
+
+// アクセスログとdocrootを開き直し、転送先の名前を引き直す関数
+static void reload_config(char *docroot);
+
+// 次のリクエストを待っているだけの接続を全て閉じる関数
+static void close_idle_connections(void);
+
+// server_fdで接続を受け付け、epollで全ての接続を1プロセスで多重化して処理する関数
+// SIGQUITを受けたら受け付けをやめ、今ある接続が応答し終えたところで終わる
+static void server_main(int server_fd, char *docroot);
+
+// server_fdに届いている接続を受け付けられるだけ受け付けてepfdに登録する関数
+static void accept_connections(int epfd, int server_fd);
+
+// connに読み書きの準備ができたときに呼ばれ、リクエストの処理を進める関数
+static void handle_connection_event(int epfd, struct Connection *conn, char *docroot);
+
+// connの監視するイベントをepfdに登録し直す関数
+static void watch_connection(int epfd, struct Connection *conn, uint32_t events);
+
+// conn->proxyの待つfdをepfdに登録する関数。転送先を待つ間はクライアントのfdを外しておく
+static void watch_proxy(int epfd, struct Connection *conn);
+
+// io_uringで接続の受け付けと送受信を行うserver_main。io_uringが使えなければ何もせず-1を返す
+static int uring_server_main(int server_fd, char *docroot);
+
+// io_uringのリングを作り、固定ファイルの表と登録済みバッファを登録する関数。失敗したら-1を返す
+static int uring_setup(void);
+
+// 空いているSQEを1つ、user_dataにopとdataを詰めて返す関数。SQが一杯なら先に溜まった分をカーネルに渡す
+static struct io_uring_sqe* uring_get_sqe(int op, void *data);
+
+// 溜まったSQEをカーネルに渡し、wait_nr個の完了を待つ関数
+static int uring_enter(unsigned wait_nr);
+
+// 届いた1つの完了cqeを処理する関数
+static void uring_handle_cqe(struct io_uring_cqe *cqe, int server_fd, char *docroot);
+
+// 固定ファイルの表のindex番目にfdを登録する関数。fdが-1なら登録を外す
+static int uring_update_file(int index, int fd);
+
+// connへの受信をSQEとして積む関数
+static void uring_prep_recv(struct Connection *conn);
+
+// connの送信待ちの先頭をSQEとして積む関数。積んだら1、送るものがなければ0を返す
+static int uring_prep_send(struct Connection *conn);
+
+// conn->proxyの待つfdのPOLL_ADDをSQEとして積む関数
+static void uring_prep_poll(struct Connection *conn);
+
+// connへの操作が全て完了したときに呼ばれ、リクエストの処理を進める関数
+static void uring_advance(struct Connection *conn, char *docroot);
+
+// connを閉じる関数。カーネルがまだバッファを使っていれば、操作を終わらせてから完了時に解放する
+static void close_connection(struct Connection *conn);
+
+// connのタイマーを止め、再開待ちの列から外すヘルパー関数
+static void unlink_connection(struct Connection *conn);
+
+// connの状態に応じた種類のタイムアウトを仕掛ける関数
+static void update_connection_timer(struct Connection *conn);
+
+// タイマーホイールを空にして現在時刻に合わせる関数
+static void init_timer_wheel(void);
+
+// timerをsec秒後に期限の来るkindの種類のタイマーとして仕掛け直す関数
+static void add_timer(struct Timer *timer, int kind, int sec);
+
+// timerをmsecミリ秒後に期限の来るkindの種類のタイマーとして仕掛け直す関数
+static void add_timer_msec(struct Timer *timer, int kind, long long msec);
+
+// timerを止める関数。止まっていれば何もしない
+static void cancel_timer(struct Timer *timer);
+
+// timerを期限に応じたタイマーホイールのスロットに繋ぐヘルパー関数
+static void insert_timer(struct Timer *timer);
+
+// 期限の来たタイマーの接続を閉じ、次に期限の来るまでのミリ秒を返す関数。タイマーがなければ-1を返す
+// 帯域の上限で止めていた接続は閉じずに再開待ちの列に積む
+static int run_timers(void);
+
+// connを再開待ちの列の末尾に積む関数
+static void push_ready_connection(struct Connection *conn);
+
+// 再開待ちの列の先頭の接続を取り出す関数。空ならNULLを返す
+static struct Connection* pop_ready_connection(void);
+
+// rlに前に足してからの時間の分のトークンを足す関数
+static void refill_rate_limit(struct RateLimit *rl, long long now);
 
-// inからやってくるリクエストを読み込んで、適切にHTTPRequest構造体インスタンスを構築しそれへのポインタを返す関数
-static struct HTTPRequest* read_request(FILE *in);
+// connが今送ってよいバイト数を返す関数。帯域を絞っていなければLLONG_MAXを返す
+static long long send_allowance(struct Connection *conn);
 
-// inからのストリームを解析し、引数reqの指し示す先に適切に格納するread_requestのヘルパー関数
-static void read_request_line(struct HTTPRequest *req, FILE *in);
+// connでnバイト送ったことを統計とトークンバケットに記録する関数
+static void account_sent(struct Connection *conn, size_t n);
 
-// inからやってくるストリームを読み込んで、適切にHTTPHeaderField構造体インスタンスを構築しそれへのポインタを返す関数
-static struct HTTPHeaderField* read_header_field(FILE *in);
+// 送ってよいバイト数の尽きたconnを、トークンが溜まるまで止める関数
+static void throttle_connection(struct Connection *conn);
+
+// timerの期限までのミリ秒を返す関数
+static int timer_remaining(struct Timer *timer);
+
+// 単調増加する現在時刻をミリ秒で返すヘルパー関数
+static long long current_msec(void);
+
+// fdから読んでoutfdに書くConnection構造体インスタンスを構築しそれへのポインタを返す関数
+static struct Connection* new_connection(int fd, int outfd);
+
+// connの指し示す先のConnection構造体インスタンスを、ディスクリプタを閉じてメモリから解放する関数
+static void free_connection(struct Connection *conn);
+
+// connの受信バッファに少なくともBLOCK_BUF_SIZEの空きを作るヘルパー関数
+static void reserve_input(struct Connection *conn);
+
+// connの受信バッファに読めるだけ読み込む関数。EOFなら0、エラーなら-1を返す
+static int fill_connection(struct Connection *conn);
+
+// connの受信バッファに届いているリクエストを、順序を保ったまま処理できるだけ処理する関数
+// レスポンスを1つでも積んだら1を返す
+static int process_requests(struct Connection *conn, char *docroot);
+
+// connの受信バッファの先頭にある、解析を終えたリクエストを処理し、レスポンスを送信バッファに積む関数
+static void handle_request(struct Connection *conn, char *docroot);
+
+// reqを受け取ったあと、connを持続的接続として使い続けるかどうかを返す関数
+static int keep_alive_p(struct HTTPRequest *req, struct Connection *conn);
+
+// 受信バッファにあるリクエストボディを読み進めてbody_sinkに渡す関数
+// 読み終えたら1、続きが届いていなければ0、ボディの形式が不正なら-1を返す
+static int consume_body(struct Connection *conn);
+
+// 受信バッファのihead以降から改行までの1行を返すconsume_bodyのヘルパー関数。行がまだ届いていなければNULLを返す
+// 行の長さ（改行を含む）をlenに格納する
+static char* body_line(struct Connection *conn, size_t *len);
+
+// 受信バッファのボディのうちlenバイトをbody_sinkに渡し、読んだものとして進めるconsume_bodyのヘルパー関数
+static void deliver_body(struct Connection *conn, size_t len);
+
+// connの送信バッファとボディを書き出す関数。書き終えたら1、ブロックするなら0、エラーなら-1を返す
+// send_quantumバイト送ったか帯域の上限に達したときも0を返す。上限のときはconn->throttledが立つ
+static int flush_connection(struct Connection *conn);
+
+// connの先頭にあるファイルの断片segを出力先の種別に応じた方法でlimitバイトまで送り、送ったバイト数を返すflush_connectionのヘルパー関数
+static ssize_t send_file_segment(struct Connection *conn, struct OutputSegment *seg, size_t limit);
+
+// connの先頭から続くメモリ上の断片をまとめてwritevで送り、送ったバイト数を返すflush_connectionのヘルパー関数
+static ssize_t send_memory_segments(struct Connection *conn);
+
+// connの先頭から続くメモリ上の断片をiovに並べて個数を返すヘルパー関数。後にファイルの断片が続けばmoreを立てる
+static int fill_memory_iov(struct Connection *conn, struct iovec *iov, int *more);
+
+// connの先頭から続くメモリ上の断片をnバイト送ったものとして進めるヘルパー関数
+static void consume_memory_segments(struct Connection *conn, size_t n);
+
+// connの送信待ちの断片の末尾に断片を加える関数。fileを渡すとその参照を断片が引き取る
+static void queue_segment(struct Connection *conn, int type, char *data, int fd, off_t offset, off_t len, struct CachedFile *file);
+
+// connの先頭の断片を送り終えたものとして取り除く関数
+static void pop_segment(struct Connection *conn);
+
+// connに送信待ちの断片が残っているかどうかを返す関数
+static int output_pending_p(struct Connection *conn);
+
+// connの送信バッファに書式つきで文字列を積む関数
+static void conn_printf(struct Connection *conn, char *fmt, ...);
+
+// connの出力用バッファにdataのlenバイトを書き写し、ヘッダの断片として積む関数
+static void conn_write(struct Connection *conn, const char *data, size_t len);
+
+// bufの指し示す先のバッファを少なくともneedバイト入るように拡張するヘルパー関数
+static void grow_buffer(char **buf, size_t *cap, size_t need);
+
+// connの受信バッファに届いている分だけリクエストの解析を進める関数
+// リクエストが全て届いて解析を終えたら1、まだ途中なら0、不正なら-1を返す
+static int parse_request(struct Connection *conn);
+
+// 受信バッファ内のpから始まる長さlenのリクエスト行を解析し、reqに記録するparse_requestのヘルパー関数
+static int parse_request_line(struct HTTPRequest *req, char *p, size_t len);
+
+// 受信バッファ内のpから始まる長さlenのヘッダ行を解析し、reqに記録するparse_requestのヘルパー関数
+static int parse_header_field(struct HTTPRequest *req, char *p, size_t len);
+
+// ヘッダを読み終えたreqの各範囲を受信バッファの中でNUL終端し、ボディの長さを決めるparse_requestのヘルパー関数
+static int finish_header(struct HTTPRequest *req);
+
+// 引数reqの指し示す先のHTTPRequest構造体インスタンスを、次のリクエストを解析できるよう初期化する関数
+static void reset_request(struct HTTPRequest *req);
+
+// pからendまでの間で最初に現れるaかbの位置を返す関数。見つからなければNULLを返す
+static char* scan_bytes(char *p, char *end, char a, char b);
 
 // strの指し示す先に格納されている文字列を大文字にするヘルパー関数
 static void upcase(char *str);
 
-// 引数reqの指し示す先のHTTPRequest構造体インスタンスをメモリから解放する関数
-static void free_request(struct HTTPRequest *req);
-
 // 引数reqの指し示す先のHTTPRequest構造体インスタンスのContent-Lengthを返す関数
 static long content_length(struct HTTPRequest *req);
 
-// 引数reqの指し示す先のHTTPRequest構造体インスタンスのヘッダーからnameの指し示す先に格納されているフィールドの文字列を返す関数
-static char* lookup_header_field_value(struct HTTPRequest *req, char *name);
+// 引数reqの指し示す先のHTTPRequest構造体インスタンスから、番号idの見分けてあるヘッダの値を返す関数
+static char* lookup_known_header(struct HTTPRequest *req, int id);
+
+// 長さlenのヘッダ名nameがknown_headersにあればその番号を、なければ-1を返す関数
+static int known_header_id(char *name, size_t len);
+
+// 引数reqの指し示す先のHTTPRequest構造体インスタンスとdocrootを元にレスポンスを生成しconnに積む関数
+static void respond_to(struct HTTPRequest *req, struct Connection *conn, char *docroot);
+
+// respond_toのヘルパー関数
+static void do_file_response(struct HTTPRequest *req, struct Connection *conn, char *docroot);
+static void method_not_allowed(struct HTTPRequest *req, struct Connection *conn);
+static void not_implemented(struct HTTPRequest *req, struct Connection *conn);
+static void not_found(struct HTTPRequest *req, struct Connection *conn);
+static void redirect_to_directory(struct HTTPRequest *req, struct Connection *conn);
+static void bad_request(struct Connection *conn);
+
+// 組み立て済みのエラーレスポンスerror_responses[err]を積むヘルパー関数
+static void output_error_response(struct HTTPRequest *req, struct Connection *conn, int err);
+
+// error_responsesのContent-Length以降のヘッダを組み立てる関数
+static void init_error_responses(void);
+
+// ヘッダーフィールドの雛形を出力するヘルパー関数。statusはSTATUS_*の雛形
+static void output_common_header_fields(struct Connection *conn, char *status);
+
+// DateとConnectionのヘッダを出力するヘルパー関数
+static void output_date_and_connection(struct Connection *conn);
+
+// 現在時刻のDateヘッダを、秒が変わったときだけ作り直して返すヘルパー関数
+static char* cached_date_header(size_t *len);
+
+// docrotを頂点とするディレクトリツリーにおいてpathによって特定されるファイルについてのFleInfo構造体を構築しそれへのポインタを返す関数
+static struct FileInfo* get_fileinfo(char *docroot, char *path);
+
+// docrootを頂点とするディレクトリツリーにおいてpathで特定されるファイルの、システム上のフルパスを意味する文字列を構築し返すヘルパー関数
+static char* build_fspath(char *docroot, char *path);
+
+// docrootを開いてdocroot_fdとする関数
+static void open_docroot(char *docroot);
+
+// URLのパスurlpathの末尾にsuffixを付けたファイルを、docrootの外に出ないように開く関数
+static int open_beneath(char *urlpath, char *suffix, int flags);
+
+// URLのパスurlpathの末尾にsuffixを付けたファイルを、docrootの外に出ないようにlstatする関数
+static int stat_beneath(char *urlpath, char *suffix, struct stat *st);
+
+// urlpathの親ディレクトリのfdをキャッシュから、なければ開いて返し、*nameに最後の要素を指させる関数
+static int lookup_dirfd(char *urlpath, char **name);
+
+// dirfdからの相対パスpathを、dirfdの外に出ないように開くヘルパー関数
+static int resolve_beneath(int dirfd, char *path, int flags);
+
+// サブディレクトリのfdのキャッシュを全て閉じる関数
+static void flush_dir_cache(void);
+
+// docrootを頂点とするディレクトリツリーにおいてpathで特定されるファイルを開き、キャッシュから、なければ新しく
+// CachedFile構造体インスタンスを得てそれへのポインタを返す関数。ファイルがなければNULLを返す
+static struct CachedFile* open_cached_file(char *docroot, char *path);
+
+// urlpathのencodingで符号化された表現としてfspathのファイルを表すCachedFile構造体インスタンスを作るヘルパー関数
+static struct CachedFile* new_cached_file(char *urlpath, unsigned int hash, int encoding, char *fspath, int fd,
+                                          off_t size, struct timespec mtime, ino_t ino);
+
+// fileをファイルキャッシュに載せ、小さければ内容も読み込むヘルパー関数
+static void cache_new_file(struct CachedFile *file);
+
+// 符号化されていないfileについて、encodingsのうち最も優先する符号化の表現を開く関数
+// 圧縮済みのファイルがあればそれを開き、なければgzipでその場で圧縮してキャッシュに載せる。どれも使えなければNULLを返す
+static struct CachedFile* open_encoded_file(struct CachedFile *file, int encodings);
+
+// fileの隣にある、encodingで圧縮済みのファイルを開くヘルパー関数。ないか古ければNULLを返す
+static struct CachedFile* open_sidecar_file(struct CachedFile *file, int encoding, unsigned int hash);
+
+// fileの内容をgzipで圧縮し、メモリ上の表現としてファイルキャッシュに載せるヘルパー関数。縮まなければNULLを返す
+static struct CachedFile* compress_cached_file(struct CachedFile *file, unsigned int hash);
+
+// sizeバイトのsrcをgzipで圧縮し、確保したバッファとその長さを返すヘルパー関数。縮まなければNULLを返す
+static char* gzip_content(char *src, off_t size, size_t *len);
+
+// fileの内容をすべて読み込んで返すヘルパー関数。読めなければNULLを返す
+static char* read_file_content(struct CachedFile *file);
+
+// /で終わるreq->pathのディレクトリのindex.htmlを開き、なければautoindexのとき一覧を返す関数
+// どちらもなければNULLを返す
+static struct CachedFile* open_directory_index(struct HTTPRequest *req, char *docroot);
+
+// urlpathのディレクトリの一覧をキャッシュから、なければ読み込んでHTMLかJSONに組み立てて返す関数
+static struct CachedFile* open_directory_listing(char *docroot, char *urlpath, int json);
+
+// dirfdのディレクトリをgetdents64(2)で読み、送れる項目を並べて返すヘルパー関数
+// 名前は*namesに詰めて返すので、項目の配列と一緒に解放する
+static struct ListingEntry* read_directory(int dirfd, char **names, size_t *n);
+
+// 項目entriesを並べたHTMLかJSONのボディを組み立てるヘルパー関数
+static char* render_directory_listing(char *urlpath, struct ListingEntry *entries, size_t n, int json,
+                                      size_t *len);
+
+// sをHTMLかJSONの文字列の中に書けるようエスケープしてbufに追記するヘルパー関数
+static void buf_append_escaped(char **buf, size_t *len, size_t *cap, const char *s, int json);
 
-// 引数reqの指し示す先のHTTPRequest構造体インスタンスとdocrootを元にレスポンスを生成しoutに投げる関数
-static void respond_to(struct HTTPRequest *req, FILE *out, char *docroot);
+// 一覧の項目をディレクトリを先に、名前の順に並べるためのqsort(3)の比較関数
+static int compare_listing_entries(const void *a, const void *b);
+
+// クエリ文字列queryが&で区切られた要素paramを含めば真を返すヘルパー関数
+static int query_param_p(char *query, char *param);
+
+// docroot以下のファイルをすべて読み、アーカイブにしてpathに書き出す関数
+static void pack_docroot(char *docroot, char *path);
+
+// urlpathのディレクトリの中身を再帰的にpackerへ追加するヘルパー関数
+static void pack_directory(struct Packer *packer, char *urlpath);
+
+// urlpathのファイルを、符号化された表現も含めてpackerへ追加するヘルパー関数
+static void pack_file(struct Packer *packer, char *urlpath);
+
+// fileの表現をボディbodyとともにアーカイブに書き、索引に加えるヘルパー関数
+static void pack_entry(struct Packer *packer, struct CachedFile *file, char *body);
+
+// bufのlenバイトをアーカイブのoffsetの位置に書くヘルパー関数。書けなければ終了する
+static void pack_write(struct Packer *packer, char *buf, size_t len, uint64_t offset);
+
+// 文字列sをアーカイブの文字列領域に加え、その位置を返すヘルパー関数
+static uint32_t pack_string(struct Packer *packer, char *s);
+
+// アーカイブの索引をパス、符号化の順に並べるためのqsort_r(3)の比較関数
+static int compare_pack_entries(const void *a, const void *b, void *strings);
+
+// pathのアーカイブをmmapし、索引の各項目を表すCachedFileを作っておく関数
+static void open_archive(char *path);
+
+// アーカイブの索引で、urlpathとencodingの組より小さくない最初の項目の位置を返すヘルパー関数
+static uint32_t archive_lower_bound(char *urlpath, int encoding);
+
+// アーカイブからurlpathのencodingで符号化された表現を引く関数。なければNULLを返す
+static struct CachedFile* open_archive_file(char *urlpath, int encoding);
+
+// アーカイブにurlpathの下のファイルがあれば真を返す関数
+static int archive_directory_p(char *urlpath);
+
+// --proxyのPREFIX=ADDRを解釈して転送先の一覧に加える関数
+static void add_proxy_route(char *spec);
+
+// routeの転送先の名前を引いてアドレスを決める関数。アドレスが変わったら使い回し用の接続を捨てる。失敗したらgetaddrinfoのエラーを返す
+static int resolve_proxy_route(struct ProxyRoute *route);
+
+// pathを受け持つ転送先のうちプレフィックスの最も長いものを返す関数。なければNULLを返す
+static struct ProxyRoute* lookup_proxy_route(char *path);
+
+// reqを転送先routeへ送り始める関数。続きはconn->proxyを通してproxy_advanceで進める
+static void do_proxy_response(struct HTTPRequest *req, struct Connection *conn, struct ProxyRoute *route);
+
+// 長さlenのヘッダ名nameが、転送先とクライアントの間で引き継がないホップごとのヘッダなら真を返す関数
+static int proxy_hop_header_p(char *name, size_t len);
+
+// 長さlenのヘッダの値valをカンマで区切ったトークンに、大文字小文字を区別せずtokenと一致するものがあれば真を返す関数
+static int header_token_p(char *val, size_t len, char *token);
+
+// 空いた接続を使い回すか新しく接続するかして、pxに転送先の接続を用意する関数
+static void connect_upstream(struct ProxyExchange *px);
+
+// conn->proxyの転送を進められるだけ進める関数
+// 終われば1を、待つなら待つべきfdと事象をproxyに残して0を、クライアントとの接続を閉じるべきなら-1を返す
+static int proxy_advance(struct Connection *conn);
+
+// 転送の各段階を進める関数。次の段階へ進めば1を返し、ほかはproxy_advanceと同じ
+static int proxy_connect_done(struct Connection *conn, struct ProxyExchange *px);
+static int proxy_send(struct Connection *conn, struct ProxyExchange *px);
+static int proxy_body(struct Connection *conn, struct ProxyExchange *px);
+static int proxy_read_header(struct Connection *conn, struct ProxyExchange *px);
+static int proxy_relay(struct Connection *conn, struct ProxyExchange *px);
+
+// リクエストボディを転送先へ送るoutに積むbody_sink
+static void proxy_body_sink(struct Connection *conn, char *data, size_t len);
+
+// 長さlenの転送先のレスポンスヘッダを解釈し、クライアントへのレスポンスヘッダを書く関数
+// 書けば1を、1xxの途中経過を読み捨てたなら0を、ヘッダが正しくなければ負を返す
+static int proxy_response_header(struct Connection *conn, struct ProxyExchange *px, size_t len);
+
+// 転送先から届いたチャンク形式のボディpのlenバイトを読み進め、最後のチャンクまでに含まれるバイト数を返す関数
+// 形式が正しくなければ-1を返す
+static ssize_t scan_chunked(struct ProxyExchange *px, char *p, size_t len);
+
+// pxにfdのeventsを待つよう記録して0を返す関数
+static int proxy_wait(struct ProxyExchange *px, int fd, short events);
+
+// 転送先とのやりとりの失敗を扱う関数。送り直すか502を返すなら1を、応答の途中なら-1を返す
+static int proxy_upstream_error(struct Connection *conn, struct ProxyExchange *px, char *what);
+
+// 転送を終え、使い回せる転送先の接続を戻してログを書く関数
+static void finish_proxy(struct Connection *conn, struct ProxyExchange *px);
+
+// pxと、まだ持っている転送先の接続を解放する関数
+static void free_proxy_exchange(struct ProxyExchange *px);
+
+// リクエストのAccept-Encodingヘッダから、受け付けられる符号化をビット集合で返す関数
+static int accepted_encodings(struct HTTPRequest *req);
+
+// fileで指し示されるCachedFile構造体インスタンスへの参照を手放し、誰も使わなくなったら閉じて解放する関数
+static void release_cached_file(struct CachedFile *file);
+
+// fileの内容を読み込み、組み立て済みのレスポンスとしてファイルキャッシュに載せる関数
+static void load_file_content(struct CachedFile *file);
+
+// fileの組み立て済みレスポンスのためのメモリを確保してヘッダを書き込み、ヘッダの長さをlenに格納して返すヘルパー関数
+static char* render_response_header(struct CachedFile *file, int *len);
+
+// ヘッダの長さがlenの組み立て済みレスポンスresponseをfileに持たせ、メモリ上のコンテンツのLRUに並べるヘルパー関数
+static void cache_file_content(struct CachedFile *file, char *response, int len);
+
+// fileの表現に関するヘッダ（ETag、Content-Encodingなど）をbufに書き込み、snprintfと同じく長さを返す関数
+static int format_file_header_fields(char *buf, size_t len, struct CachedFile *file);
+
+// format_file_header_fieldsのヘッダと、ヘッダの終わりの空行を接続の出力に積む関数
+static void output_file_header_fields(struct Connection *conn, struct CachedFile *file);
+
+// fileがcache_revalidate秒より前に確かめたものなら、ファイルが変わっていないかstatで確かめる関数
+// 変わっていたら0を返す
+static int revalidate_cached_file(struct CachedFile *file);
+
+// 組み立て済みのレスポンスを持つfileを、そのまま一度のwritevで送れるように断片として積む関数
+static void do_cached_response(struct HTTPRequest *req, struct Connection *conn, struct CachedFile *file);
+
+// fileのn個のバイト範囲rangesを206で、範囲が1つも満たせなければ416で返す関数
+static void do_range_response(struct Connection *conn, struct CachedFile *file, struct ByteRange *ranges, int n);
+
+// fileのoffsetからlenバイトを、メモリに載っていればそこから、なければファイルから送る断片として積む関数
+static void queue_file_range(struct Connection *conn, struct CachedFile *file, off_t offset, off_t len);
+
+// Rangeヘッダの値specを大きさsizeのファイルについて解析し、満たせる範囲をrangesに格納してその数を返す関数
+// 書式が不正だったり範囲が多すぎたりしてRangeヘッダを無視すべきなら-1を返す
+static int parse_range(char *spec, off_t size, struct ByteRange *ranges, int max);
+
+// If-Rangeヘッダがないか、あってfileがその時点から変わっていなければ真を返す関数
+static int if_range_p(struct HTTPRequest *req, struct CachedFile *file);
+
+// If-None-MatchかIf-Modified-Sinceから、クライアントの持つfileがまだ新しいと分かれば真を返す関数
+static int not_modified_p(struct HTTPRequest *req, struct CachedFile *file);
+
+// ボディを持たない304 Not Modifiedのレスポンスを出力する関数
+static void not_modified(struct Connection *conn, struct CachedFile *file);
+
+// カンマ区切りのエンティティタグの並びlistにetagがあれば真を返す関数。weakなら弱い比較をする
+static int etag_match_p(char *list, char *etag, int weak);
+
+// fileのinode、大きさ、mtimeからETagとLast-Modifiedの値を作る関数
+static void set_validators(struct CachedFile *file);
+
+// multipart/byterangesの区切りに使う文字列を返す関数
+static char* multipart_boundary(void);
+
+// 時刻tをHTTPの日付の形式でbufに書き込む関数
+static void format_http_time(char *buf, size_t len, time_t t);
+
+// HTTPの日付の文字列strを解析してtに格納する関数。解析できなければ-1を返す
+static int parse_http_date(char *str, time_t *t);
+
+// 最大max_entries個のファイルを保持するファイルキャッシュを初期化する関数
+static void init_file_cache(long max_entries);
+
+// ファイルキャッシュからpathとencodingに対応するエントリを探すヘルパー関数
+static struct CachedFile* file_cache_lookup(char *path, int encoding, unsigned int hash);
+
+// fileをファイルキャッシュに登録するヘルパー関数
+static void file_cache_insert(struct CachedFile *file);
+
+// fileをファイルキャッシュから取り除くヘルパー関数
+static void file_cache_evict(struct CachedFile *file);
+
+// inotifyで届いたdocroot以下の変更を読み、影響するキャッシュのエントリを捨てる関数
+static void handle_inotify_events(void);
+
+// strのハッシュ値を返すヘルパー関数
+static unsigned int hash_string(char *str);
+
+// infoで指し示されるFileInfo構造体インスタンスを解放するヘルパー関数
+static void free_fileinfo(struct FileInfo *info);
+
+// infoで指し示されるFileInfo構造体インスタンスを元に、そのファイルのコンテンツの種別を返すヘルパー関数
+static char* guess_content_type(struct FileInfo *info);
+
+// コンテンツの種別typeが圧縮する価値のあるものなら真を返すヘルパー関数
+static int compressible_type_p(char *type);
+
+// アクセスログをpathに開く関数。formatは書式の名前
+static void open_access_log(char *path, char *format);
+
+// アクセスログのリングと書き出しスレッドを用意する関数。ワーカーごとにforkの後で呼ぶ
+static void start_access_log(void);
+
+// リングに残った記録を書き終えるまで待ってから書き出しスレッドを止める関数
+static void finish_access_log(void);
+
+// connで応答したリクエストreqをアクセスログのリングに記録する関数。reqがNULLなら解析できなかったリクエスト
+static void log_access(struct HTTPRequest *req, struct Connection *conn);
+
+// connの相手のアドレスをpeer_familyとpeer_addrに一度だけ調べておく関数
+static void lookup_peer_address(struct Connection *conn);
+
+// アクセスログのリングに溜まった記録を整形してまとめて書き出すスレッドの関数
+static void* access_log_writer(void *arg);
+
+// recの1行をbufに整形し、その長さを返す関数。bufにはACCESS_LOG_MAX_LINEバイトの余裕が要る
+static size_t format_access_log(char *buf, struct AccessLogRecord *rec);
+
+// lenバイトのsrcをdstに書式に合わせてエスケープして写し、写した後の位置を返すヘルパー関数
+static char* escape_log_string(char *dst, const char *src, size_t len, int json);
+
+// dstにsrcのlenバイトまでをmaxバイトに切り詰めて写し、写した長さを返すヘルパー関数
+static size_t copy_log_string(char *dst, const char *src, size_t max);
+
+// bufのlenバイト全てをfdに書くヘルパー関数
+static int write_fully(int fd, const char *buf, size_t len);
+
+// ステータス行の雛形からステータスコードを取り出すヘルパー関数
+static int status_code(const char *status);
+
+// n個のワーカーの統計を共有メモリに用意し、このプロセスでは先頭のものに書くようにする関数
+static void init_stats(int n);
+
+// connで応答したリクエストreqを統計に数える関数。reqがNULLなら解析できなかったリクエスト
+static void count_request(struct HTTPRequest *req, struct Connection *conn);
+
+// connのレスポンスを送り終えたときに、送信にかかった時間を統計に記録する関数
+static void record_send_time(struct Connection *conn);
+
+// ヒストグラムhistにマイクロ秒の値usecを記録する関数
+static void record_histogram(struct Histogram *hist, long long usec);
+
+// ヒストグラムの添字idxの範囲の上限（この値は含まない）をマイクロ秒で返すヘルパー関数
+static unsigned long histogram_bucket_limit(int idx);
+
+// 全ワーカーの統計を足し合わせ、Prometheusのテキスト形式で返す関数
+static void do_stats_response(struct HTTPRequest *req, struct Connection *conn);
+
+// 受信バッファがHTTP/2のコネクションプリフェイスで始まるか調べる関数
+// プリフェイスなら1、まだ途中までしか届いていなければ0、違えば-1を返す
+static int h2_preface_p(struct Connection *conn);
+
+// リクエストがh2cへのUpgradeを求めているか調べる関数
+static int h2c_upgrade_p(struct HTTPRequest *req);
+
+// 接続をHTTP/2に切り替える関数。reqがあればUpgradeのリクエストとして101を返し、ストリーム1で応答する
+static void start_h2(struct Connection *conn, struct HTTPRequest *req, char *docroot);
+
+// HTTP/2の接続に届いたフレームを処理し、送れるDATAを積む関数。process_requestsと同じく積んだものがあれば真を返す
+static int process_h2_frames(struct Connection *conn, char *docroot);
+
+// 長い送信の合間にも相手のフレームを読めるよう、待たずに読めるだけ受信バッファに読む関数
+static void h2_poll_input(struct Connection *conn);
+
+// フレームを1つ処理する関数。接続を続けられない誤りならそのエラーコードを、なければ0を返す
+static int h2_handle_frame(struct Connection *conn, int type, int flags, unsigned int id,
+                           unsigned char *p, size_t len, char *docroot);
+
+// ヘッダブロックを読み終えたストリームを始める関数。戻り値はh2_handle_frameと同じ
+static int h2_end_headers(struct Connection *conn, unsigned int id, int end_stream,
+                          unsigned char *block, size_t len, char *docroot);
+
+// SETTINGSの各項目を反映する関数。戻り値はh2_handle_frameと同じ
+static int h2_apply_settings(struct H2Session *h2, unsigned char *p, size_t len);
+
+// ストリームのリクエストに応答し、送るボディがあればストリームを待ち行列に入れる関数
+static void h2_respond(struct Connection *conn, struct H2Stream *st, char *docroot);
+
+// 接続とストリームの出力先を入れ替える関数
+static void swap_h2_output(struct Connection *conn, struct H2Stream *st);
+
+// 出力に積まれたHTTP/1のステータス行とヘッダを取り出す関数。取り出した分は出力から除く
+static char* take_response_header(struct Connection *conn, size_t *len);
+
+// HTTP/1のステータス行とヘッダをHPACKで符号化し、HEADERSとCONTINUATIONで送る関数
+static void h2_output_headers(struct Connection *conn, struct H2Stream *st, char *hdr, size_t len, int end_stream);
+
+// 待ち行列のストリームから順に1フレームずつDATAを積む関数
+static void h2_send_data(struct Connection *conn);
+
+// ストリームのDATAを1フレーム積み、積んだバイト数を返す関数
+static size_t h2_send_frame(struct Connection *conn, struct H2Stream *st, size_t max);
+
+// フレームヘッダを積むヘルパー関数
+static void h2_frame_header(struct Connection *conn, size_t len, int type, int flags, unsigned int id);
+
+// 32ビットの値をネットワークバイトオーダーで積むヘルパー関数
+static void h2_write32(struct Connection *conn, unsigned long v);
+
+// RST_STREAMを積むヘルパー関数
+static void h2_rst_stream(struct Connection *conn, unsigned int id, int code);
+
+// GOAWAYを積み、送り終えたら接続を閉じるようにする関数。codeがH2_NO_ERRORなら残りのストリームを送り終えるまで待つ
+static void h2_goaway(struct Connection *conn, int code);
+
+// WINDOW_UPDATEを積むヘルパー関数
+static void h2_window_update(struct Connection *conn, unsigned int id, unsigned long inc);
+
+// ストリームを作る関数
+static struct H2Stream* new_h2_stream(unsigned int id, long window);
+
+// ストリームと、送り残したボディの断片を解放する関数
+static void free_h2_stream(struct H2Stream *st);
+
+// HTTP/2の接続の状態を解放する関数
+static void free_h2_session(struct H2Session *h2);
+
+// 待ち行列からストリームを探す関数。unlinkが真なら見つけたストリームを待ち行列から外す
+static struct H2Stream* h2_find_stream(struct H2Session *h2, unsigned int id, int unlink);
+
+// ストリームの送り残した断片の先頭を捨てるヘルパー関数
+static void h2_pop_segment(struct H2Stream *st);
+
+// 解いたヘッダフィールドを検査してストリームのリクエストに加える関数
+static void h2_request_field(struct H2Stream *st, const char *name, size_t nlen, const char *value, size_t vlen);
+
+// ストリームのリクエストをHTTP/1の形に組み立てて解析する関数
+static int h2_build_request(struct H2Stream *st);
+
+// HTTP2-Settingsヘッダのbase64urlを解く関数。解いた長さを返し、不正なら-1を返す
+static long base64url_decode(const char *src, unsigned char *dst, size_t max);
+
+// HPACKのヘッダブロックを解き、各フィールドをストリームに加える関数。stがNULLなら表を更新するだけ
+static int hpack_decode(struct H2Session *h2, unsigned char *p, size_t len, struct H2Stream *st);
+
+// HPACKの整数を解くヘルパー関数
+static int hpack_decode_int(unsigned char **p, unsigned char *end, int prefix, size_t *value);
+
+// HPACKの文字列を解くヘルパー関数。ハフマン符号ならh2->scratch[slot]に解く
+static int hpack_decode_string(struct H2Session *h2, int slot, unsigned char **p, unsigned char *end,
+                               char **str, size_t *len);
+
+// ハフマン符号を解く関数
+static int huffman_decode(unsigned char *src, size_t len, char *dst, size_t *outlen);
+
+// huffman_treeを組み立てる関数
+static void build_huffman_tree(void);
+
+// HPACKのインデックスから静的テーブルか動的テーブルの項目を引く関数
+static const struct HpackField* hpack_lookup(struct HpackTable *t, size_t index);
+
+// 動的テーブルに項目を加え、溢れた分を古い項目から捨てる関数
+static void hpack_add(struct HpackTable *t, const char *name, size_t nlen, const char *value, size_t vlen);
+
+// 動的テーブルの大きさの上限を変える関数
+static void hpack_resize(struct HpackTable *t, size_t max);
+
+// 動的テーブルの最も古い項目を捨てるヘルパー関数
+static void hpack_evict(struct HpackTable *t);
+
+// 応答のヘッダフィールドを1つHPACKで符号化する関数。indexが真なら動的テーブルに加える
+static void hpack_encode_field(struct HpackTable *t, char **buf, size_t *len, size_t *cap,
+                               const char *name, size_t nlen, const char *value, size_t vlen, int index);
+
+// HPACKの整数を書くヘルパー関数。flagsは先頭バイトのprefixビットより上に置くビット
+static void hpack_put_int(char **buf, size_t *len, size_t *cap, int prefix, int flags, size_t value);
+
+// HPACKの文字列をハフマン符号を使わずに書くヘルパー関数
+static void hpack_put_string(char **buf, size_t *len, size_t *cap, const char *str, size_t slen);
+
+// bufに書式fmtで追記し、必要ならbufを伸ばすヘルパー関数
+static void buf_printf(char **buf, size_t *len, size_t *cap, char *fmt, ...);
+
+// 単調増加する現在時刻をマイクロ秒で返すヘルパー関数
+static long long current_usec(void);
+
+// メモリ割り当ての成否を確認することを含めたmalloc
+static void* checked_malloc(size_t sz);
+
+// メッセージを出力するヘルパー関数
+static void log_error(char *fmt, ...);
+
+// メッセージを出力するとともに強制終了するヘルパー関数
+static void log_exit(char *fmt, ...);
+
+#define USAGE "Usage: %s [--listen host:port] [--keepalive-timeout SEC] [--max-keepalive-requests N]\n" \
+              "          [--file-cache-entries N] [--content-cache-size BYTES] [--content-cache-max-file BYTES]\n" \
+              "          [--cache-revalidate SEC] [--compress-max-file BYTES] [--workers N] [--cpu-affinity]\n" \
+              "          [--io-uring] [--header-timeout SEC] [--body-timeout SEC] [--write-timeout SEC]\n" \
+              "          [--access-log FILE] [--log-format common|combined|json] [--stats] [--autoindex]\n" \
+              "          [--http2] [--proxy PREFIX=host:port|PREFIX=unix:PATH]... [--proxy-timeout SEC]\n" \
+              "          [--send-quantum BYTES] [--rate-limit BYTES] [--global-rate-limit BYTES] <docroot>\n" \
+              "       %s --pack FILE <docroot>\n" \
+              "       %s [options] --archive FILE\n"
+
+static struct option longopts[] = {
+    {"listen", required_argument, NULL, 'l'},
+    {"keepalive-timeout", required_argument, NULL, 't'},
+    {"header-timeout", required_argument, NULL, 'H'},
+    {"body-timeout", required_argument, NULL, 'B'},
+    {"write-timeout", required_argument, NULL, 'W'},
+    {"max-keepalive-requests", required_argument, NULL, 'r'},
+    {"file-cache-entries", required_argument, NULL, 'c'},
+    {"content-cache-size", required_argument, NULL, 'C'},
+    {"content-cache-max-file", required_argument, NULL, 'F'},
+    {"cache-revalidate", required_argument, NULL, 'V'},
+    {"compress-max-file", required_argument, NULL, 'Z'},
+    {"io-uring", no_argument, NULL, 'u'},
+    {"workers", required_argument, NULL, 'w'},
+    {"cpu-affinity", no_argument, NULL, 'a'},
+    {"access-log", required_argument, NULL, 'L'},
+    {"log-format", required_argument, NULL, 'f'},
+    {"stats", no_argument, NULL, 's'},
+    {"autoindex", no_argument, NULL, 'i'},
+    {"http2", no_argument, NULL, '2'},
+    {"pack", required_argument, NULL, 'P'},
+    {"archive", required_argument, NULL, 'A'},
+    {"proxy", required_argument, NULL, 'p'},
+    {"proxy-timeout", required_argument, NULL, 'T'},
+    {"send-quantum", required_argument, NULL, 'Q'},
+    {"rate-limit", required_argument, NULL, 'R'},
+    {"global-rate-limit", required_argument, NULL, 'G'},
+    {"help", no_argument, NULL, 'h'},
+    {0, 0, 0, 0}
+};
+
+int
+main(int argc, char *argv[])
+{
+    int opt, sock;
+    char *listen_addr = NULL;
+    char *access_log_path = NULL;
+    char *log_format = "common";
+    char *pack_path = NULL;
+    char *archive_path = NULL;
+    char *docroot;
+
+    saved_argv = argv;
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'l':
+                listen_addr = optarg;
+                break;
+            case 't':
+                keepalive_timeout = atoi(optarg);
+                break;
+            case 'H':
+                header_timeout = atoi(optarg);
+                break;
+            case 'B':
+                body_timeout = atoi(optarg);
+                break;
+            case 'W':
+                write_timeout = atoi(optarg);
+                break;
+            case 'r':
+                max_keepalive_requests = atol(optarg);
+                break;
+            case 'c':
+                file_cache_entries = atol(optarg);
+                break;
+            case 'C':
+                content_cache_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'F':
+                content_cache_max_file = atol(optarg);
+                break;
+            case 'V':
+                cache_revalidate = atoi(optarg);
+                break;
+            case 'Z':
+                compress_max_file = atol(optarg);
+                break;
+            case 'u':
+                use_io_uring = 1;
+                break;
+            case 'w':
+                nworkers = atoi(optarg);
+                break;
+            case 'a':
+                cpu_affinity = 1;
+                break;
+            case 'L':
+                access_log_path = optarg;
+                break;
+            case 'f':
+                log_format = optarg;
+                break;
+            case 's':
+                stats_enabled = 1;
+                break;
+            case 'i':
+                autoindex = 1;
+                break;
+            case '2':
+                http2_enabled = 1;
+                break;
+            case 'P':
+                pack_path = optarg;
+                break;
+            case 'A':
+                archive_path = optarg;
+                break;
+            case 'p':
+                add_proxy_route(optarg);
+                break;
+            case 'T':
+                proxy_timeout = atoi(optarg);
+                break;
+            case 'Q':
+                send_quantum = strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                conn_rate_limit = atoll(optarg);
+                break;
+            case 'G':
+                global_rate_limit = atoll(optarg);
+                break;
+            case 'h':
+                fprintf(stdout, USAGE, argv[0], argv[0], argv[0]);
+                exit(0);
+            case '?':
+                fprintf(stderr, USAGE, argv[0], argv[0], argv[0]);
+                exit(1);
+        }
+    }
+    // アーカイブから送るときはdocrootを取らない
+    if (optind != argc - (archive_path ? 0 : 1) || (pack_path && archive_path)) {
+        fprintf(stderr, USAGE, argv[0], argv[0], argv[0]);
+        exit(1);
+    }
+    docroot = archive_path ? archive_path : argv[optind];
+    if (pack_path) {
+        init_stats(1);
+        open_docroot(docroot);
+        pack_docroot(docroot, pack_path);
+        exit(0);
+    }
+    install_signal_handlers();
+    init_error_responses();
+    init_timer_wheel();
+    if (archive_path) {
+        open_archive(archive_path);
+    } else {
+        open_docroot(docroot);
+    }
+    if (access_log_path) {
+        open_access_log(access_log_path, log_format);
+    }
+    if (listen_addr) {
+        if (nworkers < 0) {
+            nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        // 統計はforkの前に共有メモリに置き、全ワーカーから読めるようにする
+        init_stats(nworkers > 0 ? nworkers : 1);
+        global_rate.rate = global_rate_limit / (nworkers > 0 ? nworkers : 1);
+        if (nworkers > 0) {
+            master_main(listen_addr, docroot);
+        } else {
+            sock = inherited_socket();
+            close_inherited_sockets();
+            server_main(sock >= 0 ? sock : listen_socket(listen_addr, 0), docroot);
+        }
+    } else {
+        init_stats(1);
+        global_rate.rate = global_rate_limit;
+        service(STDIN_FILENO, STDOUT_FILENO, docroot);
+    }
+    exit(0);
+}
+
+static void
+install_signal_handlers(void)
+{
+    trap_signal(SIGPIPE, signal_exit);
+}
+
+static void
+trap_signal(int sig, sighandler_t handler)
+{
+    struct sigaction act;
+    act.sa_handler = handler;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART;
+    if(sigaction(sig, &act, NULL) < 0) {
+        log_exit("sigaction() failded: %s", strerror(errno));
+    }
+}
+
+static void
+signal_exit(int sig)
+{
+    log_exit("exit by signal %d", sig);
+}
+
+static void
+service(int infd, int outfd, char *docroot)
+{
+    struct Connection *conn;
+    struct pollfd pfd;
+    int ret;
+
+    conn = new_connection(infd, outfd);
+    for (;;) {
+        while (!process_requests(conn, docroot)) {
+            if (conn->eof) {
+                goto out;
+            }
+            // タイマーホイールは回さず、接続のタイマーの期限までをpollの待ち時間に使う
+            update_connection_timer(conn);
+            pfd.fd = infd;
+            pfd.events = POLLIN;
+            ret = poll(&pfd, 1, timer_remaining(&conn->timer));
+            if (ret < 0 && errno != EINTR) {
+                log_exit("poll(2) failed: %s", strerror(errno));
+            }
+            if (ret == 0) {
+                goto out;
+            }
+            if (fill_connection(conn) < 0) {
+                log_exit("failed to read request: %s", strerror(errno));
+            }
+        }
+        while (conn->proxy && (ret = proxy_advance(conn)) == 0) {
+            update_connection_timer(conn);
+            pfd.fd = conn->proxy->wait_fd;
+            pfd.events = conn->proxy->wait_events;
+            ret = poll(&pfd, 1, timer_remaining(&conn->timer));
+            if (ret < 0 && errno != EINTR) {
+                log_exit("poll(2) failed: %s", strerror(errno));
+            }
+            if (ret == 0 && !conn->throttled) {
+                goto out;
+            }
+        }
+        if (conn->proxy) {
+            goto out;
+        }
+        while ((ret = flush_connection(conn)) == 0) {
+            // 帯域の上限なら再開の時刻まで眠り、順番を譲っただけなら書けるようになるのを待って続ける
+            pfd.fd = outfd;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, conn->throttled ? 0 : 1, conn->throttled ? timer_remaining(&conn->timer) : -1) < 0
+                && errno != EINTR) {
+                log_exit("poll(2) failed: %s", strerror(errno));
+            }
+        }
+        if (ret < 0) {
+            log_exit("failed to write response: %s", strerror(errno));
+        }
+        record_send_time(conn);
+        if (!conn->keep_alive) {
+            break;
+        }
+    }
+out:
+    free_connection(conn);
+}
+
+static int
+listen_socket(char *addr, int reuseport)
+{
+    struct addrinfo hints, *res, *ai;
+    char *buf, *host, *port;
+    int err, sock, on = 1;
+
+    buf = checked_malloc(strlen(addr) + 1);
+    strcpy(buf, addr);
+    if (split_host_port(buf, &host, &port) < 0) {
+        log_exit("listen address must be host:port: %s", addr);
+    }
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((err = getaddrinfo((*host && strcmp(host, "*") != 0) ? host : NULL, port, &hints, &res)) != 0) {
+        log_exit("getaddrinfo(3) failed: %s", gai_strerror(err));
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (sock < 0) {
+            continue;
+        }
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            log_exit("setsockopt(SO_REUSEPORT) failed: %s", strerror(errno));
+        }
+        if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(sock);
+            continue;
+        }
+        if (listen(sock, MAX_BACKLOG) < 0) {
+            close(sock);
+            continue;
+        }
+        freeaddrinfo(res);
+        free(buf);
+        return sock;
+    }
+    log_exit("failed to listen on %s", addr);
+    return -1;
+}
+
+static int
+split_host_port(char *buf, char **host, char **port)
+{
+    char *p;
+
+    p = strrchr(buf, ':');
+    if (!p) {
+        return -1;
+    }
+    *p = '\0';
+    *port = p + 1;
+    *host = buf;
+    if (buf[0] == '[' && p > buf + 1 && p[-1] == ']') {
+        p[-1] = '\0';
+        (*host)++;
+    }
+    return 0;
+}
+
+static void
+master_main(char *addr, char *docroot)
+{
+    time_t *started;
+    sigset_t set;
+    pid_t pid;
+    int *socks, status, quitting = 0, nalive, i;
+
+    // ソケットはマスターが持ち続ける。ワーカーが死んでも、そのソケットに溜まった接続は次のワーカーが引き継ぐ
+    socks = checked_malloc(sizeof(int) * nworkers);
+    worker_pids = checked_malloc(sizeof(pid_t) * nworkers);
+    started = checked_malloc(sizeof(time_t) * nworkers);
+    for (i = 0; i < nworkers; i++) {
+        // 前のバイナリから引き継いだソケットがあればそれを使い、溜まっている接続を失わないようにする
+        socks[i] = inherited_socket();
+        if (socks[i] < 0) {
+            socks[i] = listen_socket(addr, 1);
+        }
+        worker_pids[i] = -1;
+    }
+    close_inherited_sockets();
+    trap_signal(SIGTERM, terminate_workers);
+    trap_signal(SIGINT, terminate_workers);
+    // 残りのシグナルはsigwaitinfoで順に受け取る。ワーカーと新しいバイナリではwait_maskに戻す
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &set, &wait_mask);
+    for (i = 0; i < nworkers; i++) {
+        started[i] = time(NULL);
+        worker_pids[i] = spawn_worker(i, socks, docroot);
+    }
+    for (;;) {
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i < nworkers; i++) {
+                if (worker_pids[i] == pid) {
+                    break;
+                }
+            }
+            if (i == nworkers) {
+                // SIGUSR2で起動した新しいバイナリが終わった
+                log_error("process %d exited with status %d", (int)pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+                continue;
+            }
+            worker_pids[i] = -1;
+            if (WIFSIGNALED(status)) {
+                log_error("worker %d (pid %d) killed by signal %d", i, (int)pid, WTERMSIG(status));
+            } else if (!quitting) {
+                log_error("worker %d (pid %d) exited with status %d", i, (int)pid, WEXITSTATUS(status));
+            }
+            if (quitting) {
+                continue;
+            }
+            // 起動してすぐ死に続けるワーカーを休みなく起動し直さないようにする
+            if (time(NULL) - started[i] < 1) {
+                sleep(1);
+            }
+            started[i] = time(NULL);
+            worker_pids[i] = spawn_worker(i, socks, docroot);
+        }
+        if (quitting) {
+            for (i = nalive = 0; i < nworkers; i++) {
+                nalive += worker_pids[i] > 0;
+            }
+            if (nalive == 0) {
+                exit(0);
+            }
+        }
+        switch (sigwaitinfo(&set, NULL)) {
+            case SIGQUIT:
+                if (quitting) {
+                    break;
+                }
+                // マスターが閉じても、ソケットはワーカーが受け付けをやめるまで開いている。新しいバイナリが持っていればそちらが受け付け続ける
+                quitting = 1;
+                for (i = 0; i < nworkers; i++) {
+                    close(socks[i]);
+                    if (worker_pids[i] > 0) {
+                        kill(worker_pids[i], SIGQUIT);
+                    }
+                }
+                break;
+            case SIGHUP:
+                // 起動し直すワーカーのためにマスターでも開き直してから、各ワーカーに伝える
+                reload_config(docroot);
+                for (i = 0; i < nworkers; i++) {
+                    if (worker_pids[i] > 0) {
+                        kill(worker_pids[i], SIGHUP);
+                    }
+                }
+                break;
+            case SIGUSR2:
+                if (!quitting) {
+                    exec_new_binary(socks, nworkers);
+                }
+                break;
+        }
+    }
+}
+
+static pid_t
+spawn_worker(int id, int *socks, char *docroot)
+{
+    pid_t pid, master;
+    int i;
+
+    master = getpid();
+    pid = fork();
+    if (pid < 0) {
+        log_error("fork(2) failed: %s", strerror(errno));
+        return -1;
+    }
+    if (pid > 0) {
+        return pid;
+    }
+    // マスターが先にいなくなったらワーカーも終わる
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != master) {
+        exit(1);
+    }
+    trap_signal(SIGTERM, SIG_DFL);
+    trap_signal(SIGINT, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+    // 前のワーカーが死んでいれば、その接続はもう開いていない
+    stats = &all_stats[id];
+    stats->open_connections = 0;
+    for (i = 0; i < nworkers; i++) {
+        if (i != id) {
+            close(socks[i]);
+        }
+    }
+    if (cpu_affinity) {
+        pin_worker(id);
+    }
+    server_main(socks[id], docroot);
+    exit(0);
+}
+
+static void
+pin_worker(int id)
+{
+    cpu_set_t allowed, set;
+    int cpu, n, count;
+
+    if (sched_getaffinity(0, sizeof allowed, &allowed) < 0) {
+        log_error("sched_getaffinity(2) failed: %s", strerror(errno));
+        return;
+    }
+    count = CPU_COUNT(&allowed);
+    n = id % count;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+            break;
+        }
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof set, &set) < 0) {
+        log_error("sched_setaffinity(2) failed: %s", strerror(errno));
+    }
+}
+
+static void
+terminate_workers(int sig)
+{
+    int i;
+
+    (void)sig;
+    for (i = 0; i < nworkers; i++) {
+        if (worker_pids[i] > 0) {
+            kill(worker_pids[i], SIGTERM);
+        }
+    }
+    _exit(0);
+}
+
+static void
+record_signal(int sig)
+{
+    if (sig == SIGQUIT) {
+        quit_requested = 1;
+    } else if (sig == SIGHUP) {
+        reload_requested = 1;
+    } else if (sig == SIGUSR2) {
+        upgrade_requested = 1;
+    }
+}
+
+static int
+check_server_signals(int server_fd, char *docroot)
+{
+    if (reload_requested) {
+        reload_requested = 0;
+        reload_config(docroot);
+    }
+    if (upgrade_requested) {
+        upgrade_requested = 0;
+        if (!draining) {
+            exec_new_binary(&server_fd, 1);
+        }
+    }
+    if (quit_requested && !draining) {
+        log_error("draining %ld connections", stats->open_connections);
+        draining = 1;
+        close_idle_connections();
+        return 1;
+    }
+    return 0;
+}
+
+static pid_t
+exec_new_binary(int *socks, int n)
+{
+    extern char **environ;
+    char **envp, *var, *p;
+    pid_t pid;
+    int i, j;
+
+    // 待ち受けソケットのfdの番号を環境変数で渡す。前の起動で渡されたものは除いておく
+    var = checked_malloc(strlen(LISTEN_FDS_ENV) + 2 + (size_t)n * 12);
+    p = var + sprintf(var, "%s=", LISTEN_FDS_ENV);
+    for (i = 0; i < n; i++) {
+        p += sprintf(p, i > 0 ? ",%d" : "%d", socks[i]);
+    }
+    for (i = 0; environ[i]; i++)
+        ;
+    envp = checked_malloc(sizeof(char*) * (i + 2));
+    for (i = j = 0; environ[i]; i++) {
+        if (strncmp(environ[i], LISTEN_FDS_ENV "=", strlen(LISTEN_FDS_ENV) + 1) != 0) {
+            envp[j++] = environ[i];
+        }
+    }
+    envp[j++] = var;
+    envp[j] = NULL;
+    pid = fork();
+    if (pid == 0) {
+        // 待ち受けソケットだけはexecの後も開いたままにする
+        for (i = 0; i < n; i++) {
+            fcntl(socks[i], F_SETFD, 0);
+        }
+        sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+        execvpe(saved_argv[0], saved_argv, envp);
+        log_error("failed to exec %s: %s", saved_argv[0], strerror(errno));
+        _exit(1);
+    }
+    if (pid < 0) {
+        log_error("fork(2) failed: %s", strerror(errno));
+    } else {
+        log_error("started %s (pid %d) with %d listening sockets", saved_argv[0], (int)pid, n);
+    }
+    free(envp);
+    free(var);
+    return pid;
+}
+
+static int
+inherited_socket(void)
+{
+    char *p, *env;
+    int fd, on = 0;
+    socklen_t len = sizeof on;
+
+    if (!inherited_fds) {
+        // 最初に呼ばれたときに環境変数を写し取り、ワーカーや次のバイナリに残らないよう消しておく
+        env = getenv(LISTEN_FDS_ENV);
+        if (!env) {
+            return -1;
+        }
+        inherited_fds = checked_malloc(strlen(env) + 1);
+        strcpy(inherited_fds, env);
+        unsetenv(LISTEN_FDS_ENV);
+    }
+    while (*inherited_fds) {
+        fd = strtol(inherited_fds, &p, 10);
+        if (p == inherited_fds) {
+            log_error("invalid %s: %s", LISTEN_FDS_ENV, inherited_fds);
+            *inherited_fds = '\0';
+            break;
+        }
+        inherited_fds = p + (*p == ',');
+        // 待ち受けているソケットでなければ使わない
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) < 0 || !on) {
+            log_error("fd %d is not a listening socket", fd);
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        return fd;
+    }
+    return -1;
+}
+
+static void
+close_inherited_sockets(void)
+{
+    int fd;
+
+    // ワーカーを減らして起動し直したときは、余ったソケットに溜まった接続は前のバイナリが終わるときに捨てられる
+    while ((fd = inherited_socket()) >= 0) {
+        close(fd);
+    }
+}
+
+static void
+reload_config(char *docroot)
+{
+    struct stat old, cur;
+    int fd, err, i;
+
+    // 書き出しスレッドが使っているfdの番号のまま、回転させたログのファイルへ差し替える
+    if (access_log.fd >= 0) {
+        fd = open(access_log.path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            log_error("failed to open %s: %s", access_log.path, strerror(errno));
+        } else {
+            dup3(fd, access_log.fd, O_CLOEXEC);
+            close(fd);
+        }
+    }
+    // シンボリックリンクの付け替えなどでdocrootが別のディレクトリになっていれば、開き直してキャッシュを捨てる
+    // アーカイブは作り直したらSIGUSR2で入れ替える
+    if (!archive.map) {
+        fd = open(docroot, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            log_error("failed to open %s: %s", docroot, strerror(errno));
+        } else if (fstat(fd, &cur) == 0 && fstat(docroot_fd, &old) == 0
+                   && cur.st_dev == old.st_dev && cur.st_ino == old.st_ino) {
+            close(fd);
+        } else {
+            dup3(fd, docroot_fd, O_CLOEXEC);
+            close(fd);
+            flush_dir_cache();
+            while (file_cache.lru_tail) {
+                file_cache_evict(file_cache.lru_tail);
+            }
+        }
+    }
+    for (i = 0; i < nproxy_routes; i++) {
+        if (proxy_routes[i].addr.ss_family != AF_UNIX && (err = resolve_proxy_route(&proxy_routes[i])) != 0) {
+            log_error("getaddrinfo(3) failed for %s: %s", proxy_routes[i].name, gai_strerror(err));
+        }
+    }
+}
+
+static void
+server_main(int server_fd, char *docroot)
+{
+    struct epoll_event ev, events[MAX_EPOLL_EVENTS];
+    struct Connection *conn;
+    sigset_t set;
+    int epfd, n, i, timeout;
+
+    // 切断されたソケットへの書き込みで全接続を道連れにしないよう、SIGPIPEは無視してEPIPEで扱う
+    trap_signal(SIGPIPE, SIG_IGN);
+    trap_signal(SIGQUIT, record_signal);
+    trap_signal(SIGHUP, record_signal);
+    // ワーカーのときはバイナリの入れ替えはマスターが行う
+    trap_signal(SIGUSR2, nworkers > 0 ? SIG_IGN : record_signal);
+    sigemptyset(&set);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &set, &wait_mask);
+    start_access_log();
+    if (use_io_uring && uring_server_main(server_fd, docroot) < 0) {
+        log_error("io_uring is not available, falling back to epoll");
+    }
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        log_exit("epoll_create1(2) failed: %s", strerror(errno));
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+        log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+    }
+    init_file_cache(file_cache_entries);
+    if (file_cache.inotify_fd >= 0) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &file_cache;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, file_cache.inotify_fd, &ev) < 0) {
+            log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+        }
+    }
+    for (;;) {
+        if (check_server_signals(server_fd, docroot)) {
+            // 受け付けをやめる。同じソケットを持つ新しいバイナリがいれば、溜まった接続はそちらが受け付ける
+            epoll_ctl(epfd, EPOLL_CTL_DEL, server_fd, NULL);
+            close(server_fd);
+        }
+        timeout = run_timers();
+        while ((conn = pop_ready_connection()) != NULL) {
+            // 帯域の上限で止めていた接続の送信を続ける。続けた後のタイマーで待ち時間を計り直す
+            handle_connection_event(epfd, conn, docroot);
+            timeout = 0;
+        }
+        // 最後の接続はタイマーで閉じることが多いので、待つ前に確かめる
+        if (draining && stats->open_connections == 0) {
+            finish_access_log();
+            exit(0);
+        }
+        n = epoll_pwait(epfd, events, MAX_EPOLL_EVENTS, timeout, &wait_mask);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_exit("epoll_wait(2) failed: %s", strerror(errno));
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_connections(epfd, server_fd);
+            } else if (events[i].data.ptr == &file_cache) {
+                handle_inotify_events();
+            } else {
+                handle_connection_event(epfd, (struct Connection*)(events[i].data.u64 & ~EPOLL_UPSTREAM), docroot);
+            }
+        }
+    }
+}
+
+static void
+accept_connections(int epfd, int server_fd)
+{
+    struct Connection *conn;
+    struct epoll_event ev;
+    int sock;
+
+    for (;;) {
+        sock = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_error("accept4(2) failed: %s", strerror(errno));
+            }
+            return;
+        }
+        conn = new_connection(sock, sock);
+        conn->events = ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+            log_error("epoll_ctl(2) failed: %s", strerror(errno));
+            free_connection(conn);
+            continue;
+        }
+        update_connection_timer(conn);
+    }
+}
+
+static void
+handle_connection_event(int epfd, struct Connection *conn, char *docroot)
+{
+    int ret;
+
+    if (conn->state == CONN_READING) {
+        ret = fill_connection(conn);
+        if (ret < 0) {
+            free_connection(conn);
+            return;
+        }
+        if (ret == 0) {
+            conn->eof = 1;
+        }
+    }
+    for (;;) {
+        if (conn->state == CONN_READING) {
+            if (!process_requests(conn, docroot)) {
+                if (conn->eof) {
+                    free_connection(conn);
+                } else {
+                    watch_connection(epfd, conn, EPOLLIN);
+                    update_connection_timer(conn);
+                }
+                return;
+            }
+            conn->state = CONN_WRITING;
+        }
+        if (conn->proxy) {
+            ret = proxy_advance(conn);
+            if (ret == 0) {
+                watch_proxy(epfd, conn);
+                update_connection_timer(conn);
+                return;
+            }
+            if (ret < 0) {
+                free_connection(conn);
+                return;
+            }
+        }
+        ret = flush_connection(conn);
+        if (ret == 0) {
+            // 帯域の上限で止めた接続は書けても送らないので、再開するまで監視から外す
+            watch_connection(epfd, conn, conn->throttled ? 0 : EPOLLOUT);
+            update_connection_timer(conn);
+            return;
+        }
+        if (ret > 0) {
+            record_send_time(conn);
+        }
+        if (ret < 0 || !conn->keep_alive) {
+            free_connection(conn);
+            return;
+        }
+        // 先に届いていたパイプライン化されたリクエストがあれば続けて処理する
+        conn->state = CONN_READING;
+    }
+}
+
+static void
+watch_connection(int epfd, struct Connection *conn, uint32_t events)
+{
+    struct epoll_event ev;
+    if (conn->events == events) {
+        return;
+    }
+    ev.events = events;
+    ev.data.ptr = conn;
+    // eventsが0なら監視から外す。転送先を待つ間や帯域の上限で止めている間は外しておき、また登録し直す
+    if (epoll_ctl(epfd, !events ? EPOLL_CTL_DEL : conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+        log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+    }
+    conn->events = events;
+}
+
+static void
+watch_proxy(int epfd, struct Connection *conn)
+{
+    struct ProxyExchange *px = conn->proxy;
+    struct epoll_event ev;
+
+    if (px->wait_fd == conn->fd) {
+        watch_connection(epfd, conn, px->wait_events == POLLIN ? EPOLLIN : EPOLLOUT);
+        return;
+    }
+    // 1つの接続の事象が同じepoll_waitの結果に2つ並ばないよう、転送先を待つ間はクライアントを外しておく
+    watch_connection(epfd, conn, 0);
+    if (px->wait_fd < 0) {
+        // 帯域の上限で止めている。再開のタイマーで続ける
+        return;
+    }
+    // 転送先の接続は他の接続に使い回されるので、一度知らせたら止まるようにしておく
+    ev.events = (px->wait_events == POLLIN ? EPOLLIN : EPOLLOUT) | EPOLLONESHOT;
+    ev.data.u64 = (unsigned long)conn | EPOLL_UPSTREAM;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, px->wait_fd, &ev) < 0
+        && (errno != ENOENT || epoll_ctl(epfd, EPOLL_CTL_ADD, px->wait_fd, &ev) < 0)) {
+        log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+    }
+}
+
+static int
+uring_server_main(int server_fd, char *docroot)
+{
+    struct Connection *conn;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    int timeout;
+
+    if (uring_setup() < 0) {
+        return -1;
+    }
+    init_file_cache(file_cache_entries);
+    if (file_cache.inotify_fd >= 0) {
+        sqe = uring_get_sqe(UOP_INOTIFY, NULL);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = file_cache.inotify_fd;
+        sqe->poll32_events = POLLIN;
+    }
+    uring_update_file(server_fd, server_fd);
+    sqe = uring_get_sqe(UOP_ACCEPT, NULL);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server_fd;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    for (;;) {
+        if (check_server_signals(server_fd, docroot)) {
+            // 受け付けの待ちを取り消してから、待ち受けソケットを手放す
+            sqe = uring_get_sqe(UOP_CANCEL, NULL);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = UOP_ACCEPT;
+            uring_update_file(server_fd, -1);
+            close(server_fd);
+        }
+        timeout = run_timers();
+        while ((conn = pop_ready_connection()) != NULL) {
+            uring_advance(conn, docroot);
+            timeout = 0;
+        }
+        if (draining && stats->open_connections == 0) {
+            finish_access_log();
+            exit(0);
+        }
+        if (timeout >= 0 && !ring.timeout_armed) {
+            ring.timeout.tv_sec = timeout / 1000;
+            ring.timeout.tv_nsec = (timeout % 1000) * 1000000LL;
+            sqe = uring_get_sqe(UOP_TIMEOUT, NULL);
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->fd = -1;
+            sqe->addr = (unsigned long)&ring.timeout;
+            sqe->len = 1;
+            ring.timeout_armed = 1;
+            ring.timeout_deadline = current_msec() + timeout;
+        } else if (timeout >= 0 && current_msec() + timeout + TIMER_TICK_MSEC <= ring.timeout_deadline) {
+            // 仕掛けたものより短いタイムアウトの接続が増えたら、仕掛けたタイマーの期限を早める
+            ring.timeout.tv_sec = timeout / 1000;
+            ring.timeout.tv_nsec = (timeout % 1000) * 1000000LL;
+            sqe = uring_get_sqe(UOP_TIMEOUT_UPDATE, NULL);
+            sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = UOP_TIMEOUT;
+            sqe->addr2 = (unsigned long)&ring.timeout;
+            sqe->timeout_flags = IORING_TIMEOUT_UPDATE;
+            ring.timeout_deadline = current_msec() + timeout;
+        }
+        // 前の周回で積まれた全接続のSQEを一度のio_uring_enterで渡し、完了をまとめて受け取る
+        if (uring_enter(1) < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            log_exit("io_uring_enter(2) failed: %s", strerror(errno));
+        }
+        head = *ring.cq_head;
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            uring_handle_cqe(cqe, server_fd, docroot);
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+            tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+}
+
+static int
+uring_setup(void)
+{
+    struct io_uring_params p;
+    struct iovec iov;
+    struct rlimit rl;
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+    int *fds, i;
+
+    memset(&p, 0, sizeof p);
+    ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ring.fd < 0) {
+        log_error("io_uring_setup(2) failed: %s", strerror(errno));
+        return -1;
+    }
+    // 古いカーネルではソケットへの操作がスレッドプールに回ってしまうので使わない
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)
+        || !(p.features & IORING_FEAT_FAST_POLL)) {
+        log_error("io_uring lacks required features");
+        close(ring.fd);
+        ring.fd = -1;
+        return -1;
+    }
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > sq_size) {
+        sq_size = cq_size;
+    }
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        log_exit("mmap(2) failed: %s", strerror(errno));
+    }
+    cq = sq;
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        log_exit("mmap(2) failed: %s", strerror(errno));
+    }
+    ring.sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+    ring.sqe_tail = *ring.sq_tail;
+    ring.cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // ソケットのfdをそのまま番号に使うので、開けるfdの数だけの空の表を登録しておく
+    ring.nfiles = URING_MAX_FILES;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)ring.nfiles) {
+        ring.nfiles = rl.rlim_cur;
+    }
+    fds = checked_malloc(sizeof(int) * ring.nfiles);
+    for (i = 0; i < ring.nfiles; i++) {
+        fds[i] = -1;
+    }
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, fds, ring.nfiles) < 0) {
+        log_error("failed to register files with io_uring: %s", strerror(errno));
+        free(fds);
+        close(ring.fd);
+        ring.fd = -1;
+        return -1;
+    }
+    free(fds);
+
+    // 登録済みバッファはページを固定するので、RLIMIT_MEMLOCKに収まらなければ普通のrecvで読む
+    ring.buf = mmap(NULL, URING_BUF_SLOTS * INITIAL_BUF_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.buf == MAP_FAILED) {
+        log_exit("mmap(2) failed: %s", strerror(errno));
+    }
+    iov.iov_base = ring.buf;
+    iov.iov_len = URING_BUF_SLOTS * INITIAL_BUF_SIZE;
+    ring.free_slots = checked_malloc(sizeof(int) * URING_BUF_SLOTS);
+    ring.nfree_slots = 0;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0) {
+        for (i = URING_BUF_SLOTS - 1; i >= 0; i--) {
+            ring.free_slots[ring.nfree_slots++] = i;
+        }
+    } else {
+        log_error("failed to register buffers with io_uring: %s", strerror(errno));
+    }
+    ring.timeout_armed = 0;
+    return 0;
+}
+
+static struct io_uring_sqe*
+uring_get_sqe(int op, void *data)
+{
+    struct io_uring_sqe *sqe;
+
+    if (ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.sq_entries) {
+        if (uring_enter(0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            log_exit("io_uring_enter(2) failed: %s", strerror(errno));
+        }
+    }
+    sqe = &ring.sqes[ring.sqe_tail & *ring.sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->user_data = (unsigned long)data | op;
+    ring.sq_array[ring.sqe_tail & *ring.sq_mask] = ring.sqe_tail & *ring.sq_mask;
+    ring.sqe_tail++;
+    return sqe;
+}
+
+static int
+uring_enter(unsigned wait_nr)
+{
+    unsigned n;
+    int ret;
+
+    n = ring.sqe_tail - *ring.sq_tail;
+    __atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+    if (n == 0 && wait_nr == 0) {
+        return 0;
+    }
+    // 待つ間だけwait_maskでシグナルを受ける
+    ret = syscall(__NR_io_uring_enter, ring.fd, n, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0,
+                  wait_nr ? &wait_mask : NULL, _NSIG / 8);
+    return ret < 0 ? -1 : 0;
+}
+
+static int
+uring_update_file(int index, int fd)
+{
+    struct io_uring_files_update up;
+
+    if (index >= ring.nfiles) {
+        return -1;
+    }
+    memset(&up, 0, sizeof up);
+    up.offset = index;
+    up.fds = (unsigned long)&fd;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES_UPDATE, &up, 1) < 0) {
+        log_error("failed to update io_uring files: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void
+uring_handle_cqe(struct io_uring_cqe *cqe, int server_fd, char *docroot)
+{
+    struct Connection *conn;
+    struct OutputSegment *seg;
+    struct io_uring_sqe *sqe;
+    int op, res;
+
+    op = cqe->user_data & UOP_MASK;
+    conn = (struct Connection*)(unsigned long)(cqe->user_data & ~(unsigned long long)UOP_MASK);
+    res = cqe->res;
+    switch (op) {
+        case UOP_ACCEPT:
+            if (res >= 0) {
+                conn = new_connection(res, res);
+                if (uring_update_file(res, res) == 0) {
+                    conn->fixed = 1;
+                }
+                if (ring.nfree_slots > 0) {
+                    // 最初の受信は登録済みバッファのスロットに読む
+                    conn->islot = ring.free_slots[--ring.nfree_slots];
+                    free(conn->ibuf);
+                    conn->ibuf = ring.buf + (size_t)conn->islot * INITIAL_BUF_SIZE;
+                    conn->icap = INITIAL_BUF_SIZE;
+                }
+                uring_prep_recv(conn);
+                update_connection_timer(conn);
+            } else if (res != -EINTR && res != -EAGAIN && res != -ECONNABORTED && res != -ECANCELED) {
+                log_error("accept failed: %s", strerror(-res));
+            }
+            if (draining) {
+                return;
+            }
+            sqe = uring_get_sqe(UOP_ACCEPT, NULL);
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = server_fd;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            return;
+        case UOP_INOTIFY:
+            handle_inotify_events();
+            sqe = uring_get_sqe(UOP_INOTIFY, NULL);
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = file_cache.inotify_fd;
+            sqe->poll32_events = POLLIN;
+            return;
+        case UOP_TIMEOUT:
+            ring.timeout_armed = 0;
+            return;
+        case UOP_TIMEOUT_UPDATE:
+            // 更新する前に期限が来ていれば-ENOENTになるが、次の周回で仕掛け直すので構わない
+            return;
+        case UOP_CANCEL:
+            return;
+    }
+    conn->inflight--;
+    if (conn->closing) {
+        if (conn->inflight == 0) {
+            free_connection(conn);
+        }
+        return;
+    }
+    switch (op) {
+        case UOP_RECV:
+            if (res < 0) {
+                conn->uerror = 1;
+            } else if (res == 0) {
+                conn->eof = 1;
+            } else {
+                conn->ilen += res;
+            }
+            break;
+        case UOP_SEND:
+            if (res < 0) {
+                conn->uerror = 1;
+            } else {
+                consume_memory_segments(conn, res);
+            }
+            break;
+        case UOP_SPLICE_IN:
+            // 送信中にファイルが縮んで0が返った場合も、Content-Lengthを守れないので接続ごと諦める
+            if (res <= 0) {
+                conn->uerror = 1;
+            } else {
+                seg = &conn->segs[conn->seghead];
+                seg->offset += res;
+                seg->len -= res;
+                conn->piped += res;
+                account_sent(conn, res);
+            }
+            break;
+        case UOP_SPLICE_OUT:
+            // パイプへの読み込みが足りずに連鎖が切れたときは-ECANCELEDで返る。残りは次に送る
+            if (res < 0 && res != -ECANCELED) {
+                conn->uerror = 1;
+            } else if (res > 0) {
+                conn->piped -= res;
+            }
+            break;
+        case UOP_PROXY:
+            // 切断などもreventsで返るので、続きを進めたときの読み書きで気づく
+            if (res < 0) {
+                conn->uerror = 1;
+            }
+            break;
+    }
+    if (conn->inflight > 0) {
+        return;
+    }
+    if (conn->uerror) {
+        close_connection(conn);
+        return;
+    }
+    uring_advance(conn, docroot);
+}
+
+static void
+uring_advance(struct Connection *conn, char *docroot)
+{
+    int ret;
+
+    for (;;) {
+        if (conn->state == CONN_READING) {
+            if (!process_requests(conn, docroot)) {
+                if (conn->eof) {
+                    close_connection(conn);
+                } else {
+                    uring_prep_recv(conn);
+                    update_connection_timer(conn);
+                }
+                return;
+            }
+            conn->state = CONN_WRITING;
+        }
+        if (conn->proxy) {
+            ret = proxy_advance(conn);
+            if (ret == 0) {
+                uring_prep_poll(conn);
+                update_connection_timer(conn);
+                return;
+            }
+            if (ret < 0) {
+                close_connection(conn);
+                return;
+            }
+        }
+        ret = uring_prep_send(conn);
+        if (ret > 0) {
+            update_connection_timer(conn);
+            return;
+        }
+        if (ret == 0) {
+            record_send_time(conn);
+        }
+        if (ret < 0 || !conn->keep_alive) {
+            close_connection(conn);
+            return;
+        }
+        // 先に届いていたパイプライン化されたリクエストがあれば続けて処理する
+        conn->state = CONN_READING;
+    }
+}
+
+static void
+uring_prep_recv(struct Connection *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    reserve_input(conn);
+    sqe = uring_get_sqe(UOP_RECV, conn);
+    if (conn->islot >= 0) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->off = -1;
+        sqe->buf_index = 0;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+    }
+    sqe->fd = conn->fd;
+    sqe->flags = conn->fixed ? IOSQE_FIXED_FILE : 0;
+    sqe->addr = (unsigned long)(conn->ibuf + conn->ilen);
+    sqe->len = conn->icap - conn->ilen;
+    conn->inflight++;
+}
+
+static void
+uring_prep_poll(struct Connection *conn)
+{
+    struct ProxyExchange *px = conn->proxy;
+    struct io_uring_sqe *sqe;
+
+    if (px->wait_fd < 0) {
+        // 帯域の上限で止めている。再開のタイマーで続ける
+        return;
+    }
+    sqe = uring_get_sqe(UOP_PROXY, conn);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = px->wait_fd;
+    sqe->flags = px->wait_fd == conn->fd && conn->fixed ? IOSQE_FIXED_FILE : 0;
+    sqe->poll32_events = px->wait_events;
+    conn->inflight++;
+}
+
+static int
+uring_prep_send(struct Connection *conn)
+{
+    struct OutputSegment *seg;
+    struct io_uring_sqe *sqe;
+    long long allowance;
+    size_t len;
+    int more;
+
+    if (conn->piped > 0) {
+        sqe = uring_get_sqe(UOP_SPLICE_OUT, conn);
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = conn->fd;
+        sqe->flags = conn->fixed ? IOSQE_FIXED_FILE : 0;
+        sqe->off = -1;
+        sqe->splice_fd_in = conn->pipefd[0];
+        sqe->splice_off_in = -1;
+        sqe->len = conn->piped;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        conn->inflight++;
+        return 1;
+    }
+    if (conn->throttled) {
+        conn->throttled = 0;
+        cancel_timer(&conn->timer);
+    }
+    // 完了ごとに積み直すので、1つの接続の送信は他の接続の完了と交互に進む。帯域の上限だけはここで見る
+    allowance = output_pending_p(conn) ? send_allowance(conn) : 1;
+    if (allowance <= 0) {
+        throttle_connection(conn);
+        return 1;
+    }
+    while (output_pending_p(conn)) {
+        seg = &conn->segs[conn->seghead];
+        if (seg->type != SEG_FILE) {
+            if (!conn->uiov) {
+                conn->uiov = checked_malloc(sizeof(struct iovec) * MAX_WRITEV_SEGMENTS);
+            }
+            memset(&conn->umsg, 0, sizeof conn->umsg);
+            conn->umsg.msg_iov = conn->uiov;
+            conn->umsg.msg_iovlen = fill_memory_iov(conn, conn->uiov, &more);
+            sqe = uring_get_sqe(UOP_SEND, conn);
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = conn->fd;
+            sqe->flags = conn->fixed ? IOSQE_FIXED_FILE : 0;
+            sqe->addr = (unsigned long)&conn->umsg;
+            sqe->len = 1;
+            sqe->msg_flags = more ? MSG_MORE : 0;
+            conn->inflight++;
+            return 1;
+        }
+        if (seg->len == 0) {
+            pop_segment(conn);
+            continue;
+        }
+        if (conn->pipefd[0] < 0 && pipe2(conn->pipefd, O_CLOEXEC) < 0) {
+            return -1;
+        }
+        // ファイルからパイプ、パイプからソケットへのspliceを連鎖させ、1つのSQEの組で送る
+        len = seg->len < PIPE_BUF_SIZE ? seg->len : PIPE_BUF_SIZE;
+        if ((long long)len > allowance) {
+            len = allowance;
+        }
+        sqe = uring_get_sqe(UOP_SPLICE_IN, conn);
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = conn->pipefd[1];
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->off = -1;
+        sqe->splice_fd_in = seg->fd;
+        sqe->splice_off_in = seg->offset;
+        sqe->len = len;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe = uring_get_sqe(UOP_SPLICE_OUT, conn);
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = conn->fd;
+        sqe->flags = conn->fixed ? IOSQE_FIXED_FILE : 0;
+        sqe->off = -1;
+        sqe->splice_fd_in = conn->pipefd[0];
+        sqe->splice_off_in = -1;
+        sqe->len = len;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        conn->inflight += 2;
+        return 1;
+    }
+    conn->nsegs = conn->seghead = 0;
+    conn->olen = 0;
+    return 0;
+}
+
+static void
+close_connection(struct Connection *conn)
+{
+    if (conn->inflight > 0) {
+        // 受信待ちなどを終わらせるため、ソケットを閉じずに切断だけしておく
+        unlink_connection(conn);
+        conn->closing = 1;
+        shutdown(conn->fd, SHUT_RDWR);
+        if (conn->proxy && conn->proxy->up) {
+            // 転送先を待っていることもあるので、そちらも切断して待ちを終わらせる
+            shutdown(conn->proxy->up->fd, SHUT_RDWR);
+        }
+        return;
+    }
+    free_connection(conn);
+}
+
+static void
+close_idle_connections(void)
+{
+    struct Timer *head, *timer, *next;
+    int level, i;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            head = &timer_wheel.slots[level][i];
+            for (timer = head->next; timer != head; timer = next) {
+                next = timer->next;
+                if (timer->kind == TIMEOUT_IDLE) {
+                    close_connection(timer->data);
+                }
+            }
+        }
+    }
+}
+
+static void
+unlink_connection(struct Connection *conn)
+{
+    struct Connection **p, *prev = NULL;
+
+    cancel_timer(&conn->timer);
+    if (conn->ready) {
+        for (p = &ready_head; *p != conn; p = &(*p)->ready_next) {
+            prev = *p;
+        }
+        *p = conn->ready_next;
+        if (ready_tail == conn) {
+            ready_tail = prev;
+        }
+        conn->ready = 0;
+    }
+}
+
+static void
+update_connection_timer(struct Connection *conn)
+{
+    if (conn->throttled) {
+        // 帯域の上限で止めている間は、再開のタイマーを書き込みの期限の代わりにする
+        return;
+    } else if (conn->proxy) {
+        // 転送中はクライアントと転送先のどちらを待っていても、進むたびに期限を延ばす
+        add_timer(&conn->timer, TIMEOUT_PROXY, proxy_timeout);
+    } else if (conn->state == CONN_WRITING) {
+        add_timer(&conn->timer, TIMEOUT_WRITE, write_timeout);
+    } else if (conn->h2 && conn->h2->preface && conn->ilen == conn->ihead) {
+        // HTTP/2ではウィンドウの開くのを待つストリームがあれば送信の、なければ次のストリームを待つ期限
+        if (conn->h2->head) {
+            add_timer(&conn->timer, TIMEOUT_WRITE, write_timeout);
+        } else if (conn->timer.kind != TIMEOUT_IDLE || !conn->timer.next) {
+            add_timer(&conn->timer, TIMEOUT_IDLE, draining ? 0 : keepalive_timeout);
+        }
+    } else if (conn->body_state != BODY_NONE) {
+        add_timer(&conn->timer, TIMEOUT_BODY, body_timeout);
+    } else if (conn->nrequests == 0 || conn->ilen > conn->ihead || conn->req.state != PARSE_REQUEST_LINE) {
+        // ヘッダを少しずつ送り続けて居座るクライアントがいるので、最初に仕掛けた期限を延ばさない
+        if (conn->timer.kind != TIMEOUT_HEADER || !conn->timer.next) {
+            add_timer(&conn->timer, TIMEOUT_HEADER, header_timeout);
+        }
+    } else if (conn->timer.kind != TIMEOUT_IDLE || !conn->timer.next) {
+        // 終わろうとしている間は、応答し終えた接続を次の刻みで閉じる
+        add_timer(&conn->timer, TIMEOUT_IDLE, draining ? 0 : keepalive_timeout);
+    }
+}
+
+static void
+init_timer_wheel(void)
+{
+    int l, i;
+
+    for (l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            timer_wheel.slots[l][i].prev = timer_wheel.slots[l][i].next = &timer_wheel.slots[l][i];
+        }
+    }
+    timer_wheel.current = current_msec() / TIMER_TICK_MSEC;
+    timer_wheel.count = 0;
+}
+
+static void
+add_timer(struct Timer *timer, int kind, int sec)
+{
+    add_timer_msec(timer, kind, sec * 1000LL);
+}
+
+static void
+add_timer_msec(struct Timer *timer, int kind, long long msec)
+{
+    cancel_timer(timer);
+    if (timer_wheel.count == 0) {
+        // 空の間は刻みを進めていないので、現在時刻まで飛ばす
+        timer_wheel.current = current_msec() / TIMER_TICK_MSEC;
+    }
+    // 期限の前に閉じないよう刻みの端数は切り上げる
+    timer->expires = (current_msec() + msec + TIMER_TICK_MSEC - 1) / TIMER_TICK_MSEC;
+    timer->kind = kind;
+    insert_timer(timer);
+    timer_wheel.count++;
+}
+
+static void
+cancel_timer(struct Timer *timer)
+{
+    if (!timer->next) {
+        return;
+    }
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+    timer_wheel.count--;
+}
+
+static void
+insert_timer(struct Timer *timer)
+{
+    struct Timer *head;
+    long long delta;
+    int level;
+
+    delta = timer->expires - timer_wheel.current;
+    if (delta < 0) {
+        // 振り分け直すときに期限の過ぎていたものは、これから処理するスロットに入れる
+        delta = 0;
+        timer->expires = timer_wheel.current;
+    }
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+        if (delta < 1LL << (TIMER_WHEEL_BITS * (level + 1))) {
+            break;
+        }
+    }
+    if (delta >= 1LL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) {
+        timer->expires = timer_wheel.current + (1LL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    }
+    head = &timer_wheel.slots[level][(timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static int
+run_timers(void)
+{
+    struct Timer *head, *timer, *next;
+    long long now;
+    int level, i;
+
+    now = current_msec() / TIMER_TICK_MSEC;
+    while (timer_wheel.current <= now && timer_wheel.count > 0) {
+        // 下の段が一周したら、上の段の次のスロットをばらして下の段へ入れ直す
+        for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if (timer_wheel.current & ((1LL << (TIMER_WHEEL_BITS * level)) - 1)) {
+                break;
+            }
+            head = &timer_wheel.slots[level][(timer_wheel.current >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+            timer = head->next;
+            head->prev = head->next = head;
+            while (timer != head) {
+                next = timer->next;
+                insert_timer(timer);
+                timer = next;
+            }
+        }
+        head = &timer_wheel.slots[0][timer_wheel.current & TIMER_WHEEL_MASK];
+        while (head->next != head) {
+            // 閉じる処理で他のタイマーが外れることもあるので、毎回先頭から取る
+            timer = head->next;
+            cancel_timer(timer);
+            if (timer->kind == TIMEOUT_THROTTLE) {
+                push_ready_connection(timer->data);
+            } else {
+                close_connection(timer->data);
+            }
+        }
+        timer_wheel.current++;
+    }
+    if (timer_wheel.count == 0) {
+        return -1;
+    }
+    // 下の段の次の一周までに期限がなければ、振り分け直す時刻に起きる
+    for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        head = &timer_wheel.slots[0][(timer_wheel.current + i) & TIMER_WHEEL_MASK];
+        if (head->next != head || ((timer_wheel.current + i) & TIMER_WHEEL_MASK) == 0) {
+            break;
+        }
+    }
+    now = current_msec();
+    if ((timer_wheel.current + i) * TIMER_TICK_MSEC <= now) {
+        return 0;
+    }
+    return (int)((timer_wheel.current + i) * TIMER_TICK_MSEC - now);
+}
+
+static void
+push_ready_connection(struct Connection *conn)
+{
+    conn->ready = 1;
+    conn->ready_next = NULL;
+    if (ready_tail) {
+        ready_tail->ready_next = conn;
+    } else {
+        ready_head = conn;
+    }
+    ready_tail = conn;
+}
+
+static struct Connection*
+pop_ready_connection(void)
+{
+    struct Connection *conn = ready_head;
+
+    if (conn) {
+        ready_head = conn->ready_next;
+        if (!ready_head) {
+            ready_tail = NULL;
+        }
+        conn->ready = 0;
+    }
+    return conn;
+}
+
+static void
+refill_rate_limit(struct RateLimit *rl, long long now)
+{
+    long long elapsed, burst;
+
+    // 止まっていた間の分をすべて溜めると一気に送ってしまうので、RATE_BURST_DIVISOR分の1秒ぶんで頭打ちにする
+    burst = rl->rate / RATE_BURST_DIVISOR + 1;
+    if (rl->updated == 0) {
+        rl->tokens = burst;
+    } else {
+        elapsed = now - rl->updated;
+        if (elapsed > 1000000) {
+            elapsed = 1000000;
+        }
+        rl->tokens += rl->rate * elapsed / 1000000;
+        if (rl->tokens > burst) {
+            rl->tokens = burst;
+        }
+    }
+    rl->updated = now;
+}
+
+static long long
+send_allowance(struct Connection *conn)
+{
+    long long allowance = LLONG_MAX, now;
+
+    if (conn->rate.rate == 0 && global_rate.rate == 0) {
+        return allowance;
+    }
+    now = current_usec();
+    if (conn->rate.rate > 0) {
+        refill_rate_limit(&conn->rate, now);
+        allowance = conn->rate.tokens;
+    }
+    if (global_rate.rate > 0) {
+        refill_rate_limit(&global_rate, now);
+        if (global_rate.tokens < allowance) {
+            allowance = global_rate.tokens;
+        }
+    }
+    return allowance;
+}
+
+static void
+account_sent(struct Connection *conn, size_t n)
+{
+    STAT_ADD(stats->sent_bytes, n);
+    // ヘッダなどメモリ上の断片は残りに関係なく送るので、トークンは負になることもある
+    if (conn->rate.rate > 0) {
+        conn->rate.tokens -= n;
+    }
+    if (global_rate.rate > 0) {
+        global_rate.tokens -= n;
+    }
+}
+
+static void
+throttle_connection(struct Connection *conn)
+{
+    struct RateLimit *rls[2] = { &conn->rate, &global_rate };
+    long long msec, wait = 0;
+    int i;
+
+    // 少しずつ起きて小さく送らないよう、RATE_RESUME_DIVISOR分の1秒ぶん溜まってから再開する
+    for (i = 0; i < 2; i++) {
+        if (rls[i]->rate > 0 && rls[i]->tokens < rls[i]->rate / RATE_RESUME_DIVISOR) {
+            msec = (rls[i]->rate / RATE_RESUME_DIVISOR - rls[i]->tokens) * 1000 / rls[i]->rate;
+            if (msec > wait) {
+                wait = msec;
+            }
+        }
+    }
+    conn->throttled = 1;
+    add_timer_msec(&conn->timer, TIMEOUT_THROTTLE, wait);
+    STAT_ADD(stats->throttled, 1);
+}
+
+static int
+timer_remaining(struct Timer *timer)
+{
+    long long remaining;
+
+    remaining = timer->expires * TIMER_TICK_MSEC - current_msec();
+    return remaining > 0 ? (int)remaining : 0;
+}
+
+static long long
+current_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static long long
+current_msec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static struct Connection*
+new_connection(int fd, int outfd)
+{
+    struct Connection *conn;
+    struct stat st;
+    conn = checked_malloc(sizeof(struct Connection));
+    conn->fd = fd;
+    conn->outfd = outfd;
+    conn->state = CONN_READING;
+    conn->icap = INITIAL_BUF_SIZE;
+    conn->ibuf = checked_malloc(conn->icap);
+    conn->ihead = 0;
+    conn->ilen = 0;
+    reset_request(&conn->req);
+    conn->ocap = INITIAL_BUF_SIZE;
+    conn->obuf = checked_malloc(conn->ocap);
+    conn->olen = 0;
+    conn->segcap = 8;
+    conn->segs = checked_malloc(sizeof(struct OutputSegment) * conn->segcap);
+    conn->nsegs = 0;
+    conn->seghead = 0;
+    conn->out_type = OUT_OTHER;
+    if (fstat(outfd, &st) == 0) {
+        if (S_ISSOCK(st.st_mode)) {
+            conn->out_type = OUT_SOCKET;
+        } else if (S_ISFIFO(st.st_mode)) {
+            conn->out_type = OUT_PIPE;
+        }
+    }
+    conn->pipefd[0] = conn->pipefd[1] = -1;
+    conn->piped = 0;
+    conn->keep_alive = 0;
+    conn->eof = 0;
+    conn->nrequests = 0;
+    conn->body_state = BODY_NONE;
+    conn->body_remaining = 0;
+    conn->body_sink = NULL;
+    conn->events = 0;
+    conn->timer.kind = TIMEOUT_NONE;
+    conn->timer.data = conn;
+    conn->timer.prev = conn->timer.next = NULL;
+    conn->status = 0;
+    conn->body_bytes = 0;
+    conn->peer_family = -1;
+    conn->parse_usec = 0;
+    conn->send_start = 0;
+    STAT_ADD(stats->accepted, 1);
+    STAT_ADD(stats->open_connections, 1);
+    conn->islot = -1;
+    conn->fixed = 0;
+    conn->inflight = 0;
+    conn->closing = 0;
+    conn->uerror = 0;
+    conn->uiov = NULL;
+    conn->h2 = NULL;
+    conn->proxy = NULL;
+    conn->rate.rate = conn_rate_limit;
+    conn->rate.updated = 0;
+    conn->throttled = 0;
+    conn->ready = 0;
+    conn->ready_next = NULL;
+    return conn;
+}
+
+static void
+free_connection(struct Connection *conn)
+{
+    if (conn->body_state != BODY_NONE && conn->body_sink) {
+        // ボディの途中で切れたことを受け取り手に知らせる
+        conn->body_state = BODY_NONE;
+        conn->body_sink(conn, NULL, 0);
+    }
+    unlink_connection(conn);
+    while (output_pending_p(conn)) {
+        pop_segment(conn);
+    }
+    if (conn->proxy) {
+        free_proxy_exchange(conn->proxy);
+    }
+    if (conn->h2) {
+        free_h2_session(conn->h2);
+    }
+    if (conn->pipefd[0] >= 0) {
+        close(conn->pipefd[0]);
+        close(conn->pipefd[1]);
+    }
+    if (conn->fixed) {
+        uring_update_file(conn->fd, -1);
+    }
+    close(conn->fd);
+    if (conn->outfd != conn->fd) {
+        close(conn->outfd);
+    }
+    if (conn->islot >= 0) {
+        ring.free_slots[ring.nfree_slots++] = conn->islot;
+    } else {
+        free(conn->ibuf);
+    }
+    free(conn->obuf);
+    free(conn->segs);
+    free(conn->uiov);
+    free(conn);
+    STAT_ADD(stats->open_connections, -1);
+}
+
+static void
+reserve_input(struct Connection *conn)
+{
+    char *p;
+
+    if (conn->icap - conn->ilen < BLOCK_BUF_SIZE && conn->ihead > 0) {
+        // 処理済みのリクエストの分を詰める。解析中の範囲はリクエストの先頭からのオフセットなのでずれない
+        memmove(conn->ibuf, conn->ibuf + conn->ihead, conn->ilen - conn->ihead);
+        conn->ilen -= conn->ihead;
+        conn->ihead = 0;
+    }
+    if (conn->icap - conn->ilen >= BLOCK_BUF_SIZE) {
+        return;
+    }
+    if (conn->islot >= 0) {
+        // 登録済みバッファのスロットは伸ばせないので、普通のメモリに移ってスロットを返す
+        p = checked_malloc(conn->icap * 2);
+        memcpy(p, conn->ibuf, conn->ilen);
+        ring.free_slots[ring.nfree_slots++] = conn->islot;
+        conn->islot = -1;
+        conn->ibuf = p;
+        conn->icap *= 2;
+        return;
+    }
+    grow_buffer(&conn->ibuf, &conn->icap, conn->icap * 2);
+}
+
+static int
+fill_connection(struct Connection *conn)
+{
+    ssize_t n;
+
+    reserve_input(conn);
+    for (;;) {
+        n = read(conn->fd, conn->ibuf + conn->ilen, conn->icap - conn->ilen);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            return -1;
+        }
+        conn->ilen += n;
+        return n == 0 ? 0 : 1;
+    }
+}
+
+static int
+process_requests(struct Connection *conn, char *docroot)
+{
+    long long start;
+    int ret, queued = 0;
+
+    if (conn->h2) {
+        return process_h2_frames(conn, docroot);
+    }
+    // 送信待ちが溜まりすぎたら、先に送ってから続きを処理する
+    while (conn->olen < MAX_PIPELINED_OUTPUT && conn->nsegs - conn->seghead < MAX_PIPELINED_SEGMENTS) {
+        if (conn->body_state != BODY_NONE) {
+            ret = consume_body(conn);
+            if (ret == 0) {
+                break;
+            }
+            if (ret < 0) {
+                // 次のリクエストの始まりがわからないので、応答した後に閉じる
+                conn->keep_alive = 0;
+                conn->body_state = BODY_NONE;
+                if (conn->body_sink) {
+                    conn->body_sink(conn, NULL, 0);
+                }
+                if (!queued) {
+                    bad_request(conn);
+                }
+                return 1;
+            }
+        }
+        if (queued && !conn->keep_alive) {
+            break;
+        }
+        if (http2_enabled && conn->nrequests == 0 && conn->req.state == PARSE_REQUEST_LINE) {
+            // 事前の知識でHTTP/2を話すクライアントは、リクエストの代わりにプリフェイスを送ってくる
+            ret = h2_preface_p(conn);
+            if (ret == 0) {
+                break;
+            }
+            if (ret > 0) {
+                start_h2(conn, NULL, docroot);
+                return process_h2_frames(conn, docroot);
+            }
+        }
+        start = current_usec();
+        ret = parse_request(conn);
+        conn->parse_usec += current_usec() - start;
+        if (ret == 0) {
+            break;
+        }
+        record_histogram(&stats->phases[PHASE_PARSE], conn->parse_usec);
+        conn->parse_usec = 0;
+        if (ret < 0) {
+            conn->keep_alive = 0;
+            conn->status = 0;
+            conn->body_bytes = 0;
+            bad_request(conn);
+            log_access(NULL, conn);
+            count_request(NULL, conn);
+            return 1;
+        }
+        if (h2c_upgrade_p(&conn->req)) {
+            start_h2(conn, &conn->req, docroot);
+            return process_h2_frames(conn, docroot);
+        }
+        handle_request(conn, docroot);
+        queued = 1;
+        if (conn->proxy) {
+            // 転送を終えるまで次のリクエストには進まない
+            break;
+        }
+    }
+    return queued;
+}
+
+static void
+handle_request(struct Connection *conn, char *docroot)
+{
+    struct HTTPRequest *req = &conn->req;
+
+    // ヘッダを読み終えたので、ヘッダのタイムアウトは次のリクエストで仕掛け直す
+    cancel_timer(&conn->timer);
+    conn->nrequests++;
+    conn->keep_alive = keep_alive_p(req, conn);
+    conn->body_sink = NULL;
+    if ((req->chunked || req->length > 0) && lookup_known_header(req, HDR_EXPECT)) {
+        // 100 Continueを返さなければボディは来ないかもしれないので、応答したら閉じる
+        // ボディを受け取るハンドラは100 Continueを返し、keep_aliveを戻してbody_sinkを設定する
+        conn->keep_alive = 0;
+    }
+    conn->status = 0;
+    conn->body_bytes = 0;
+    respond_to(req, conn, docroot);
+    if (!conn->proxy) {
+        // 転送したリクエストのログは応答を終えたときにfinish_proxyで書く
+        log_access(req, conn);
+        count_request(req, conn);
+    }
+    if (!conn->send_start) {
+        conn->send_start = current_usec();
+    }
+    if (req->chunked || req->length > 0) {
+        if (!conn->body_sink && lookup_known_header(req, HDR_EXPECT)) {
+            conn->keep_alive = 0;
+        } else {
+            conn->body_state = req->chunked ? BODY_CHUNK_SIZE : BODY_LENGTH;
+            conn->body_remaining = req->length;
+        }
+    }
+    conn->ihead += req->header_len;
+    if (conn->ihead == conn->ilen) {
+        conn->ihead = conn->ilen = 0;
+    }
+    reset_request(req);
+}
+
+static int
+consume_body(struct Connection *conn)
+{
+    char *line, *end;
+    size_t avail, len;
+    long long size;
+
+    for (;;) {
+        avail = conn->ilen - conn->ihead;
+        switch (conn->body_state) {
+            case BODY_LENGTH:
+            case BODY_CHUNK_DATA:
+                if (conn->body_remaining > 0) {
+                    if (avail == 0) {
+                        return 0;
+                    }
+                    deliver_body(conn, (long long)avail < conn->body_remaining ? avail : (size_t)conn->body_remaining);
+                    continue;
+                }
+                if (conn->body_state == BODY_CHUNK_DATA) {
+                    conn->body_state = BODY_CHUNK_END;
+                    continue;
+                }
+                break;
+            case BODY_CHUNK_SIZE:
+                if (!(line = body_line(conn, &len))) {
+                    return avail < MAX_CHUNK_LINE_LENGTH ? 0 : -1;
+                }
+                // チャンク拡張は無視する
+                errno = 0;
+                size = strtoll(line, &end, 16);
+                if (!isxdigit((int)*line) || size < 0 || errno == ERANGE
+                    || (*end != ';' && *end != '\r' && *end != '\n' && *end != ' ' && *end != '\t')) {
+                    log_error("invalid chunk size: %.*s", (int)len, line);
+                    return -1;
+                }
+                conn->ihead += len;
+                conn->body_remaining = size;
+                conn->body_state = size > 0 ? BODY_CHUNK_DATA : BODY_TRAILER;
+                continue;
+            case BODY_CHUNK_END:
+                if (!(line = body_line(conn, &len))) {
+                    return avail < 2 ? 0 : -1;
+                }
+                if (len != 2 && len != 1) {
+                    log_error("missing CRLF after chunk data");
+                    return -1;
+                }
+                conn->ihead += len;
+                conn->body_state = BODY_CHUNK_SIZE;
+                continue;
+            case BODY_TRAILER:
+                // トレイラーは読み捨て、空行でボディを終える
+                if (!(line = body_line(conn, &len))) {
+                    return avail < MAX_CHUNK_LINE_LENGTH ? 0 : -1;
+                }
+                conn->ihead += len;
+                if (len > 2 || (len == 2 && *line != '\r')) {
+                    continue;
+                }
+                break;
+        }
+        conn->body_state = BODY_NONE;
+        if (conn->ihead == conn->ilen) {
+            conn->ihead = conn->ilen = 0;
+        }
+        if (conn->body_sink) {
+            conn->body_sink(conn, NULL, 0);
+        }
+        return 1;
+    }
+}
+
+static char*
+body_line(struct Connection *conn, size_t *len)
+{
+    char *p, *nl;
+
+    p = conn->ibuf + conn->ihead;
+    nl = memchr(p, '\n', conn->ilen - conn->ihead);
+    if (!nl || nl - p >= MAX_CHUNK_LINE_LENGTH) {
+        return NULL;
+    }
+    *len = nl + 1 - p;
+    return p;
+}
+
+static void
+deliver_body(struct Connection *conn, size_t len)
+{
+    if (conn->body_sink) {
+        conn->body_sink(conn, conn->ibuf + conn->ihead, len);
+    }
+    conn->body_remaining -= len;
+    conn->ihead += len;
+    // 受信バッファはボディの大きさによらず、読んだ分を詰めて使い回す
+    if (conn->ihead == conn->ilen) {
+        conn->ihead = conn->ilen = 0;
+    }
+}
+
+static int
+keep_alive_p(struct HTTPRequest *req, struct Connection *conn)
+{
+    char *val;
+
+    if (max_keepalive_requests > 0 && conn->nrequests >= max_keepalive_requests) {
+        return 0;
+    }
+    // 終わろうとしているので、この応答を最後に閉じる
+    if (draining || conn->eof) {
+        return 0;
+    }
+    val = lookup_known_header(req, HDR_CONNECTION);
+    if (val && header_token_p(val, strlen(val), "close")) {
+        return 0;
+    }
+    if (req->protocol_minor_version >= 1) {
+        return 1;
+    }
+    return val && header_token_p(val, strlen(val), "keep-alive");
+}
+
+static int
+flush_connection(struct Connection *conn)
+{
+    struct OutputSegment *seg;
+    long long allowance;
+    size_t sent = 0;
+    ssize_t n;
+
+    if (conn->throttled) {
+        conn->throttled = 0;
+        cancel_timer(&conn->timer);
+    }
+    while (output_pending_p(conn)) {
+        if (send_quantum > 0 && sent >= send_quantum) {
+            // 順番を譲る。書ける限りepollはまたこの接続を返すので、他の接続を一回りしてから続きを送る
+            return 0;
+        }
+        allowance = send_allowance(conn);
+        if (allowance <= 0) {
+            throttle_connection(conn);
+            return 0;
+        }
+        if (send_quantum > 0 && allowance > (long long)(send_quantum - sent)) {
+            allowance = send_quantum - sent;
+        }
+        seg = &conn->segs[conn->seghead];
+        if (seg->type == SEG_FILE) {
+            n = send_file_segment(conn, seg, allowance);
+        } else {
+            n = send_memory_segments(conn);
+        }
+        if (n > 0) {
+            sent += n;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (n == 0) {
+            // 送信中にファイルが縮んだ。Content-Lengthを守れないので接続ごと諦める
+            return -1;
+        }
+    }
+    conn->nsegs = conn->seghead = 0;
+    conn->olen = 0;
+    return 1;
+}
+
+static ssize_t
+send_memory_segments(struct Connection *conn)
+{
+    struct iovec iov[MAX_WRITEV_SEGMENTS];
+    struct msghdr msg;
+    ssize_t n;
+    int niov, more;
+
+    niov = fill_memory_iov(conn, iov, &more);
+    if (conn->out_type == OUT_SOCKET) {
+        // ボディが続くならヘッダだけのパケットを出さず、ボディの先頭とまとめて送らせる
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = niov;
+        n = sendmsg(conn->outfd, &msg, more ? MSG_MORE : 0);
+    } else {
+        n = writev(conn->outfd, iov, niov);
+    }
+    if (n < 0) {
+        return -1;
+    }
+    consume_memory_segments(conn, n);
+    return n > 0 ? n : 1;
+}
+
+static int
+fill_memory_iov(struct Connection *conn, struct iovec *iov, int *more)
+{
+    struct OutputSegment *seg;
+    int i, niov = 0;
+
+    *more = 0;
+    for (i = conn->seghead; i < conn->nsegs && niov < MAX_WRITEV_SEGMENTS; i++) {
+        seg = &conn->segs[i];
+        if (seg->type == SEG_FILE) {
+            *more = 1;
+            break;
+        }
+        iov[niov].iov_base = (seg->type == SEG_BUF ? conn->obuf : seg->data) + seg->offset;
+        iov[niov].iov_len = seg->len;
+        niov++;
+    }
+    return niov;
+}
+
+static void
+consume_memory_segments(struct Connection *conn, size_t n)
+{
+    struct OutputSegment *seg;
+
+    account_sent(conn, n);
+    while (output_pending_p(conn)) {
+        seg = &conn->segs[conn->seghead];
+        if (seg->type == SEG_FILE) {
+            break;
+        }
+        if ((off_t)n < seg->len) {
+            seg->offset += n;
+            seg->len -= n;
+            break;
+        }
+        n -= seg->len;
+        pop_segment(conn);
+    }
+}
+
+static ssize_t
+send_file_segment(struct Connection *conn, struct OutputSegment *seg, size_t limit)
+{
+    char buf[PIPE_BUF_SIZE];
+    size_t len;
+    ssize_t n, w;
+
+    if (seg->len == 0 && conn->piped == 0) {
+        pop_segment(conn);
+        return 1;
+    }
+    len = seg->len < MAX_SENDFILE_SIZE ? seg->len : MAX_SENDFILE_SIZE;
+    if (len > limit) {
+        len = limit;
+    }
+    switch (conn->out_type) {
+        case OUT_SOCKET:
+            n = sendfile(conn->outfd, seg->fd, &seg->offset, len);
+            break;
+        case OUT_PIPE:
+            n = splice(seg->fd, &seg->offset, conn->outfd, NULL, len, SPLICE_F_MOVE);
+            break;
+        case OUT_OTHER:
+            if (conn->piped > 0) {
+                n = splice(conn->pipefd[0], NULL, conn->outfd, NULL, conn->piped, SPLICE_F_MOVE);
+                if (n < 0 && errno == EINVAL) {
+                    // 出力先がspliceに対応していない。パイプに入れた分は読み直すことにして普通に書く
+                    seg->offset -= conn->piped;
+                    seg->len += conn->piped;
+                    conn->piped = 0;
+                    close(conn->pipefd[0]);
+                    close(conn->pipefd[1]);
+                    conn->pipefd[0] = conn->pipefd[1] = -1;
+                    conn->out_type = OUT_COPY;
+                    return 1;
+                }
+                if (n > 0) {
+                    conn->piped -= n;
+                }
+                return n;
+            }
+            if (conn->pipefd[0] < 0 && pipe2(conn->pipefd, O_CLOEXEC) < 0) {
+                return -1;
+            }
+            n = splice(seg->fd, &seg->offset, conn->pipefd[1], NULL,
+                       len < PIPE_BUF_SIZE ? len : PIPE_BUF_SIZE, SPLICE_F_MOVE);
+            if (n > 0) {
+                conn->piped += n;
+            }
+            break;
+        default:
+            n = pread(seg->fd, buf, len < PIPE_BUF_SIZE ? len : PIPE_BUF_SIZE, seg->offset);
+            if (n <= 0) {
+                return n;
+            }
+            w = write(conn->outfd, buf, n);
+            if (w < 0) {
+                return -1;
+            }
+            seg->offset += w;
+            n = w;
+            break;
+    }
+    if (n > 0) {
+        seg->len -= n;
+        account_sent(conn, n);
+    }
+    return n;
+}
+
+static void
+queue_segment(struct Connection *conn, int type, char *data, int fd, off_t offset, off_t len, struct CachedFile *file)
+{
+    struct OutputSegment *seg, *p;
+
+    if (type == SEG_BUF && conn->nsegs > conn->seghead) {
+        seg = &conn->segs[conn->nsegs - 1];
+        if (seg->type == SEG_BUF && seg->offset + seg->len == offset) {
+            seg->len += len;
+            return;
+        }
+    }
+    if (conn->nsegs == conn->segcap) {
+        p = realloc(conn->segs, sizeof(struct OutputSegment) * conn->segcap * 2);
+        if (!p) {
+            log_exit("failed to allocate memory");
+        }
+        conn->segs = p;
+        conn->segcap *= 2;
+    }
+    seg = &conn->segs[conn->nsegs++];
+    seg->type = type;
+    seg->data = data;
+    seg->fd = fd;
+    seg->offset = offset;
+    seg->len = len;
+    seg->file = file;
+}
+
+static void
+pop_segment(struct Connection *conn)
+{
+    struct OutputSegment *seg;
+
+    seg = &conn->segs[conn->seghead++];
+    if (seg->file) {
+        release_cached_file(seg->file);
+    }
+}
+
+static int
+output_pending_p(struct Connection *conn)
+{
+    return conn->seghead < conn->nsegs;
+}
+
+static void
+conn_printf(struct Connection *conn, char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(conn->obuf + conn->olen, conn->ocap - conn->olen, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            log_exit("vsnprintf(3) failed");
+        }
+        if (conn->olen + n < conn->ocap) {
+            queue_segment(conn, SEG_BUF, NULL, -1, conn->olen, n, NULL);
+            conn->olen += n;
+            return;
+        }
+        grow_buffer(&conn->obuf, &conn->ocap, conn->olen + n + 1);
+    }
+}
+
+static void
+conn_write(struct Connection *conn, const char *data, size_t len)
+{
+    if (conn->olen + len > conn->ocap) {
+        grow_buffer(&conn->obuf, &conn->ocap, conn->olen + len);
+    }
+    memcpy(conn->obuf + conn->olen, data, len);
+    queue_segment(conn, SEG_BUF, NULL, -1, conn->olen, len, NULL);
+    conn->olen += len;
+}
+
+static void
+grow_buffer(char **buf, size_t *cap, size_t need)
+{
+    size_t newcap;
+    char *p;
+
+    if (need <= *cap) {
+        return;
+    }
+    for (newcap = *cap ? *cap : INITIAL_BUF_SIZE; newcap < need; newcap *= 2)
+        ;
+    p = realloc(*buf, newcap);
+    if (!p) {
+        log_exit("failed to allocate memory");
+    }
+    *buf = p;
+    *cap = newcap;
+}
+
+static int
+parse_request(struct Connection *conn)
+{
+    struct HTTPRequest *req = &conn->req;
+    char *end, *eol, *p;
+    size_t len;
+
+    req->buf = conn->ibuf + conn->ihead;
+    end = conn->ibuf + conn->ilen;
+    while (req->state != PARSE_BODY) {
+        eol = scan_bytes(req->buf + req->pos, end, '\r', '\n');
+        if (!eol || (*eol == '\r' && eol + 1 == end)) {
+            // 行の終わりがまだ届いていない。次はここから探す
+            req->pos = (eol ? eol : end) - req->buf;
+            if (req->pos >= MAX_REQUEST_HEADER_LENGTH) {
+                log_error("request header is too long");
+                return -1;
+            }
+            return 0;
+        }
+        p = req->buf + req->line;
+        len = eol - p;
+        if (*eol == '\r') {
+            if (eol[1] != '\n') {
+                log_error("bare CR in request header");
+                return -1;
+            }
+            eol++;
+        }
+        req->pos = req->line = eol + 1 - req->buf;
+        if (req->state == PARSE_REQUEST_LINE) {
+            // リクエスト行より前の空行は読み飛ばす
+            if (len == 0) {
+                continue;
+            }
+            if (parse_request_line(req, p, len) < 0) {
+                return -1;
+            }
+            req->state = PARSE_HEADER;
+        } else if (len == 0) {
+            req->header_len = req->pos;
+            if (finish_header(req) < 0) {
+                return -1;
+            }
+            req->state = PARSE_BODY;
+        } else if (parse_header_field(req, p, len) < 0) {
+            return -1;
+        }
+    }
+    // ボディは待たずにヘッダだけで応答を始め、ボディはconsume_bodyで流れてくるそばから読む
+    req->method = req->buf + req->method_range.off;
+    req->path = req->buf + req->path_range.off;
+    req->query = req->query_range.off ? req->buf + req->query_range.off : NULL;
+    return 1;
+}
+
+static int
+parse_request_line(struct HTTPRequest *req, char *p, size_t len)
+{
+    char *end, *sp1, *sp2, *q;
+
+    end = p + len;
+    sp1 = memchr(p, ' ', len);
+    if (!sp1 || sp1 == p) {
+        log_error("parse error on request line (1): %.*s", (int)len, p);
+        return -1;
+    }
+    sp2 = memchr(sp1 + 1, ' ', end - (sp1 + 1));
+    if (!sp2 || sp2 == sp1 + 1) {
+        log_error("parse error on request line (2): %.*s", (int)len, p);
+        return -1;
+    }
+    if (end - (sp2 + 1) != strlen("HTTP/1.x")
+        || strncasecmp(sp2 + 1, "HTTP/1.", strlen("HTTP/1.")) != 0 || !isdigit((int)sp2[8])) {
+        log_error("parse error on request line (3): %.*s", (int)len, p);
+        return -1;
+    }
+    req->protocol_minor_version = sp2[8] - '0';
+    req->method_range.off = p - req->buf;
+    req->method_range.len = sp1 - p;
+    req->path_range.off = sp1 + 1 - req->buf;
+    q = memchr(sp1 + 1, '?', sp2 - (sp1 + 1));
+    if (q) {
+        req->path_range.len = q - (sp1 + 1);
+        req->query_range.off = q + 1 - req->buf;
+        req->query_range.len = sp2 - (q + 1);
+    } else {
+        req->path_range.len = sp2 - (sp1 + 1);
+    }
+    return 0;
+}
+
+static int
+parse_header_field(struct HTTPRequest *req, char *p, size_t len)
+{
+    struct HTTPHeaderField *h;
+    char *end, *colon, *v;
+    int id;
+
+    end = p + len;
+    // 行の折り返し(obs-fold)は受け付けない
+    if (*p == ' ' || *p == '\t') {
+        log_error("parse error on request header field: %.*s", (int)len, p);
+        return -1;
+    }
+    colon = scan_bytes(p, end, ':', ':');
+    if (!colon || colon == p || scan_bytes(p, colon, ' ', '\t')) {
+        log_error("parse error on request header field: %.*s", (int)len, p);
+        return -1;
+    }
+    if (req->nheaders == MAX_HEADER_FIELDS) {
+        log_error("too many request header fields");
+        return -1;
+    }
+    for (v = colon + 1; v < end && (*v == ' ' || *v == '\t'); v++)
+        ;
+    while (end > v && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    id = known_header_id(p, colon - p);
+    if (id >= 0 && req->known[id]) {
+        // ボディの長さの解釈が食い違わないよう、長さを決めるヘッダの重複は受け付けない
+        if (id == HDR_CONTENT_LENGTH || id == HDR_TRANSFER_ENCODING) {
+            log_error("duplicate %.*s header field", (int)(colon - p), p);
+            return -1;
+        }
+    } else if (id >= 0) {
+        req->known[id] = req->nheaders + 1;
+    }
+    h = &req->header[req->nheaders++];
+    h->name.off = p - req->buf;
+    h->name.len = colon - p;
+    h->value.off = v - req->buf;
+    h->value.len = end - v;
+    return 0;
+}
+
+static int
+finish_header(struct HTTPRequest *req)
+{
+    struct HTTPHeaderField *h;
+    char *val;
+    size_t len;
+    int i;
+
+    // 範囲の直後は区切りの空白や':'、改行なので、そこを潰して文字列にする
+    req->buf[req->method_range.off + req->method_range.len] = '\0';
+    req->buf[req->path_range.off + req->path_range.len] = '\0';
+    if (req->query_range.off) {
+        req->buf[req->query_range.off + req->query_range.len] = '\0';
+    }
+    upcase(req->buf + req->method_range.off);
+    for (i = 0; i < req->nheaders; i++) {
+        h = &req->header[i];
+        req->buf[h->name.off + h->name.len] = '\0';
+        req->buf[h->value.off + h->value.len] = '\0';
+    }
+    val = lookup_known_header(req, HDR_TRANSFER_ENCODING);
+    if (val) {
+        // chunkedが最後の符号化でなければボディの終わりがわからない
+        len = strlen(val);
+        if (len < strlen("chunked") || strcasecmp(val + len - strlen("chunked"), "chunked") != 0
+            || (len > strlen("chunked") && !strchr(", \t", val[len - strlen("chunked") - 1]))) {
+            log_error("unsupported Transfer-Encoding: %s", val);
+            return -1;
+        }
+        if (lookup_known_header(req, HDR_CONTENT_LENGTH)) {
+            log_error("both Transfer-Encoding and Content-Length found");
+            return -1;
+        }
+        req->chunked = 1;
+        return 0;
+    }
+    req->length = content_length(req);
+    if (req->length < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void
+reset_request(struct HTTPRequest *req)
+{
+    req->state = PARSE_REQUEST_LINE;
+    req->pos = 0;
+    req->line = 0;
+    req->header_len = 0;
+    req->query_range.off = 0;
+    req->query_range.len = 0;
+    req->nheaders = 0;
+    memset(req->known, 0, sizeof req->known);
+    req->length = 0;
+    req->chunked = 0;
+}
+
+static char*
+scan_bytes(char *p, char *end, char a, char b)
+{
+    unsigned int mask;
+
+#if defined(__AVX2__)
+    __m256i va32 = _mm256_set1_epi8(a), vb32 = _mm256_set1_epi8(b), v32;
+    for (; end - p >= 32; p += 32) {
+        v32 = _mm256_loadu_si256((__m256i*)p);
+        mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v32, va32), _mm256_cmpeq_epi8(v32, vb32)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), v;
+    for (; end - p >= 16; p += 16) {
+        v = _mm_loadu_si128((__m128i*)p);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == a || *p == b) {
+            return p;
+        }
+    }
+    (void)mask;
+    return NULL;
+}
+
+static void
+upcase(char *str)
+{
+    char *p;
+    for (p = str; *p; p++) {
+        *p = (char)toupper((int)*p);
+    }
+}
+
+static long
+content_length(struct HTTPRequest *req)
+{
+    char *val, *end;
+    long len;
+    val = lookup_known_header(req, HDR_CONTENT_LENGTH);
+    if (!val) {
+        return 0;
+    }
+    errno = 0;
+    len = strtol(val, &end, 10);
+    if (!isdigit((int)*val) || *end != '\0' || errno == ERANGE) {
+        log_error("invalid Content-Length value found: %s", val);
+        return -1;
+    }
+    return len;
+}
+
+static char*
+lookup_known_header(struct HTTPRequest *req, int id)
+{
+    if (!req->known[id]) {
+        return NULL;
+    }
+    return req->buf + req->header[req->known[id] - 1].value.off;
+}
+
+static int
+known_header_id(char *name, size_t len)
+{
+    const struct KnownHeader *k;
+    if (len == 0) {
+        return -1;
+    }
+    k = &known_headers[HEADER_HASH(len, name[0], name[len - 1])];
+    if (k->len != len || strncasecmp(k->name, name, len) != 0) {
+        return -1;
+    }
+    return k->id;
+}
+
+static void
+respond_to(struct HTTPRequest *req, struct Connection *conn, char *docroot)
+{
+    struct ProxyRoute *route;
+
+    if (stats_enabled && strcmp(req->path, STATS_PATH) == 0
+        && (strcmp(req->method, "GET") == 0 || strcmp(req->method, "HEAD") == 0)) {
+        do_stats_response(req, conn);
+    } else if ((route = lookup_proxy_route(req->path)) != NULL) {
+        do_proxy_response(req, conn, route);
+    } else if (strcmp(req->method, "GET") == 0) {
+        do_file_response(req, conn, docroot);
+    } else if (strcmp(req->method, "HEAD") == 0) {
+        do_file_response(req, conn, docroot);
+    } else if (strcmp(req->method, "POST") == 0) {
+        method_not_allowed(req, conn);
+    } else {
+        not_implemented(req, conn);
+    }
+}
+
+static void
+do_file_response(struct HTTPRequest *req, struct Connection *conn, char *docroot)
+{
+    struct ByteRange ranges[MAX_RANGES];
+    struct CachedFile *file, *encoded;
+    struct stat st;
+    long long start;
+    char *range;
+    size_t len;
+    int n;
+
+    start = current_usec();
+    len = strlen(req->path);
+    if (len > 0 && req->path[len - 1] == '/') {
+        file = open_directory_index(req, docroot);
+    } else {
+        file = open_cached_file(docroot, req->path);
+    }
+    if (!file) {
+        if (archive.map) {
+            n = len > 0 && req->path[len - 1] != '/' && archive_directory_p(req->path);
+        } else {
+            n = len > 0 && req->path[len - 1] != '/' && stat_beneath(req->path, "", &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        record_histogram(&stats->phases[PHASE_STAT], current_usec() - start);
+        if (n) {
+            // /なしでディレクトリを指していたら、相対リンクが正しく辿れるよう/付きのURLへ転送する
+            redirect_to_directory(req, conn);
+        } else {
+            not_found(req, conn);
+        }
+        return;
+    }
+    if (file->encodings && (n = accepted_encodings(req) & file->encodings) != 0) {
+        encoded = open_encoded_file(file, n);
+        if (encoded) {
+            release_cached_file(file);
+            file = encoded;
+        }
+    }
+    record_histogram(&stats->phases[PHASE_STAT], current_usec() - start);
+    if (not_modified_p(req, file)) {
+        not_modified(conn, file);
+        release_cached_file(file);
+        return;
+    }
+    range = lookup_known_header(req, HDR_RANGE);
+    if (range && strcmp(req->method, "GET") == 0 && if_range_p(req, file)) {
+        n = parse_range(range, file->size, ranges, MAX_RANGES);
+        if (n >= 0) {
+            do_range_response(conn, file, ranges, n);
+            release_cached_file(file);
+            return;
+        }
+    }
+    if (file->response) {
+        do_cached_response(req, conn, file);
+        return;
+    }
+    output_common_header_fields(conn, STATUS_200);
+    conn_printf(conn, "Content-Length: %ld\r\nContent-Type: %s\r\n", (long)file->size, file->content_type);
+    output_file_header_fields(conn, file);
+    if (strcmp(req->method, "HEAD") != 0) {
+        // ボディはここでは読まず、flush_connectionが書けるだけずつ送り出す
+        queue_file_range(conn, file, 0, file->size);
+        conn->body_bytes += file->size;
+    }
+    release_cached_file(file);
+}
+
+#define MULTIPART_HEADER_FMT "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n"
+#define MULTIPART_TRAILER_FMT "\r\n--%s--\r\n"
+
+static void
+do_range_response(struct Connection *conn, struct CachedFile *file, struct ByteRange *ranges, int n)
+{
+    char *boundary;
+    long len;
+    int i;
+
+    if (n == 0) {
+        output_common_header_fields(conn, STATUS_416);
+        conn_printf(conn, "Content-Range: bytes */%ld\r\nContent-Length: 0\r\n\r\n", (long)file->size);
+        return;
+    }
+    output_common_header_fields(conn, STATUS_206);
+    if (n == 1) {
+        conn_printf(conn, "Content-Range: bytes %ld-%ld/%ld\r\nContent-Length: %ld\r\nContent-Type: %s\r\n",
+                    (long)ranges[0].first, (long)ranges[0].last, (long)file->size,
+                    (long)(ranges[0].last - ranges[0].first + 1), file->content_type);
+        output_file_header_fields(conn, file);
+        queue_file_range(conn, file, ranges[0].first, ranges[0].last - ranges[0].first + 1);
+        conn->body_bytes += ranges[0].last - ranges[0].first + 1;
+        return;
+    }
+    // Content-Lengthを先に出すため、各パートのヘッダの長さを数えてから組み立てる
+    boundary = multipart_boundary();
+    len = snprintf(NULL, 0, MULTIPART_TRAILER_FMT, boundary);
+    for (i = 0; i < n; i++) {
+        len += snprintf(NULL, 0, MULTIPART_HEADER_FMT, boundary, file->content_type,
+                        (long)ranges[i].first, (long)ranges[i].last, (long)file->size);
+        len += ranges[i].last - ranges[i].first + 1;
+    }
+    conn_printf(conn, "Content-Length: %ld\r\nContent-Type: multipart/byteranges; boundary=%s\r\n", len, boundary);
+    output_file_header_fields(conn, file);
+    conn->body_bytes += len;
+    for (i = 0; i < n; i++) {
+        conn_printf(conn, MULTIPART_HEADER_FMT, boundary, file->content_type,
+                    (long)ranges[i].first, (long)ranges[i].last, (long)file->size);
+        queue_file_range(conn, file, ranges[i].first, ranges[i].last - ranges[i].first + 1);
+    }
+    conn_printf(conn, MULTIPART_TRAILER_FMT, boundary);
+}
+
+static void
+queue_file_range(struct Connection *conn, struct CachedFile *file, off_t offset, off_t len)
+{
+    file->refcount++;
+    if (file->response) {
+        queue_segment(conn, SEG_MEM, file->response, -1, file->header_len + offset, len, file);
+    } else {
+        queue_segment(conn, SEG_FILE, NULL, file->fd, offset, len, file);
+    }
+}
+
+static int
+parse_range(char *spec, off_t size, struct ByteRange *ranges, int max)
+{
+    char *p, *end;
+    long long first, last;
+    int n = 0;
+
+    p = spec + strspn(spec, " \t");
+    if (strncasecmp(p, "bytes=", strlen("bytes=")) != 0) {
+        return -1;
+    }
+    p += strlen("bytes=");
+    for (;;) {
+        p += strspn(p, " \t,");
+        if (*p == '\0') {
+            break;
+        }
+        if (*p == '-') {
+            // 末尾からの長さで指定された範囲
+            p++;
+            if (!isdigit((int)*p)) {
+                return -1;
+            }
+            last = strtoll(p, &end, 10);
+            p = end;
+            if (last == 0 || size == 0) {
+                first = size;
+            } else {
+                first = last < size ? size - last : 0;
+            }
+            last = size - 1;
+        } else {
+            if (!isdigit((int)*p)) {
+                return -1;
+            }
+            first = strtoll(p, &end, 10);
+            p = end;
+            if (*p++ != '-') {
+                return -1;
+            }
+            if (isdigit((int)*p)) {
+                last = strtoll(p, &end, 10);
+                p = end;
+                if (last < first) {
+                    return -1;
+                }
+            } else {
+                last = size - 1;
+            }
+            if (last >= size) {
+                last = size - 1;
+            }
+        }
+        p += strspn(p, " \t");
+        if (*p != ',' && *p != '\0') {
+            return -1;
+        }
+        // ファイルの外を指す範囲は満たせないので数えない
+        if (first >= size) {
+            continue;
+        }
+        if (n == max) {
+            return -1;
+        }
+        ranges[n].first = first;
+        ranges[n].last = last;
+        n++;
+    }
+    return n;
+}
+
+static int
+if_range_p(struct HTTPRequest *req, struct CachedFile *file)
+{
+    char *val;
+    time_t t;
+
+    val = lookup_known_header(req, HDR_IF_RANGE);
+    if (!val) {
+        return 1;
+    }
+    // If-Rangeでは強い比較しか使えない
+    if (*val == '"' || strncmp(val, "W/", 2) == 0) {
+        return strcmp(val, file->etag) == 0;
+    }
+    if (parse_http_date(val, &t) < 0) {
+        return 0;
+    }
+    return t == file->mtime.tv_sec;
+}
+
+static int
+not_modified_p(struct HTTPRequest *req, struct CachedFile *file)
+{
+    char *val;
+    time_t t;
+
+    // If-None-Matchがあれば、If-Modified-Sinceは見ない
+    val = lookup_known_header(req, HDR_IF_NONE_MATCH);
+    if (val) {
+        return etag_match_p(val, file->etag, 1);
+    }
+    val = lookup_known_header(req, HDR_IF_MODIFIED_SINCE);
+    if (val && parse_http_date(val, &t) == 0) {
+        return file->mtime.tv_sec <= t;
+    }
+    return 0;
+}
+
+static void
+not_modified(struct Connection *conn, struct CachedFile *file)
+{
+    output_common_header_fields(conn, STATUS_304);
+    conn_printf(conn, "ETag: %s\r\nLast-Modified: %s\r\n%s\r\n", file->etag, file->last_modified,
+                file->vary ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+static int
+etag_match_p(char *list, char *etag, int weak)
+{
+    char *p = list, *tag;
+    size_t len;
+
+    if (weak && strncmp(etag, "W/", 2) == 0) {
+        etag += 2;
+    }
+    len = strlen(etag);
+    for (;;) {
+        p += strspn(p, " \t,");
+        if (*p == '\0') {
+            return 0;
+        }
+        if (*p == '*') {
+            return 1;
+        }
+        tag = p;
+        if (weak && strncmp(tag, "W/", 2) == 0) {
+            tag += 2;
+        }
+        if (strncmp(tag, etag, len) == 0
+            && (tag[len] == '\0' || tag[len] == ',' || tag[len] == ' ' || tag[len] == '\t')) {
+            return 1;
+        }
+        // 次の要素まで読み飛ばす。エンティティタグ自体はカンマを含まない
+        p = strchr(p, ',');
+        if (!p) {
+            return 0;
+        }
+    }
+}
+
+static void
+set_validators(struct CachedFile *file)
+{
+    // 同じファイルでも符号化が違えば別の表現なので、ETagも変える
+    snprintf(file->etag, ETAG_BUF_SIZE, "\"%lx-%lx-%llx%s%s\"",
+             (unsigned long)file->ino, (unsigned long)file->source_size,
+             (unsigned long long)file->mtime.tv_sec * 1000000000ULL + (unsigned long long)file->mtime.tv_nsec,
+             file->encoding ? "-" : "", file->encoding ? content_encodings[file->encoding].name : "");
+    format_http_time(file->last_modified, TIME_BUF_SIZE, file->mtime.tv_sec);
+}
+
+static char*
+multipart_boundary(void)
+{
+    static char boundary[64];
+    struct timespec ts;
+
+    if (!boundary[0]) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        snprintf(boundary, sizeof boundary, "%s_%08lx%08lx%04x", SERVER_NAME,
+                 (unsigned long)ts.tv_sec, (unsigned long)ts.tv_nsec, (unsigned int)getpid() & 0xffff);
+    }
+    return boundary;
+}
+
+static void
+do_cached_response(struct HTTPRequest *req, struct Connection *conn, struct CachedFile *file)
+{
+    // responseはDateとConnection以外のヘッダとボディを持っているので、その間に差し込んで一度に送る
+    file->refcount++;
+    conn->status = 200;
+    STAT_ADD(stats->content_cache_hits, 1);
+    queue_segment(conn, SEG_MEM, file->response, -1, 0, file->header_len, file);
+    output_date_and_connection(conn);
+    conn_write(conn, "\r\n", 2);
+    if (strcmp(req->method, "HEAD") == 0) {
+        release_cached_file(file);
+        return;
+    }
+    queue_segment(conn, SEG_MEM, file->response, -1, file->header_len, file->size, file);
+    conn->body_bytes += file->size;
+}
+
+static void
+method_not_allowed(struct HTTPRequest *req, struct Connection *conn)
+{
+    output_error_response(req, conn, ERR_METHOD_NOT_ALLOWED);
+}
+
+static void
+not_implemented(struct HTTPRequest *req, struct Connection *conn)
+{
+    output_error_response(req, conn, ERR_NOT_IMPLEMENTED);
+}
+
+static void
+not_found(struct HTTPRequest *req, struct Connection *conn)
+{
+    output_error_response(req, conn, ERR_NOT_FOUND);
+}
+
+static void
+redirect_to_directory(struct HTTPRequest *req, struct Connection *conn)
+{
+    static const char body[] = "<html>\r\n"
+                               "<header><title>Moved Permanently</title><header>\r\n"
+                               "<body><p>The document has moved</p></body>\r\n"
+                               "</html>\r\n";
+
+    output_common_header_fields(conn, STATUS_301);
+    conn_printf(conn, "Location: %s/%s%s\r\nContent-Length: %ld\r\nContent-Type: text/html\r\n\r\n",
+                req->path, req->query ? "?" : "", req->query ? req->query : "", (long)(sizeof body - 1));
+    if (strcmp(req->method, "HEAD") != 0) {
+        queue_segment(conn, SEG_MEM, (char*)body, -1, 0, sizeof body - 1, NULL);
+        conn->body_bytes += sizeof body - 1;
+    }
+}
+
+static void
+bad_request(struct Connection *conn)
+{
+    output_error_response(NULL, conn, ERR_BAD_REQUEST);
+}
+
+static void
+output_error_response(struct HTTPRequest *req, struct Connection *conn, int err)
+{
+    struct ErrorResponse *r = &error_responses[err];
+
+    conn->status = status_code(r->head);
+    conn_write(conn, r->head, r->head_len);
+    output_date_and_connection(conn);
+    conn_write(conn, r->fields, r->fields_len);
+    if (!req || strcmp(req->method, "HEAD") != 0) {
+        // ボディは静的な文字列なので、コピーせずそのまま送る
+        queue_segment(conn, SEG_MEM, r->body, -1, 0, r->body_len, NULL);
+        conn->body_bytes += r->body_len;
+    }
+}
+
+static void
+init_error_responses(void)
+{
+    struct ErrorResponse *r;
+    int i;
+
+    for (i = 0; i < NUM_ERRORS; i++) {
+        r = &error_responses[i];
+        r->body_len = strlen(r->body);
+        r->fields_len = snprintf(r->fields, sizeof r->fields,
+                                 "Content-Length: %ld\r\nContent-Type: text/html\r\n\r\n", (long)r->body_len);
+    }
+}
+
+static void
+output_common_header_fields(struct Connection *conn, char *status)
+{
+    conn->status = status_code(status);
+    conn_write(conn, status, strlen(status));
+    output_date_and_connection(conn);
+}
+
+static void
+output_date_and_connection(struct Connection *conn)
+{
+    static const char keep_alive[] = "Connection: keep-alive\r\n";
+    static const char close[] = "Connection: close\r\n";
+    char *date;
+    size_t len;
+
+    date = cached_date_header(&len);
+    conn_write(conn, date, len);
+    if (conn->keep_alive) {
+        conn_write(conn, keep_alive, sizeof keep_alive - 1);
+    } else {
+        conn_write(conn, close, sizeof close - 1);
+    }
+}
+
+static char*
+cached_date_header(size_t *len)
+{
+    time_t now;
+
+    now = time(NULL);
+    if (now != date_header_time) {
+        memcpy(date_header, "Date: ", 6);
+        format_http_time(date_header + 6, sizeof date_header - 8, now);
+        date_header_len = strlen(date_header);
+        memcpy(date_header + date_header_len, "\r\n", 2);
+        date_header_len += 2;
+        date_header_time = now;
+    }
+    *len = date_header_len;
+    return date_header;
+}
+
+static int
+format_file_header_fields(char *buf, size_t len, struct CachedFile *file)
+{
+    return snprintf(buf, len, "Accept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\n%s%s%s%s",
+                    file->etag, file->last_modified,
+                    file->encoding ? "Content-Encoding: " : "",
+                    file->encoding ? content_encodings[file->encoding].name : "",
+                    file->encoding ? "\r\n" : "",
+                    file->vary ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+static void
+output_file_header_fields(struct Connection *conn, struct CachedFile *file)
+{
+    char buf[LINE_BUF_SIZE];
+    int n;
+
+    // ヘッダの終わりの空行もここで出す
+    n = format_file_header_fields(buf, sizeof buf - 2, file);
+    memcpy(buf + n, "\r\n", 2);
+    conn_write(conn, buf, n + 2);
+}
+
+static void
+format_http_time(char *buf, size_t len, time_t t)
+{
+    struct tm *tm;
+    tm = gmtime(&t);
+    if (!tm) {
+        log_exit("gmtime() failed: %s", strerror(errno));
+    }
+    strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", tm);
+}
+
+static int
+parse_http_date(char *str, time_t *t)
+{
+    static char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",    // IMF-fixdate
+        "%A, %d-%b-%y %H:%M:%S GMT",    // RFC 850
+        "%a %b %e %H:%M:%S %Y",         // asctime()
+        NULL
+    };
+    struct tm tm;
+    char *end;
+    int i;
+
+    for (i = 0; formats[i]; i++) {
+        memset(&tm, 0, sizeof tm);
+        end = strptime(str, formats[i], &tm);
+        if (end && *end == '\0') {
+            *t = timegm(&tm);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static struct FileInfo*
+get_fileinfo(char *docroot, char *urlpath)
+{
+    struct FileInfo *info;
+    struct stat st;
+    info = checked_malloc(sizeof(struct FileInfo));
+    info->path = build_fspath(docroot, urlpath);
+    info->ok = 0;
+    // 開いてから種類を確かめる。FIFOを開いて止まらないようO_NONBLOCKにするが、通常のファイルには影響しない
+    info->fd = open_beneath(urlpath, "", O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_NOCTTY);
+    if (info->fd < 0) {
+        return info;
+    }
+    if (fstat(info->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return info;
+    }
+    info->ok = 1;
+    info->size = st.st_size;
+    info->mtime = st.st_mtim;
+    info->ino = st.st_ino;
+    return info;
+}
+
+static char*
+build_fspath(char *docroot, char *urlpath)
+{
+    char *path;
+    path = checked_malloc(strlen(docroot) + 1 + strlen(urlpath) + 1);
+    sprintf(path, "%s/%s", docroot, urlpath);
+    return path;
+}
+
+static void
+open_docroot(char *docroot)
+{
+    docroot_fd = open(docroot, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (docroot_fd < 0) {
+        log_exit("failed to open %s: %s", docroot, strerror(errno));
+    }
+}
+
+static int
+open_beneath(char *urlpath, char *suffix, int flags)
+{
+    char buf[NAME_MAX + 1], *name;
+    int dirfd;
+
+    dirfd = lookup_dirfd(urlpath, &name);
+    if (dirfd < 0) {
+        return -1;
+    }
+    if (*suffix) {
+        if (snprintf(buf, sizeof buf, "%s%s", name, suffix) >= (int)sizeof buf) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        name = buf;
+    }
+    return resolve_beneath(dirfd, name, flags | O_CLOEXEC);
+}
+
+static int
+stat_beneath(char *urlpath, char *suffix, struct stat *st)
+{
+    char buf[NAME_MAX + 1], *name;
+    int dirfd;
+
+    dirfd = lookup_dirfd(urlpath, &name);
+    if (dirfd < 0) {
+        return -1;
+    }
+    if (snprintf(buf, sizeof buf, "%s%s", name, suffix) >= (int)sizeof buf) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    // fstatatは..を辿ってしまうので、最後の要素が.や..なら見つからないことにする
+    if (strcmp(buf, "") == 0 || strcmp(buf, ".") == 0 || strcmp(buf, "..") == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    return fstatat(dirfd, buf, st, AT_SYMLINK_NOFOLLOW);
+}
+
+static int
+lookup_dirfd(char *urlpath, char **name)
+{
+    struct DirCacheEntry *e;
+    struct stat st;
+    unsigned int h = 2166136261u;
+    char *dir, *slash;
+    size_t len, i;
+    time_t now;
+    int fd;
+
+    dir = urlpath + strspn(urlpath, "/");
+    slash = strrchr(dir, '/');
+    if (!slash) {
+        *name = dir;
+        return docroot_fd;
+    }
+    *name = slash + 1;
+    len = slash - dir;
+    // hash_stringと同じFNV-1aを、ディレクトリ部分だけに使う
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)dir[i];
+        h *= 16777619u;
+    }
+    e = &dir_cache[h & (DIR_CACHE_SIZE - 1)];
+    now = time(NULL);
+    if (e->path && e->len == len && memcmp(e->path, dir, len) == 0
+        && (cache_revalidate <= 0 || now - e->validated < cache_revalidate)) {
+        return e->fd;
+    }
+    // 開き直すか、期限の切れたものが同じディレクトリのままか確かめる
+    *slash = '\0';
+    fd = resolve_beneath(docroot_fd, dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    *slash = '/';
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (e->path && e->len == len && memcmp(e->path, dir, len) == 0
+        && e->dev == st.st_dev && e->ino == st.st_ino) {
+        close(fd);
+        e->validated = now;
+        return e->fd;
+    }
+    if (e->path) {
+        close(e->fd);
+        free(e->path);
+    }
+    e->path = checked_malloc(len);
+    memcpy(e->path, dir, len);
+    e->len = len;
+    e->fd = fd;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->validated = now;
+    return fd;
+}
+
+static int
+resolve_beneath(int dirfd, char *path, int flags)
+{
+    struct open_how how;
+    char *p;
+    int fd;
+
+    if (use_openat2) {
+        memset(&how, 0, sizeof how);
+        how.flags = flags;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        fd = syscall(SYS_openat2, dirfd, path, &how, sizeof how);
+        if (fd >= 0 || errno != ENOSYS) {
+            return fd;
+        }
+        use_openat2 = 0;
+    }
+    // openat2(2)がなければ、..の要素を含むパスは外へ出るかもしれないので拒む
+    for (p = path; p; p = strchr(p, '/')) {
+        p += strspn(p, "/");
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) {
+            errno = EXDEV;
+            return -1;
+        }
+    }
+    return openat(dirfd, *path ? path : ".", flags);
+}
+
+static void
+flush_dir_cache(void)
+{
+    int i;
+
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dir_cache[i].path) {
+            close(dir_cache[i].fd);
+            free(dir_cache[i].path);
+            dir_cache[i].path = NULL;
+        }
+    }
+}
+
+static struct CachedFile*
+open_cached_file(char *docroot, char *urlpath)
+{
+    struct CachedFile *file;
+    struct FileInfo *info;
+    struct stat st;
+    unsigned int hash;
+    int fd, enc;
+
+    if (archive.map) {
+        return open_archive_file(urlpath, ENC_IDENTITY);
+    }
+    hash = hash_string(urlpath);
+    if (file_cache.inotify_fd >= 0 && (file = file_cache_lookup(urlpath, ENC_IDENTITY, hash)) != NULL) {
+        if (revalidate_cached_file(file)) {
+            STAT_ADD(stats->file_cache_hits, 1);
+            file->refcount++;
+            return file;
+        }
+        file_cache_evict(file);
+    }
+    if (file_cache.inotify_fd >= 0) {
+        STAT_ADD(stats->file_cache_misses, 1);
+    }
+    info = get_fileinfo(docroot, urlpath);
+    if (!info->ok) {
+        free_fileinfo(info);
+        return NULL;
+    }
+    fd = info->fd;
+    file = new_cached_file(urlpath, hash, ENC_IDENTITY, info->path, fd, info->size, info->mtime, info->ino);
+    file->content_type = guess_content_type(info);
+    free(info);
+    // 使える符号化を調べておく。圧縮済みのファイルは元のファイルより新しいものだけを使う
+    for (enc = ENC_IDENTITY + 1; enc < NUM_ENCODINGS; enc++) {
+        if (stat_beneath(urlpath, content_encodings[enc].suffix, &st) == 0 && S_ISREG(st.st_mode)
+            && (st.st_mtim.tv_sec > file->mtime.tv_sec
+                || (st.st_mtim.tv_sec == file->mtime.tv_sec && st.st_mtim.tv_nsec >= file->mtime.tv_nsec))) {
+            file->encodings |= 1 << enc;
+        }
+    }
+    if (file_cache.inotify_fd >= 0 && compressible_type_p(file->content_type)
+        && file->size >= MIN_COMPRESS_SIZE && file->size <= compress_max_file) {
+        file->encodings |= 1 << ENC_GZIP;
+    }
+    file->vary = file->encodings != 0;
+    set_validators(file);
+    cache_new_file(file);
+    return file;
+}
+
+static struct CachedFile*
+new_cached_file(char *urlpath, unsigned int hash, int encoding, char *fspath, int fd,
+                off_t size, struct timespec mtime, ino_t ino)
+{
+    struct CachedFile *file;
+
+    file = checked_malloc(sizeof(struct CachedFile));
+    file->urlpath = checked_malloc(strlen(urlpath) + 1);
+    strcpy(file->urlpath, urlpath);
+    file->fspath = fspath;
+    file->hash = hash;
+    file->encoding = encoding;
+    file->sidecar = 0;
+    file->listing = 0;
+    file->fd = fd;
+    file->size = size;
+    file->source_size = size;
+    file->mtime = mtime;
+    file->ino = ino;
+    file->content_type = NULL;
+    file->encodings = 0;
+    file->vary = 0;
+    file->response = NULL;
+    file->header_len = 0;
+    file->validated = time(NULL);
+    file->refcount = 1;
+    file->watch = NULL;
+    file->name = NULL;
+    return file;
+}
+
+static void
+cache_new_file(struct CachedFile *file)
+{
+    if (file_cache.inotify_fd < 0) {
+        return;
+    }
+    file_cache_insert(file);
+    if (file->watch && file->fd >= 0
+        && file->size <= content_cache_max_file && (size_t)file->size <= content_cache_size) {
+        load_file_content(file);
+    }
+}
+
+static struct CachedFile*
+open_encoded_file(struct CachedFile *file, int encodings)
+{
+    struct CachedFile *encoded;
+    unsigned int hash;
+    int enc;
+
+    for (enc = ENC_IDENTITY + 1; enc < NUM_ENCODINGS; enc++) {
+        if (!(encodings & (1 << enc))) {
+            continue;
+        }
+        if (archive.map) {
+            encoded = open_archive_file(file->urlpath, enc);
+            if (encoded) {
+                return encoded;
+            }
+            continue;
+        }
+        hash = file->hash + enc;
+        if (file_cache.inotify_fd >= 0 && (encoded = file_cache_lookup(file->urlpath, enc, hash)) != NULL) {
+            if (revalidate_cached_file(encoded)) {
+                STAT_ADD(stats->file_cache_hits, 1);
+                encoded->refcount++;
+                return encoded;
+            }
+            file_cache_evict(encoded);
+        }
+        if (file_cache.inotify_fd >= 0) {
+            STAT_ADD(stats->file_cache_misses, 1);
+        }
+        encoded = open_sidecar_file(file, enc, hash);
+        if (!encoded && enc == ENC_GZIP) {
+            encoded = compress_cached_file(file, hash);
+        }
+        if (encoded) {
+            return encoded;
+        }
+        // 次からは試さない。ファイルが変われば元のエントリごと作り直される
+        file->encodings &= ~(1 << enc);
+    }
+    return NULL;
+}
+
+static struct CachedFile*
+open_sidecar_file(struct CachedFile *file, int encoding, unsigned int hash)
+{
+    struct CachedFile *encoded;
+    struct stat st;
+    char *path;
+    int fd;
+
+    path = checked_malloc(strlen(file->fspath) + strlen(content_encodings[encoding].suffix) + 1);
+    sprintf(path, "%s%s", file->fspath, content_encodings[encoding].suffix);
+    if (stat_beneath(file->urlpath, content_encodings[encoding].suffix, &st) < 0 || !S_ISREG(st.st_mode)
+        || st.st_mtim.tv_sec < file->mtime.tv_sec
+        || (st.st_mtim.tv_sec == file->mtime.tv_sec && st.st_mtim.tv_nsec < file->mtime.tv_nsec)) {
+        free(path);
+        return NULL;
+    }
+    fd = open_beneath(file->urlpath, content_encodings[encoding].suffix, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        free(path);
+        return NULL;
+    }
+    encoded = new_cached_file(file->urlpath, hash, encoding, path, fd, st.st_size, st.st_mtim, st.st_ino);
+    encoded->sidecar = 1;
+    encoded->content_type = file->content_type;
+    encoded->vary = 1;
+    set_validators(encoded);
+    cache_new_file(encoded);
+    return encoded;
+}
+
+static struct CachedFile*
+compress_cached_file(struct CachedFile *file, unsigned int hash)
+{
+    struct CachedFile *encoded;
+    char *src, *dst, *path, *p;
+    size_t n;
+    int len;
+
+    if (file_cache.inotify_fd < 0 || file->size > compress_max_file) {
+        return NULL;
+    }
+    src = file->response ? file->response + file->header_len : read_file_content(file);
+    if (!src) {
+        return NULL;
+    }
+    dst = gzip_content(src, file->size, &n);
+    if (!file->response) {
+        free(src);
+    }
+    if (!dst) {
+        return NULL;
+    }
+    if (n + LINE_BUF_SIZE > content_cache_size) {
+        free(dst);
+        return NULL;
+    }
+    path = checked_malloc(strlen(file->fspath) + 1);
+    strcpy(path, file->fspath);
+    encoded = new_cached_file(file->urlpath, hash, ENC_GZIP, path, -1, n, file->mtime, file->ino);
+    encoded->source_size = file->size;
+    encoded->listing = file->listing;
+    encoded->content_type = file->content_type;
+    encoded->vary = 1;
+    set_validators(encoded);
+    file_cache_insert(encoded);
+    if (!encoded->watch) {
+        // 監視できないと変更に気づけないので、キャッシュには載せず元のファイルを送る
+        free(dst);
+        release_cached_file(encoded);
+        return NULL;
+    }
+    p = render_response_header(encoded, &len);
+    memcpy(p + len, dst, encoded->size);
+    free(dst);
+    cache_file_content(encoded, p, len);
+    return encoded;
+}
+
+static char*
+gzip_content(char *src, off_t size, size_t *len)
+{
+    z_stream z;
+    char *dst;
+    size_t cap;
+
+    memset(&z, 0, sizeof z);
+    // windowBitsに16を足すとzlibではなくgzipの形式で出力される
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        log_exit("deflateInit2() failed");
+    }
+    cap = deflateBound(&z, size);
+    dst = checked_malloc(cap);
+    z.next_in = (Bytef*)src;
+    z.avail_in = size;
+    z.next_out = (Bytef*)dst;
+    z.avail_out = cap;
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+        log_exit("deflate() failed");
+    }
+    deflateEnd(&z);
+    if ((off_t)z.total_out >= size) {
+        free(dst);
+        return NULL;
+    }
+    *len = z.total_out;
+    return dst;
+}
+
+static char*
+read_file_content(struct CachedFile *file)
+{
+    char *buf;
+    ssize_t n;
+    off_t off;
+
+    buf = checked_malloc(file->size + 1);
+    for (off = 0; off < file->size; off += n) {
+        n = pread(file->fd, buf + off, file->size - off, off);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n <= 0) {
+            free(buf);
+            return NULL;
+        }
+    }
+    return buf;
+}
+
+static struct CachedFile*
+open_directory_index(struct HTTPRequest *req, char *docroot)
+{
+    struct CachedFile *file;
+    char *path;
+
+    path = checked_malloc(strlen(req->path) + strlen(INDEX_FILE_NAME) + 1);
+    sprintf(path, "%s%s", req->path, INDEX_FILE_NAME);
+    file = open_cached_file(docroot, path);
+    free(path);
+    // アーカイブにはディレクトリの一覧を作れるだけの情報がない
+    if (file || !autoindex || archive.map) {
+        return file;
+    }
+    return open_directory_listing(docroot, req->path, req->query && query_param_p(req->query, "format=json"));
+}
+
+static struct CachedFile*
+open_directory_listing(char *docroot, char *urlpath, int json)
+{
+    struct CachedFile *file;
+    struct ListingEntry *entries;
+    struct stat st;
+    unsigned int hash;
+    char *key, *names, *body, *dir, *p;
+    size_t n, len;
+    int fd, header_len;
+
+    // JSONの一覧は、実際のリクエストのパスには現れない?付きのキーでキャッシュに載せる
+    key = checked_malloc(strlen(urlpath) + strlen(LISTING_JSON_KEY) + 1);
+    sprintf(key, "%s%s", urlpath, json ? LISTING_JSON_KEY : "");
+    hash = hash_string(key);
+    if (file_cache.inotify_fd >= 0 && (file = file_cache_lookup(key, ENC_IDENTITY, hash)) != NULL) {
+        if (revalidate_cached_file(file)) {
+            STAT_ADD(stats->file_cache_hits, 1);
+            file->refcount++;
+            free(key);
+            return file;
+        }
+        file_cache_evict(file);
+    }
+    if (file_cache.inotify_fd >= 0) {
+        STAT_ADD(stats->file_cache_misses, 1);
+    }
+    dir = urlpath + strspn(urlpath, "/");
+    fd = resolve_beneath(docroot_fd, *dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(key);
+        return NULL;
+    }
+    entries = read_directory(fd, &names, &n);
+    close(fd);
+    if (!entries) {
+        free(key);
+        return NULL;
+    }
+    body = render_directory_listing(urlpath, entries, n, json, &len);
+    free(entries);
+    free(names);
+    file = new_cached_file(key, hash, ENC_IDENTITY, build_fspath(docroot, urlpath), -1, len, st.st_mtim, st.st_ino);
+    free(key);
+    file->listing = 1;
+    file->content_type = json ? "application/json" : "text/html";
+    if (file_cache.inotify_fd >= 0 && len + LINE_BUF_SIZE <= content_cache_size
+        && (off_t)len >= MIN_COMPRESS_SIZE && (off_t)len <= compress_max_file) {
+        file->encodings = 1 << ENC_GZIP;
+    }
+    file->vary = file->encodings != 0;
+    set_validators(file);
+    p = render_response_header(file, &header_len);
+    memcpy(p + header_len, body, len);
+    free(body);
+    if (file_cache.inotify_fd >= 0 && len + LINE_BUF_SIZE <= content_cache_size) {
+        file_cache_insert(file);
+    }
+    if (file->watch) {
+        cache_file_content(file, p, header_len);
+    } else {
+        // キャッシュに載せられなくても、組み立てた一覧はこのリクエストに使い、release_cached_fileで解放する
+        file->encodings = 0;
+        file->response = p;
+        file->header_len = header_len;
+    }
+    return file;
+}
+
+static struct ListingEntry*
+read_directory(int dirfd, char **names, size_t *n)
+{
+    struct LinuxDirent64 *d;
+    struct ListingEntry *entries;
+    struct stat st;
+    char *buf;
+    size_t i, names_len = 0, names_cap = 0, entries_cap = 64, len;
+    long nread, off;
+
+    buf = checked_malloc(GETDENTS_BUF_SIZE);
+    entries = checked_malloc(entries_cap * sizeof(struct ListingEntry));
+    *names = NULL;
+    *n = 0;
+    for (;;) {
+        nread = syscall(SYS_getdents64, dirfd, buf, GETDENTS_BUF_SIZE);
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("getdents64(2) failed: %s", strerror(errno));
+            free(buf);
+            free(entries);
+            free(*names);
+            return NULL;
+        }
+        if (nread == 0) {
+            break;
+        }
+        for (off = 0; off < nread; off += d->d_reclen) {
+            d = (struct LinuxDirent64*)(buf + off);
+            // .と..、隠しファイルは載せない。d_typeでわかるものは、送れない種類をstatせずに飛ばす
+            if (d->d_name[0] == '.'
+                || (d->d_type != DT_UNKNOWN && d->d_type != DT_REG && d->d_type != DT_DIR)) {
+                continue;
+            }
+            // O_NOFOLLOWで開くので、シンボリックリンクは送れない
+            if (fstatat(dirfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0
+                || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+                continue;
+            }
+            if (*n == entries_cap) {
+                entries_cap *= 2;
+                entries = realloc(entries, entries_cap * sizeof(struct ListingEntry));
+                if (!entries) {
+                    log_exit("failed to allocate memory");
+                }
+            }
+            len = strlen(d->d_name) + 1;
+            grow_buffer(names, &names_cap, names_len + len);
+            memcpy(*names + names_len, d->d_name, len);
+            entries[*n].name_off = names_len;
+            entries[*n].dir = S_ISDIR(st.st_mode);
+            entries[*n].size = st.st_size;
+            entries[*n].mtime = st.st_mtime;
+            names_len += len;
+            (*n)++;
+        }
+    }
+    free(buf);
+    for (i = 0; i < *n; i++) {
+        entries[i].name = *names + entries[i].name_off;
+    }
+    qsort(entries, *n, sizeof(struct ListingEntry), compare_listing_entries);
+    return entries;
+}
+
+static char*
+render_directory_listing(char *urlpath, struct ListingEntry *entries, size_t n, int json, size_t *len)
+{
+    struct tm tm;
+    char *buf = NULL, mtime[TIME_BUF_SIZE];
+    size_t cap = 0, i;
+
+    *len = 0;
+    if (json) {
+        buf_printf(&buf, len, &cap, "{\"path\":\"");
+        buf_append_escaped(&buf, len, &cap, urlpath, 1);
+        buf_printf(&buf, len, &cap, "\",\"entries\":[");
+        for (i = 0; i < n; i++) {
+            buf_printf(&buf, len, &cap, "%s\n{\"name\":\"", i ? "," : "");
+            buf_append_escaped(&buf, len, &cap, entries[i].name, 1);
+            buf_printf(&buf, len, &cap, "\",\"type\":\"%s\",\"size\":%lld,\"mtime\":%lld}",
+                       entries[i].dir ? "directory" : "file",
+                       (long long)entries[i].size, (long long)entries[i].mtime);
+        }
+        buf_printf(&buf, len, &cap, "\n]}\n");
+        return buf;
+    }
+    buf_printf(&buf, len, &cap, "<!DOCTYPE html>\n<html>\n<head><meta charset=\"utf-8\"><title>Index of ");
+    buf_append_escaped(&buf, len, &cap, urlpath, 0);
+    buf_printf(&buf, len, &cap, "</title></head>\n<body>\n<h1>Index of ");
+    buf_append_escaped(&buf, len, &cap, urlpath, 0);
+    buf_printf(&buf, len, &cap, "</h1>\n<table>\n<tr><th>Name</th><th>Last modified</th><th>Size</th></tr>\n");
+    if (strcmp(urlpath, "/") != 0) {
+        buf_printf(&buf, len, &cap, "<tr><td><a href=\"../\">../</a></td><td></td><td></td></tr>\n");
+    }
+    for (i = 0; i < n; i++) {
+        gmtime_r(&entries[i].mtime, &tm);
+        strftime(mtime, sizeof mtime, "%Y-%m-%d %H:%M", &tm);
+        buf_printf(&buf, len, &cap, "<tr><td><a href=\"");
+        buf_append_escaped(&buf, len, &cap, entries[i].name, 0);
+        buf_printf(&buf, len, &cap, "%s\">", entries[i].dir ? "/" : "");
+        buf_append_escaped(&buf, len, &cap, entries[i].name, 0);
+        if (entries[i].dir) {
+            buf_printf(&buf, len, &cap, "/</a></td><td>%s</td><td>-</td></tr>\n", mtime);
+        } else {
+            buf_printf(&buf, len, &cap, "</a></td><td>%s</td><td>%lld</td></tr>\n",
+                       mtime, (long long)entries[i].size);
+        }
+    }
+    buf_printf(&buf, len, &cap, "</table>\n</body>\n</html>\n");
+    return buf;
+}
+
+static void
+buf_append_escaped(char **buf, size_t *len, size_t *cap, const char *s, int json)
+{
+    const char *rep;
+    unsigned char c;
+
+    for (; *s; s++) {
+        c = *s;
+        rep = NULL;
+        if (json) {
+            if (c == '"') {
+                rep = "\\\"";
+            } else if (c == '\\') {
+                rep = "\\\\";
+            } else if (c < 0x20) {
+                buf_printf(buf, len, cap, "\\u%04x", c);
+                continue;
+            }
+        } else {
+            if (c == '&') {
+                rep = "&amp;";
+            } else if (c == '<') {
+                rep = "&lt;";
+            } else if (c == '>') {
+                rep = "&gt;";
+            } else if (c == '"') {
+                rep = "&quot;";
+            } else if (c == '\'') {
+                rep = "&#39;";
+            }
+        }
+        // UTF-8の名前はそのまま書く
+        if (rep) {
+            buf_printf(buf, len, cap, "%s", rep);
+        } else {
+            grow_buffer(buf, cap, *len + 2);
+            (*buf)[(*len)++] = c;
+            (*buf)[*len] = '\0';
+        }
+    }
+}
+
+static int
+compare_listing_entries(const void *a, const void *b)
+{
+    const struct ListingEntry *x = a, *y = b;
+
+    if (x->dir != y->dir) {
+        return y->dir - x->dir;
+    }
+    return strcmp(x->name, y->name);
+}
+
+static int
+query_param_p(char *query, char *param)
+{
+    size_t len = strlen(param);
+    char *p;
+
+    for (p = query; p; p = strchr(p, '&')) {
+        p += strspn(p, "&");
+        if (strncmp(p, param, len) == 0 && (p[len] == '&' || p[len] == '\0')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+pack_docroot(char *docroot, char *path)
+{
+    struct Packer packer;
+    struct PackHeader header;
+    char *tmp;
+
+    memset(&packer, 0, sizeof packer);
+    packer.docroot = docroot;
+    // 書きかけのアーカイブを読まれないよう、別名で作ってから置き換える
+    tmp = checked_malloc(strlen(path) + strlen(".tmp") + 1);
+    sprintf(tmp, "%s.tmp", path);
+    packer.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (packer.fd < 0) {
+        log_exit("failed to open %s: %s", tmp, strerror(errno));
+    }
+    packer.offset = PACK_ALIGN;
+    pack_directory(&packer, "/");
+    qsort_r(packer.entries, packer.nentries, sizeof(struct PackEntry), compare_pack_entries, packer.strings);
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, PACK_MAGIC, sizeof header.magic);
+    header.version = PACK_VERSION;
+    header.nentries = packer.nentries;
+    header.strings_offset = packer.offset;
+    header.index_offset = (packer.offset + packer.strings_len + 7) & ~(uint64_t)7;
+    header.size = header.index_offset + packer.nentries * sizeof(struct PackEntry);
+    pack_write(&packer, packer.strings, packer.strings_len, header.strings_offset);
+    pack_write(&packer, (char*)packer.entries, packer.nentries * sizeof(struct PackEntry), header.index_offset);
+    pack_write(&packer, (char*)&header, sizeof header, 0);
+    if (ftruncate(packer.fd, header.size) < 0 || fsync(packer.fd) < 0) {
+        log_exit("failed to write %s: %s", tmp, strerror(errno));
+    }
+    close(packer.fd);
+    if (rename(tmp, path) < 0) {
+        log_exit("failed to rename %s: %s", tmp, strerror(errno));
+    }
+    fprintf(stderr, "%s: %lu entries, %llu bytes\n", path, (unsigned long)packer.nentries,
+            (unsigned long long)header.size);
+    free(tmp);
+    free(packer.entries);
+    free(packer.strings);
+}
+
+static void
+pack_directory(struct Packer *packer, char *urlpath)
+{
+    struct ListingEntry *entries;
+    char *names, *dir, *path;
+    size_t n, i;
+    int fd;
+
+    dir = urlpath + strspn(urlpath, "/");
+    fd = resolve_beneath(docroot_fd, *dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        log_exit("failed to open %s: %s", urlpath, strerror(errno));
+    }
+    entries = read_directory(fd, &names, &n);
+    close(fd);
+    if (!entries) {
+        log_exit("failed to read %s", urlpath);
+    }
+    // 隠しファイルとシンボリックリンクは一覧と同じく載せない
+    for (i = 0; i < n; i++) {
+        path = checked_malloc(strlen(urlpath) + strlen(entries[i].name) + 2);
+        sprintf(path, "%s%s%s", urlpath, entries[i].name, entries[i].dir ? "/" : "");
+        if (entries[i].dir) {
+            pack_directory(packer, path);
+        } else {
+            pack_file(packer, path);
+        }
+        free(path);
+    }
+    free(entries);
+    free(names);
+}
+
+static void
+pack_file(struct Packer *packer, char *urlpath)
+{
+    struct CachedFile *file, *variants[NUM_ENCODINGS];
+    struct FileInfo *info;
+    char *bodies[NUM_ENCODINGS];
+    size_t n;
+    int enc;
+
+    info = get_fileinfo(packer->docroot, urlpath);
+    if (!info->ok) {
+        free_fileinfo(info);
+        return;
+    }
+    file = new_cached_file(urlpath, 0, ENC_IDENTITY, info->path, info->fd, info->size, info->mtime, info->ino);
+    file->content_type = guess_content_type(info);
+    free(info);
+    variants[ENC_IDENTITY] = file;
+    bodies[ENC_IDENTITY] = read_file_content(file);
+    if (!bodies[ENC_IDENTITY]) {
+        log_exit("failed to read %s", file->fspath);
+    }
+    // 符号化した表現は、サーバーがその場で選ぶものと同じく、新しい圧縮済みファイルかgzipで縮めたもの
+    for (enc = ENC_IDENTITY + 1; enc < NUM_ENCODINGS; enc++) {
+        variants[enc] = open_sidecar_file(file, enc, 0);
+        bodies[enc] = NULL;
+        if (variants[enc] && !(bodies[enc] = read_file_content(variants[enc]))) {
+            log_exit("failed to read %s", variants[enc]->fspath);
+        }
+    }
+    if (!variants[ENC_GZIP] && compressible_type_p(file->content_type)
+        && file->size >= MIN_COMPRESS_SIZE && file->size <= compress_max_file
+        && (bodies[ENC_GZIP] = gzip_content(bodies[ENC_IDENTITY], file->size, &n)) != NULL) {
+        variants[ENC_GZIP] = new_cached_file(urlpath, 0, ENC_GZIP, NULL, -1, n, file->mtime, file->ino);
+        variants[ENC_GZIP]->source_size = file->size;
+        variants[ENC_GZIP]->content_type = file->content_type;
+        variants[ENC_GZIP]->vary = 1;
+        set_validators(variants[ENC_GZIP]);
+    }
+    for (enc = ENC_IDENTITY + 1; enc < NUM_ENCODINGS; enc++) {
+        if (variants[enc]) {
+            file->encodings |= 1 << enc;
+        }
+    }
+    file->vary = file->encodings != 0;
+    set_validators(file);
+    for (enc = ENC_IDENTITY; enc < NUM_ENCODINGS; enc++) {
+        if (variants[enc]) {
+            pack_entry(packer, variants[enc], bodies[enc]);
+            free(bodies[enc]);
+            release_cached_file(variants[enc]);
+        }
+    }
+}
+
+static void
+pack_entry(struct Packer *packer, struct CachedFile *file, char *body)
+{
+    struct PackEntry *entry;
+    uint64_t body_offset;
+    char *p;
+    int len;
+
+    // ヘッダはボディの直前に置き、responseとしてそのまま使えるようにする
+    p = render_response_header(file, &len);
+    memcpy(p + len, body, file->size);
+    body_offset = (packer->offset + len + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+    pack_write(packer, p, len + file->size, body_offset - len);
+    free(p);
+    packer->offset = body_offset + file->size;
+    if (packer->nentries == packer->entries_cap) {
+        packer->entries_cap = packer->entries_cap ? packer->entries_cap * 2 : 64;
+        packer->entries = realloc(packer->entries, packer->entries_cap * sizeof(struct PackEntry));
+        if (!packer->entries) {
+            log_exit("failed to allocate memory");
+        }
+    }
+    entry = &packer->entries[packer->nentries++];
+    memset(entry, 0, sizeof(struct PackEntry));
+    entry->header_offset = body_offset - len;
+    entry->size = file->size;
+    entry->source_size = file->source_size;
+    entry->mtime = file->mtime.tv_sec;
+    entry->path_len = strlen(file->urlpath);
+    // 同じファイルの表現は続けて書くので、パスとContent-Typeは直前の項目と同じなら使い回す
+    if (packer->nentries > 1 && strcmp(packer->strings + entry[-1].path_offset, file->urlpath) == 0) {
+        entry->path_offset = entry[-1].path_offset;
+    } else {
+        entry->path_offset = pack_string(packer, file->urlpath);
+    }
+    if (packer->nentries > 1 && strcmp(packer->strings + entry[-1].type_offset, file->content_type) == 0) {
+        entry->type_offset = entry[-1].type_offset;
+    } else {
+        entry->type_offset = pack_string(packer, file->content_type);
+    }
+    entry->header_len = len;
+    entry->encoding = file->encoding;
+    entry->encodings = file->encodings;
+    memcpy(entry->etag, file->etag, ETAG_BUF_SIZE);
+    memcpy(entry->last_modified, file->last_modified, TIME_BUF_SIZE);
+}
+
+static void
+pack_write(struct Packer *packer, char *buf, size_t len, uint64_t offset)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = pwrite(packer->fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            log_exit("failed to write archive: %s", strerror(errno));
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+static uint32_t
+pack_string(struct Packer *packer, char *s)
+{
+    size_t off = packer->strings_len, len = strlen(s) + 1;
+
+    grow_buffer(&packer->strings, &packer->strings_cap, off + len);
+    memcpy(packer->strings + off, s, len);
+    packer->strings_len += len;
+    return off;
+}
+
+static int
+compare_pack_entries(const void *a, const void *b, void *strings)
+{
+    const struct PackEntry *x = a, *y = b;
+    int n;
+
+    n = strcmp((char*)strings + x->path_offset, (char*)strings + y->path_offset);
+    if (n != 0) {
+        return n;
+    }
+    return x->encoding - y->encoding;
+}
+
+static void
+open_archive(char *path)
+{
+    struct PackHeader *header;
+    struct PackEntry *entry;
+    struct CachedFile *file;
+    struct timespec mtime;
+    struct stat st;
+    uint64_t strings_len;
+    uint32_t i;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        log_exit("failed to open %s: %s", path, strerror(errno));
+    }
+    if ((size_t)st.st_size < sizeof(struct PackHeader)) {
+        log_exit("%s is not an archive", path);
+    }
+    archive.size = st.st_size;
+    archive.map = mmap(NULL, archive.size, PROT_READ, MAP_SHARED, fd, 0);
+    if (archive.map == MAP_FAILED) {
+        log_exit("mmap(2) failed: %s", strerror(errno));
+    }
+    close(fd);
+    // 壊れたアーカイブでマップの外を読まないよう、すべての項目の範囲を確かめておく
+    header = (struct PackHeader*)archive.map;
+    if (memcmp(header->magic, PACK_MAGIC, sizeof header->magic) != 0 || header->version != PACK_VERSION
+        || header->size != archive.size || header->strings_offset > header->index_offset
+        || header->index_offset > archive.size || header->index_offset % 8 != 0
+        || header->nentries > (archive.size - header->index_offset) / sizeof(struct PackEntry)) {
+        log_exit("%s is not a valid archive", path);
+    }
+    archive.entries = (struct PackEntry*)(archive.map + header->index_offset);
+    archive.strings = archive.map + header->strings_offset;
+    archive.nentries = header->nentries;
+    strings_len = header->index_offset - header->strings_offset;
+    for (i = 0; i < archive.nentries; i++) {
+        entry = &archive.entries[i];
+        if (entry->path_offset >= strings_len || entry->path_len >= strings_len - entry->path_offset
+            || archive.strings[entry->path_offset + entry->path_len] != '\0'
+            || strlen(archive.strings + entry->path_offset) != entry->path_len
+            || entry->type_offset >= strings_len
+            || !memchr(archive.strings + entry->type_offset, '\0', strings_len - entry->type_offset)
+            || entry->header_offset > header->strings_offset
+            || entry->header_len > header->strings_offset - entry->header_offset
+            || entry->size > header->strings_offset - entry->header_offset - entry->header_len
+            || entry->encoding >= NUM_ENCODINGS
+            || !memchr(entry->etag, '\0', ETAG_BUF_SIZE) || !memchr(entry->last_modified, '\0', TIME_BUF_SIZE)
+            || (i > 0 && compare_pack_entries(entry - 1, entry, archive.strings) >= 0)) {
+            log_exit("%s: broken entry %lu", path, (unsigned long)i);
+        }
+    }
+    // CachedFileはforkの前に作っておき、アーカイブが持つ参照で生かし続ける
+    archive.files = checked_malloc(archive.nentries * sizeof(struct CachedFile*) + 1);
+    for (i = 0; i < archive.nentries; i++) {
+        entry = &archive.entries[i];
+        mtime.tv_sec = entry->mtime;
+        mtime.tv_nsec = 0;
+        file = new_cached_file(archive.strings + entry->path_offset, 0, entry->encoding, NULL, -1,
+                               entry->size, mtime, 0);
+        file->source_size = entry->source_size;
+        file->content_type = archive.strings + entry->type_offset;
+        file->encodings = entry->encodings;
+        file->vary = entry->encoding != ENC_IDENTITY || entry->encodings != 0;
+        memcpy(file->etag, entry->etag, ETAG_BUF_SIZE);
+        memcpy(file->last_modified, entry->last_modified, TIME_BUF_SIZE);
+        file->response = archive.map + entry->header_offset;
+        file->header_len = entry->header_len;
+        archive.files[i] = file;
+    }
+}
+
+static uint32_t
+archive_lower_bound(char *urlpath, int encoding)
+{
+    struct PackEntry *entry;
+    uint32_t lo = 0, hi = archive.nentries, mid;
+    int n;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        entry = &archive.entries[mid];
+        n = strcmp(archive.strings + entry->path_offset, urlpath);
+        if (n < 0 || (n == 0 && entry->encoding < encoding)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static struct CachedFile*
+open_archive_file(char *urlpath, int encoding)
+{
+    struct PackEntry *entry;
+    uint32_t i;
+
+    i = archive_lower_bound(urlpath, encoding);
+    if (i == archive.nentries) {
+        return NULL;
+    }
+    entry = &archive.entries[i];
+    if (entry->encoding != encoding || strcmp(archive.strings + entry->path_offset, urlpath) != 0) {
+        return NULL;
+    }
+    archive.files[i]->refcount++;
+    return archive.files[i];
+}
+
+static int
+archive_directory_p(char *urlpath)
+{
+    struct PackEntry *entry;
+    char *path;
+    size_t len;
+    uint32_t i;
+
+    len = strlen(urlpath);
+    path = checked_malloc(len + 2);
+    sprintf(path, "%s/", urlpath);
+    i = archive_lower_bound(path, ENC_IDENTITY);
+    free(path);
+    if (i == archive.nentries) {
+        return 0;
+    }
+    entry = &archive.entries[i];
+    return strncmp(archive.strings + entry->path_offset, urlpath, len) == 0
+        && archive.strings[entry->path_offset + len] == '/';
+}
+
+static void
+add_proxy_route(char *spec)
+{
+    struct ProxyRoute *route;
+    struct sockaddr_un *sun;
+    char *eq, *buf, *host, *port;
+    int err;
+
+    eq = strchr(spec, '=');
+    if (spec[0] != '/' || !eq) {
+        log_exit("--proxy must be PREFIX=host:port or PREFIX=unix:PATH: %s", spec);
+    }
+    proxy_routes = realloc(proxy_routes, sizeof(struct ProxyRoute) * (nproxy_routes + 1));
+    if (!proxy_routes) {
+        log_exit("failed to allocate memory");
+    }
+    route = &proxy_routes[nproxy_routes++];
+    memset(route, 0, sizeof(struct ProxyRoute));
+    route->prefix_len = eq - spec;
+    route->prefix = checked_malloc(route->prefix_len + 1);
+    memcpy(route->prefix, spec, route->prefix_len);
+    route->prefix[route->prefix_len] = '\0';
+    route->name = eq + 1;
+    if (strncmp(route->name, "unix:", strlen("unix:")) == 0) {
+        sun = (struct sockaddr_un*)&route->addr;
+        if (strlen(route->name + strlen("unix:")) >= sizeof sun->sun_path) {
+            log_exit("socket path is too long: %s", route->name);
+        }
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, route->name + strlen("unix:"));
+        route->addrlen = sizeof(struct sockaddr_un);
+        return;
+    }
+    buf = checked_malloc(strlen(route->name) + 1);
+    strcpy(buf, route->name);
+    if (split_host_port(buf, &host, &port) < 0) {
+        log_exit("upstream address must be host:port or unix:PATH: %s", route->name);
+    }
+    free(buf);
+    if ((err = resolve_proxy_route(route)) != 0) {
+        log_exit("getaddrinfo(3) failed for %s: %s", route->name, gai_strerror(err));
+    }
+}
+
+static int
+resolve_proxy_route(struct ProxyRoute *route)
+{
+    struct addrinfo hints, *res;
+    struct Upstream *up;
+    char *buf, *host, *port;
+    int err;
+
+    // 転送先の名前は起動時とSIGHUPのときだけ引き、ワーカーはその最初のアドレスへつなぐ
+    buf = checked_malloc(strlen(route->name) + 1);
+    strcpy(buf, route->name);
+    split_host_port(buf, &host, &port);
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    err = getaddrinfo(host, port, &hints, &res);
+    free(buf);
+    if (err != 0) {
+        return err;
+    }
+    if (res->ai_addrlen != route->addrlen || memcmp(&route->addr, res->ai_addr, res->ai_addrlen) != 0) {
+        memcpy(&route->addr, res->ai_addr, res->ai_addrlen);
+        route->addrlen = res->ai_addrlen;
+        // 前のアドレスへつないだ接続は使い回さない
+        while ((up = route->idle) != NULL) {
+            route->idle = up->next;
+            route->nidle--;
+            close(up->fd);
+            free(up);
+        }
+    }
+    freeaddrinfo(res);
+    return 0;
+}
+
+static struct ProxyRoute*
+lookup_proxy_route(char *path)
+{
+    struct ProxyRoute *route, *best = NULL;
+    int i;
+
+    for (i = 0; i < nproxy_routes; i++) {
+        route = &proxy_routes[i];
+        // /apiは/apiと/api/...に一致し、/apixには一致しない
+        if (strncmp(path, route->prefix, route->prefix_len) == 0
+            && (route->prefix[route->prefix_len - 1] == '/' || path[route->prefix_len] == '\0'
+                || path[route->prefix_len] == '/')
+            && (!best || route->prefix_len > best->prefix_len)) {
+            best = route;
+        }
+    }
+    return best;
+}
+
+static void
+do_proxy_response(struct HTTPRequest *req, struct Connection *conn, struct ProxyRoute *route)
+{
+    static const char continue_100[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    struct ProxyExchange *px;
+    struct HTTPHeaderField *h;
+    char *name, *val, addr[INET6_ADDRSTRLEN];
+    int i;
+
+    if (conn->h2) {
+        // HTTP/2のストリームは1つの接続に多重化されているので、転送先を待つと他のストリームまで止まってしまう
+        not_implemented(req, conn);
+        return;
+    }
+    px = checked_malloc(sizeof(struct ProxyExchange));
+    memset(px, 0, sizeof(struct ProxyExchange));
+    px->route = route;
+    // ログと統計は応答を終えてから書くので、リクエストを受信バッファの外へ写しておく
+    px->req = *req;
+    px->req.buf = checked_malloc(req->header_len);
+    memcpy(px->req.buf, req->buf, req->header_len);
+    px->req.method = px->req.buf + (req->method - req->buf);
+    px->req.path = px->req.buf + (req->path - req->buf);
+    px->req.query = req->query ? px->req.buf + (req->query - req->buf) : NULL;
+    px->head_only = strcmp(req->method, "HEAD") == 0;
+    px->chunked_body = req->chunked;
+    // 持続的接続を使い回すと転送先が先に閉じていることがある。副作用のないリクエストだけは新しい接続で送り直せる
+    px->replayable = !req->chunked && req->length == 0
+                     && strcmp(req->method, "POST") != 0 && strcmp(req->method, "PATCH") != 0;
+
+    // HTTP/1.0のクライアントにはチャンクを返せないので、転送先にもHTTP/1.0で頼む
+    buf_printf(&px->out, &px->olen, &px->ocap, "%s %s%s%s HTTP/1.%d\r\n", req->method, req->path,
+               req->query ? "?" : "", req->query ? req->query : "", req->protocol_minor_version >= 1 ? 1 : 0);
+    for (i = 0; i < req->nheaders; i++) {
+        h = &req->header[i];
+        name = req->buf + h->name.off;
+        if (proxy_hop_header_p(name, h->name.len) || strcasecmp(name, "X-Forwarded-For") == 0) {
+            continue;
+        }
+        buf_printf(&px->out, &px->olen, &px->ocap, "%s: %s\r\n", name, req->buf + h->value.off);
+    }
+    lookup_peer_address(conn);
+    if (conn->peer_family == AF_INET || conn->peer_family == AF_INET6) {
+        inet_ntop(conn->peer_family, conn->peer_addr, addr, sizeof addr);
+        val = NULL;
+        for (i = 0; i < req->nheaders; i++) {
+            if (strcasecmp(req->buf + req->header[i].name.off, "X-Forwarded-For") == 0) {
+                val = req->buf + req->header[i].value.off;
+            }
+        }
+        buf_printf(&px->out, &px->olen, &px->ocap, "X-Forwarded-For: %s%s%s\r\n",
+                   val ? val : "", val ? ", " : "", addr);
+    }
+    buf_printf(&px->out, &px->olen, &px->ocap, "%sConnection: keep-alive\r\n\r\n",
+               req->chunked ? "Transfer-Encoding: chunked\r\n" : "");
+
+    if (req->chunked || req->length > 0) {
+        // ボディは転送先へ流すので、handle_requestにはボディの受け取り手がいることを知らせる
+        conn->body_sink = proxy_body_sink;
+        val = lookup_known_header(req, HDR_EXPECT);
+        if (val && strcasecmp(val, "100-continue") == 0) {
+            conn_write(conn, continue_100, sizeof continue_100 - 1);
+            conn->keep_alive = keep_alive_p(req, conn);
+        }
+    }
+    conn->proxy = px;
+    connect_upstream(px);
+}
+
+static int
+proxy_hop_header_p(char *name, size_t len)
+{
+    static const char *hop_headers[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Transfer-Encoding", "Upgrade",
+        "Expect", "HTTP2-Settings", NULL
+    };
+    int i;
+
+    for (i = 0; hop_headers[i]; i++) {
+        if (len == strlen(hop_headers[i]) && strncasecmp(name, hop_headers[i], len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+header_token_p(char *val, size_t len, char *token)
+{
+    char *end = val + len, *p;
+    size_t n;
+
+    while (val < end) {
+        while (val < end && (*val == ' ' || *val == '\t' || *val == ',')) {
+            val++;
+        }
+        for (p = val; p < end && *p != ','; p++)
+            ;
+        n = p - val;
+        while (n > 0 && (val[n - 1] == ' ' || val[n - 1] == '\t')) {
+            n--;
+        }
+        if (n > 0 && n == strlen(token) && strncasecmp(val, token, n) == 0) {
+            return 1;
+        }
+        val = p;
+    }
+    return 0;
+}
+
+static void
+connect_upstream(struct ProxyExchange *px)
+{
+    struct ProxyRoute *route = px->route;
+    struct Upstream *up;
+    char c;
+    int fd, on = 1;
+
+    px->ooff = 0;
+    while ((up = route->idle) != NULL) {
+        route->idle = up->next;
+        route->nidle--;
+        // 閉じられたか、頼んでいないのに何か届いている接続は使わない
+        if (recv(up->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            STAT_ADD(stats->upstream_reused, 1);
+            px->up = up;
+            px->state = PX_SEND;
+            return;
+        }
+        close(up->fd);
+        free(up);
+    }
+    px->state = PX_CONNECT;
+    fd = socket(route->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("socket(2) failed: %s", strerror(errno));
+        return;
+    }
+    if (route->addr.ss_family != AF_UNIX) {
+        // リクエストヘッダとボディを分けて書くので、Nagleで遅れないようにする
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+    }
+    up = checked_malloc(sizeof(struct Upstream));
+    up->fd = fd;
+    up->reused = 0;
+    up->next = NULL;
+    px->up = up;
+    STAT_ADD(stats->upstream_connects, 1);
+    if (connect(fd, (struct sockaddr*)&route->addr, route->addrlen) == 0) {
+        px->state = PX_SEND;
+    } else if (errno != EINPROGRESS) {
+        px->error = errno;
+    }
+}
+
+static int
+proxy_advance(struct Connection *conn)
+{
+    struct ProxyExchange *px = conn->proxy;
+    int ret;
+
+    for (;;) {
+        switch (px->state) {
+            case PX_CONNECT:
+                ret = proxy_connect_done(conn, px);
+                break;
+            case PX_SEND:
+                ret = proxy_send(conn, px);
+                break;
+            case PX_BODY:
+                ret = proxy_body(conn, px);
+                break;
+            case PX_HEADER:
+                ret = proxy_read_header(conn, px);
+                break;
+            case PX_RELAY:
+                ret = proxy_relay(conn, px);
+                break;
+            default:
+                finish_proxy(conn, px);
+                return 1;
+        }
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+}
+
+static int
+proxy_connect_done(struct Connection *conn, struct ProxyExchange *px)
+{
+    socklen_t len = sizeof px->error;
+
+    if (!px->up) {
+        return proxy_upstream_error(conn, px, "socket");
+    }
+    if (px->error) {
+        errno = px->error;
+        return proxy_upstream_error(conn, px, "connect");
+    }
+    // 接続の完了は書けるようになったことで知らせられる。最初はまだ待っていない
+    if (!px->connect_waited) {
+        px->connect_waited = 1;
+        return proxy_wait(px, px->up->fd, POLLOUT);
+    }
+    px->connect_waited = 0;
+    if (getsockopt(px->up->fd, SOL_SOCKET, SO_ERROR, &px->error, &len) < 0) {
+        px->error = errno;
+    }
+    if (px->error) {
+        errno = px->error;
+        return proxy_upstream_error(conn, px, "connect");
+    }
+    px->state = PX_SEND;
+    return 1;
+}
+
+static int
+proxy_send(struct Connection *conn, struct ProxyExchange *px)
+{
+    ssize_t n;
+
+    while (px->ooff < px->olen) {
+        n = send(px->up->fd, px->out + px->ooff, px->olen - px->ooff, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return proxy_wait(px, px->up->fd, POLLOUT);
+            }
+            return proxy_upstream_error(conn, px, "send");
+        }
+        px->ooff += n;
+    }
+    if (px->replayable) {
+        // 送り直すときのために、送った内容を取っておく
+        px->state = PX_HEADER;
+        return 1;
+    }
+    px->olen = px->ooff = 0;
+    px->state = conn->body_state != BODY_NONE ? PX_BODY : PX_HEADER;
+    return 1;
+}
+
+static int
+proxy_body(struct Connection *conn, struct ProxyExchange *px)
+{
+    size_t ilen;
+    ssize_t n;
+    int ret;
+
+    if (output_pending_p(conn)) {
+        // 100 Continueを送らなければボディは届かない。パイプに前のレスポンスのファイルの続きがあれば、それも送り切ってから使う
+        ret = flush_connection(conn);
+        if (ret == 0) {
+            return proxy_wait(px, conn->throttled ? -1 : conn->outfd, POLLOUT);
+        }
+        if (ret < 0) {
+            return -1;
+        }
+    }
+    if (conn->piped == 0 && conn->ilen > conn->ihead) {
+        // 受信バッファに届いている分はconsume_bodyからproxy_body_sinkを通してoutに積む
+        // チャンクのボディは解いてから積み直すので、ここで終わりを見つけられる
+        ret = consume_body(conn);
+        if (ret < 0) {
+            return -1;
+        }
+        if (px->olen > 0) {
+            px->state = PX_SEND;
+            return 1;
+        }
+    }
+    if (conn->body_state == BODY_NONE) {
+        px->state = PX_HEADER;
+        return 1;
+    }
+    if (conn->body_state != BODY_LENGTH) {
+        // チャンクのボディは続きを受信バッファに読み、consume_bodyで解く
+        ilen = conn->ilen;
+        if (fill_connection(conn) <= 0) {
+            return -1;
+        }
+        return conn->ilen > ilen ? 1 : proxy_wait(px, conn->fd, POLLIN);
+    }
+    // 長さの決まったボディの残りは、ユーザー空間へ読まずにパイプを経由して転送先へ流す
+    if (conn->pipefd[0] < 0 && pipe2(conn->pipefd, O_CLOEXEC) < 0) {
+        log_error("pipe2(2) failed: %s", strerror(errno));
+        return -1;
+    }
+    if (conn->piped == 0) {
+        n = splice(conn->fd, NULL, conn->pipefd[1], NULL,
+                   conn->body_remaining < PIPE_BUF_SIZE ? conn->body_remaining : PIPE_BUF_SIZE,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return proxy_wait(px, conn->fd, POLLIN);
+        }
+        if (n < 0 && errno == EINTR) {
+            return 1;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        conn->piped = n;
+        conn->body_remaining -= n;
+        px->body_spliced = 1;
+    }
+    n = splice(conn->pipefd[0], NULL, px->up->fd, NULL, conn->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return 1;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return proxy_wait(px, px->up->fd, POLLOUT);
+        }
+        return proxy_upstream_error(conn, px, "splice");
+    }
+    conn->piped -= n;
+    if (conn->piped == 0 && conn->body_remaining == 0) {
+        conn->body_state = BODY_NONE;
+    }
+    return 1;
+}
+
+static void
+proxy_body_sink(struct Connection *conn, char *data, size_t len)
+{
+    struct ProxyExchange *px = conn->proxy;
+
+    if (!px) {
+        return;
+    }
+    if (!px->chunked_body) {
+        grow_buffer(&px->out, &px->ocap, px->olen + len);
+        memcpy(px->out + px->olen, data, len);
+        px->olen += len;
+        return;
+    }
+    // 転送先にもチャンクで送る。トレイラーは送らない
+    if (len == 0) {
+        buf_printf(&px->out, &px->olen, &px->ocap, "0\r\n\r\n");
+        return;
+    }
+    buf_printf(&px->out, &px->olen, &px->ocap, "%lx\r\n", (unsigned long)len);
+    grow_buffer(&px->out, &px->ocap, px->olen + len + 2);
+    memcpy(px->out + px->olen, data, len);
+    memcpy(px->out + px->olen + len, "\r\n", 2);
+    px->olen += len + 2;
+}
+
+static int
+proxy_read_header(struct Connection *conn, struct ProxyExchange *px)
+{
+    char *end;
+    ssize_t n;
+    int ret;
+
+    for (;;) {
+        end = px->ilen > 0 ? memmem(px->in, px->ilen, "\r\n\r\n", 4) : NULL;
+        if (end) {
+            ret = proxy_response_header(conn, px, end + 4 - px->in);
+            if (ret < 0) {
+                errno = EPROTO;
+                return proxy_upstream_error(conn, px, "parse response header");
+            }
+            if (ret > 0) {
+                px->state = PX_RELAY;
+                return 1;
+            }
+            continue;
+        }
+        if (px->ilen == px->icap) {
+            if (px->icap >= MAX_REQUEST_HEADER_LENGTH) {
+                errno = EMSGSIZE;
+                return proxy_upstream_error(conn, px, "read response header");
+            }
+            grow_buffer(&px->in, &px->icap, px->icap ? px->icap * 2 : PROXY_BUF_SIZE);
+        }
+        n = recv(px->up->fd, px->in + px->ilen, px->icap - px->ilen, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return proxy_wait(px, px->up->fd, POLLIN);
+            }
+            return proxy_upstream_error(conn, px, "recv");
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
+            return proxy_upstream_error(conn, px, "recv");
+        }
+        px->ilen += n;
+        px->received = 1;
+    }
+}
+
+static int
+proxy_response_header(struct Connection *conn, struct ProxyExchange *px, size_t len)
+{
+    static const char chunked[] = "Transfer-Encoding: chunked\r\n";
+    char *p, *end, *eol, *name, *val;
+    size_t nlen, vlen, rest;
+    long long length = -1;
+    int status, minor, close = 0, keep_alive = 0, te = 0, i;
+    ssize_t n;
+
+    p = px->in;
+    end = px->in + len;
+    eol = memchr(p, '\n', end - p);
+    if (eol - p < 13 || strncmp(p, "HTTP/1.", strlen("HTTP/1.")) != 0 || !isdigit((int)p[7]) || p[8] != ' '
+        || !isdigit((int)p[9]) || !isdigit((int)p[10]) || !isdigit((int)p[11])) {
+        log_error("invalid status line from %s: %.*s", px->route->name, (int)(eol - p), p);
+        return -1;
+    }
+    minor = p[7] - '0';
+    status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+    if (status < MIN_STATUS_CODE || status > MAX_STATUS_CODE || status == 101) {
+        return -1;
+    }
+    if (status < 200) {
+        // 100 Continueなどの途中経過は捨て、最終的なレスポンスを待つ
+        memmove(px->in, px->in + len, px->ilen - len);
+        px->ilen -= len;
+        return 0;
+    }
+    // まずボディの区切り方と接続を使い回せるかを調べ、送ってよいとわかってからクライアントへ書く
+    for (i = 0; i < 2; i++) {
+        if (i == 1) {
+            conn->status = status;
+            conn_printf(conn, "HTTP/1.%d %.*s\r\n", HTTP_MINOR_VERSION,
+                        (int)(eol - (p + 9) - (eol[-1] == '\r')), p + 9);
+        }
+        for (p = eol + 1; (eol = memchr(p, '\n', end - p)) != NULL && eol - p > 1; p = eol + 1) {
+            name = p;
+            val = memchr(p, ':', eol - p);
+            if (!val || val == p) {
+                log_error("invalid response header field from %s: %.*s", px->route->name, (int)(eol - p), p);
+                return -1;
+            }
+            nlen = val - name;
+            for (val++; *val == ' ' || *val == '\t'; val++)
+                ;
+            vlen = eol - val;
+            while (vlen > 0 && (val[vlen - 1] == '\r' || val[vlen - 1] == ' ' || val[vlen - 1] == '\t')) {
+                vlen--;
+            }
+            if (i == 1) {
+                if (!proxy_hop_header_p(name, nlen)) {
+                    conn_write(conn, name, eol + 1 - name);
+                }
+            } else if (nlen == strlen("Content-Length") && strncasecmp(name, "Content-Length", nlen) == 0) {
+                if (length >= 0 || vlen == 0 || vlen > 18 || strspn(val, "0123456789") < vlen) {
+                    return -1;
+                }
+                length = strtoll(val, NULL, 10);
+            } else if (nlen == strlen("Transfer-Encoding") && strncasecmp(name, "Transfer-Encoding", nlen) == 0) {
+                if (vlen < strlen("chunked") || strncasecmp(val + vlen - strlen("chunked"), "chunked", 7) != 0) {
+                    return -1;
+                }
+                te = 1;
+            } else if (nlen == strlen("Connection") && strncasecmp(name, "Connection", nlen) == 0) {
+                close |= header_token_p(val, vlen, "close");
+                keep_alive |= header_token_p(val, vlen, "keep-alive");
+            }
+        }
+        if (i == 0 && (te && (length >= 0 || px->req.protocol_minor_version < 1))) {
+            // HTTP/1.0で頼んだのにチャンクが返ってきても、クライアントへは区切りを伝えられない
+            return -1;
+        }
+        p = px->in;
+        eol = memchr(p, '\n', end - p);
+    }
+    px->reusable = !close && (minor >= 1 || keep_alive);
+    if (px->head_only || status == 204 || status == 304) {
+        px->framing = FRAME_NONE;
+    } else if (te) {
+        px->framing = FRAME_CHUNKED;
+        px->chunk_state = CHUNK_SIZE;
+        conn_write(conn, chunked, sizeof chunked - 1);
+    } else if (length >= 0) {
+        px->framing = FRAME_LENGTH;
+        px->remaining = length;
+    } else {
+        // 閉じるまでがボディなので、クライアントにも閉じて終わりを知らせる
+        px->framing = FRAME_EOF;
+        px->reusable = 0;
+        conn->keep_alive = 0;
+    }
+    conn_printf(conn, "Connection: %s\r\n\r\n", conn->keep_alive ? "keep-alive" : "close");
+    px->head_sent = 1;
+
+    // ヘッダと一緒に届いたボディの始まりは、受け取ったバッファからそのまま送る
+    rest = px->ilen - len;
+    px->ilen = 0;
+    if (rest == 0) {
+        return 1;
+    }
+    n = rest;
+    if (px->framing == FRAME_NONE) {
+        n = 0;
+    } else if (px->framing == FRAME_LENGTH && (long long)rest > px->remaining) {
+        n = px->remaining;
+    } else if (px->framing == FRAME_CHUNKED && (n = scan_chunked(px, px->in + len, rest)) < 0) {
+        px->reusable = 0;
+        return -2;
+    }
+    if (n < (ssize_t)rest) {
+        // 頼んでいないものまで届いた接続は使い回さない
+        px->reusable = 0;
+    }
+    conn_write(conn, px->in + len, n);
+    conn->body_bytes += n;
+    if (px->framing == FRAME_LENGTH) {
+        px->remaining -= n;
+    }
+    return 1;
+}
+
+static ssize_t
+scan_chunked(struct ProxyExchange *px, char *p, size_t len)
+{
+    size_t i, n;
+    int c;
+
+    for (i = 0; i < len && px->chunk_state != CHUNK_DONE; i++) {
+        c = (unsigned char)p[i];
+        switch (px->chunk_state) {
+            case CHUNK_SIZE:
+                if (isxdigit(c)) {
+                    if (px->remaining >= (1LL << 56)) {
+                        return -1;
+                    }
+                    px->remaining = px->remaining * 16 + (isdigit(c) ? c - '0' : (c | 0x20) - 'a' + 10);
+                    px->chunk_digits++;
+                    break;
+                }
+                if (px->chunk_digits == 0) {
+                    return -1;
+                }
+                px->chunk_state = CHUNK_EXT;
+                /* fall through */
+            case CHUNK_EXT:
+                if (c == '\n') {
+                    px->chunk_state = px->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+                }
+                break;
+            case CHUNK_DATA:
+                n = len - i < (size_t)px->remaining ? len - i : (size_t)px->remaining;
+                px->remaining -= n;
+                i += n - 1;
+                if (px->remaining == 0) {
+                    px->chunk_state = CHUNK_DATA_END;
+                }
+                break;
+            case CHUNK_DATA_END:
+                if (c == '\n') {
+                    px->chunk_state = CHUNK_SIZE;
+                    px->chunk_digits = 0;
+                } else if (c != '\r') {
+                    return -1;
+                }
+                break;
+            case CHUNK_TRAILER:
+                if (c == '\n') {
+                    px->chunk_state = CHUNK_DONE;
+                } else if (c != '\r') {
+                    px->chunk_state = CHUNK_TRAILER_LINE;
+                }
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (c == '\n') {
+                    px->chunk_state = CHUNK_TRAILER;
+                }
+                break;
+        }
+    }
+    return i;
+}
+
+static int
+proxy_relay(struct Connection *conn, struct ProxyExchange *px)
+{
+    ssize_t n, m;
+    size_t len;
+    int ret;
+
+    for (;;) {
+        if (output_pending_p(conn)) {
+            ret = flush_connection(conn);
+            if (ret == 0) {
+                return proxy_wait(px, conn->throttled ? -1 : conn->outfd, POLLOUT);
+            }
+            if (ret < 0) {
+                return -1;
+            }
+        }
+        if (conn->piped > 0) {
+            n = splice(conn->pipefd[0], NULL, conn->outfd, NULL, conn->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return proxy_wait(px, conn->outfd, POLLOUT);
+            }
+            if (n < 0 && errno == EINVAL) {
+                // 出力先がspliceに対応していない。パイプに入れた分は読み出して書き、以降はバッファを通す
+                conn->out_type = OUT_COPY;
+                if (px->icap == 0) {
+                    grow_buffer(&px->in, &px->icap, PROXY_BUF_SIZE);
+                }
+                n = read(conn->pipefd[0], px->in, conn->piped < px->icap ? conn->piped : px->icap);
+                if (n > 0) {
+                    conn_write(conn, px->in, n);
+                    conn->piped -= n;
+                    continue;
+                }
+            }
+            if (n <= 0) {
+                return -1;
+            }
+            conn->piped -= n;
+            account_sent(conn, n);
+            continue;
+        }
+        if (px->framing == FRAME_NONE || (px->framing == FRAME_LENGTH && px->remaining == 0)
+            || (px->framing == FRAME_CHUNKED && px->chunk_state == CHUNK_DONE)) {
+            px->state = PX_DONE;
+            return 1;
+        }
+        len = PIPE_BUF_SIZE;
+        if (px->framing == FRAME_LENGTH && px->remaining < PIPE_BUF_SIZE) {
+            len = px->remaining;
+        }
+        if (px->framing == FRAME_CHUNKED || conn->out_type == OUT_COPY) {
+            // チャンクは区切りを読んで終わりを見つけるため、バッファを通してそのまま送る
+            if (px->icap == 0) {
+                grow_buffer(&px->in, &px->icap, PROXY_BUF_SIZE);
+            }
+            n = recv(px->up->fd, px->in, len < px->icap ? len : px->icap, 0);
+            if (n > 0) {
+                m = n;
+                if (px->framing == FRAME_CHUNKED && (m = scan_chunked(px, px->in, n)) < 0) {
+                    errno = EPROTO;
+                    return proxy_upstream_error(conn, px, "parse chunk");
+                }
+                if (m < n) {
+                    px->reusable = 0;
+                }
+                conn_write(conn, px->in, m);
+                conn->body_bytes += m;
+                if (px->framing == FRAME_LENGTH) {
+                    px->remaining -= m;
+                }
+                continue;
+            }
+        } else {
+            if (conn->pipefd[0] < 0 && pipe2(conn->pipefd, O_CLOEXEC) < 0) {
+                log_error("pipe2(2) failed: %s", strerror(errno));
+                return -1;
+            }
+            n = splice(px->up->fd, NULL, conn->pipefd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                conn->piped += n;
+                conn->body_bytes += n;
+                if (px->framing == FRAME_LENGTH) {
+                    px->remaining -= n;
+                }
+                continue;
+            }
+        }
+        if (n == 0 && px->framing == FRAME_EOF) {
+            px->state = PX_DONE;
+            return 1;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return proxy_wait(px, px->up->fd, POLLIN);
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
+        }
+        return proxy_upstream_error(conn, px, "recv");
+    }
+}
+
+static int
+proxy_wait(struct ProxyExchange *px, int fd, short events)
+{
+    px->wait_fd = fd;
+    px->wait_events = events;
+    return 0;
+}
+
+static int
+proxy_upstream_error(struct Connection *conn, struct ProxyExchange *px, char *what)
+{
+    int reused = 0;
+
+    log_error("upstream %s: %s failed: %s", px->route->name, what, strerror(errno));
+    STAT_ADD(stats->upstream_errors, 1);
+    if (px->up) {
+        reused = px->up->reused;
+        close(px->up->fd);
+        free(px->up);
+        px->up = NULL;
+    }
+    if (conn->piped > 0) {
+        // パイプに残った転送先へのボディはクライアントへ流れてはいけないので、パイプごと捨てる
+        close(conn->pipefd[0]);
+        close(conn->pipefd[1]);
+        conn->pipefd[0] = conn->pipefd[1] = -1;
+        conn->piped = 0;
+    }
+    if (px->head_sent) {
+        // 応答の途中で切れたことは、クライアントとの接続を閉じて知らせるしかない
+        return -1;
+    }
+    if (reused && px->replayable && !px->received) {
+        connect_upstream(px);
+        return 1;
+    }
+    if (conn->body_state != BODY_NONE) {
+        // 読み残したボディの後に次のリクエストがあるとは限らないので、応答したら閉じる
+        conn->keep_alive = 0;
+        conn->body_state = BODY_NONE;
+    }
+    output_error_response(&px->req, conn, ERR_BAD_GATEWAY);
+    px->state = PX_DONE;
+    return 1;
+}
+
+static void
+finish_proxy(struct Connection *conn, struct ProxyExchange *px)
+{
+    struct ProxyRoute *route = px->route;
+
+    if (px->up && px->reusable && route->nidle < PROXY_POOL_SIZE) {
+        px->up->reused = 1;
+        px->up->next = route->idle;
+        route->idle = px->up;
+        route->nidle++;
+        px->up = NULL;
+    }
+    log_access(&px->req, conn);
+    count_request(&px->req, conn);
+    conn->body_sink = NULL;
+    conn->proxy = NULL;
+    free_proxy_exchange(px);
+}
+
+static void
+free_proxy_exchange(struct ProxyExchange *px)
+{
+    if (px->up) {
+        close(px->up->fd);
+        free(px->up);
+    }
+    free(px->req.buf);
+    free(px->out);
+    free(px->in);
+    free(px);
+}
+
+static int
+accepted_encodings(struct HTTPRequest *req)
+{
+    char *p, *token, *q;
+    size_t len;
+    int enc, accepted = 0, rejected = 0, any = 0, *set;
+
+    p = lookup_known_header(req, HDR_ACCEPT_ENCODING);
+    if (!p) {
+        return 0;
+    }
+    // q=0のものは受け付けない。それ以外の重みは見ず、こちらの優先順で選ぶ
+    for (;;) {
+        p += strspn(p, " \t,");
+        if (*p == '\0') {
+            break;
+        }
+        token = p;
+        len = strcspn(p, " \t,;");
+        p += strcspn(p, ",");
+        q = memchr(token, ';', p - token);
+        set = &accepted;
+        if (q) {
+            q += strspn(q + 1, " \t") + 1;
+            if (strncasecmp(q, "q=", 2) == 0 && strtod(q + 2, NULL) == 0.0) {
+                set = &rejected;
+            }
+        }
+        if (len == 1 && *token == '*') {
+            any = set == &accepted;
+            continue;
+        }
+        if (len == strlen("x-gzip") && strncasecmp(token, "x-gzip", len) == 0) {
+            *set |= 1 << ENC_GZIP;
+            continue;
+        }
+        for (enc = ENC_IDENTITY + 1; enc < NUM_ENCODINGS; enc++) {
+            if (len == strlen(content_encodings[enc].name)
+                && strncasecmp(token, content_encodings[enc].name, len) == 0) {
+                *set |= 1 << enc;
+            }
+        }
+    }
+    if (any) {
+        accepted |= ((1 << NUM_ENCODINGS) - 1) & ~(1 << ENC_IDENTITY);
+    }
+    return accepted & ~rejected;
+}
+
+static void
+release_cached_file(struct CachedFile *file)
+{
+    if (--file->refcount > 0) {
+        return;
+    }
+    if (file->fd >= 0) {
+        close(file->fd);
+    }
+    free(file->urlpath);
+    free(file->fspath);
+    free(file->name);
+    free(file->response);
+    free(file);
+}
+
+#define CACHED_HEADER_FMT "HTTP/1.%d 200 OK\r\nServer: %s/%s\r\nContent-Length: %ld\r\nContent-Type: %s\r\n"
+
+static void
+load_file_content(struct CachedFile *file)
+{
+    char *p;
+    int len;
+    ssize_t n;
+    off_t off;
+
+    p = render_response_header(file, &len);
+    for (off = 0; off < file->size; off += n) {
+        n = pread(file->fd, p + len + off, file->size - off, off);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n <= 0) {
+            // 読んでいる間に縮んだ。キャッシュせず普通に送る
+            free(p);
+            return;
+        }
+    }
+    cache_file_content(file, p, len);
+}
+
+static char*
+render_response_header(struct CachedFile *file, int *len)
+{
+    char *p;
+    int n;
+
+    n = snprintf(NULL, 0, CACHED_HEADER_FMT,
+                 HTTP_MINOR_VERSION, SERVER_NAME, SERVER_VERSION, (long)file->size, file->content_type);
+    n += format_file_header_fields(NULL, 0, file);
+    p = checked_malloc(n + 1 + file->size);
+    *len = sprintf(p, CACHED_HEADER_FMT,
+                   HTTP_MINOR_VERSION, SERVER_NAME, SERVER_VERSION, (long)file->size, file->content_type);
+    *len += format_file_header_fields(p + *len, n + 1 - *len, file);
+    return p;
+}
+
+static void
+cache_file_content(struct CachedFile *file, char *response, int len)
+{
+    file->response = response;
+    file->header_len = len;
+    file->content_prev = NULL;
+    file->content_next = file_cache.content_head;
+    if (file_cache.content_head) {
+        file_cache.content_head->content_prev = file;
+    } else {
+        file_cache.content_tail = file;
+    }
+    file_cache.content_head = file;
+    file_cache.content_bytes += len + file->size;
+    while (file_cache.content_bytes > file_cache.content_size && file_cache.content_tail != file) {
+        file_cache_evict(file_cache.content_tail);
+    }
+}
+
+static int
+revalidate_cached_file(struct CachedFile *file)
+{
+    struct stat st;
+    char *name;
+    time_t now;
+    int dirfd;
+
+    if (cache_revalidate <= 0) {
+        return 1;
+    }
+    now = time(NULL);
+    if (now - file->validated < cache_revalidate) {
+        return 1;
+    }
+    if (file->listing) {
+        // 一覧はディレクトリのmtimeが変わるまで使う。大きさは一覧のものなので比べない
+        dirfd = lookup_dirfd(file->urlpath, &name);
+        if (dirfd < 0 || fstat(dirfd, &st) < 0 || st.st_ino != file->ino
+            || st.st_mtim.tv_sec != file->mtime.tv_sec || st.st_mtim.tv_nsec != file->mtime.tv_nsec) {
+            return 0;
+        }
+        file->validated = now;
+        return 1;
+    }
+    if (stat_beneath(file->urlpath, file->sidecar ? content_encodings[file->encoding].suffix : "", &st) < 0
+        || !S_ISREG(st.st_mode) || st.st_ino != file->ino || st.st_size != file->source_size
+        || st.st_mtim.tv_sec != file->mtime.tv_sec || st.st_mtim.tv_nsec != file->mtime.tv_nsec) {
+        return 0;
+    }
+    file->validated = now;
+    return 1;
+}
+
+static void
+init_file_cache(long max_entries)
+{
+    unsigned int n;
+
+    if (max_entries <= 0) {
+        return;
+    }
+    file_cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (file_cache.inotify_fd < 0) {
+        log_error("inotify_init1(2) failed, file cache disabled: %s", strerror(errno));
+        return;
+    }
+    for (n = 1; n < max_entries * 2; n *= 2)
+        ;
+    file_cache.max_entries = max_entries;
+    file_cache.nentries = 0;
+    file_cache.nbuckets = n;
+    file_cache.buckets = calloc(n, sizeof(struct CachedFile*));
+    if (!file_cache.buckets) {
+        log_exit("failed to allocate memory");
+    }
+    file_cache.lru_head = file_cache.lru_tail = NULL;
+    file_cache.content_size = content_cache_size;
+    file_cache.content_bytes = 0;
+    file_cache.content_head = file_cache.content_tail = NULL;
+    file_cache.watches = NULL;
+}
+
+static struct CachedFile*
+file_cache_lookup(char *urlpath, int encoding, unsigned int hash)
+{
+    struct CachedFile *file;
+
+    for (file = file_cache.buckets[hash & (file_cache.nbuckets - 1)]; file; file = file->hnext) {
+        if (file->hash == hash && file->encoding == encoding && strcmp(file->urlpath, urlpath) == 0) {
+            break;
+        }
+    }
+    if (file && file->response && file != file_cache.content_head) {
+        file->content_prev->content_next = file->content_next;
+        if (file->content_next) {
+            file->content_next->content_prev = file->content_prev;
+        } else {
+            file_cache.content_tail = file->content_prev;
+        }
+        file->content_prev = NULL;
+        file->content_next = file_cache.content_head;
+        file_cache.content_head->content_prev = file;
+        file_cache.content_head = file;
+    }
+    if (!file || file == file_cache.lru_head) {
+        return file;
+    }
+    // 最近使ったものとしてLRUリストの先頭に移す
+    file->lru_prev->lru_next = file->lru_next;
+    if (file->lru_next) {
+        file->lru_next->lru_prev = file->lru_prev;
+    } else {
+        file_cache.lru_tail = file->lru_prev;
+    }
+    file->lru_prev = NULL;
+    file->lru_next = file_cache.lru_head;
+    file_cache.lru_head->lru_prev = file;
+    file_cache.lru_head = file;
+    return file;
+}
+
+static void
+file_cache_insert(struct CachedFile *file)
+{
+    struct CacheWatch *w;
+    char *dir, *p;
+    int wd;
+
+    // ファイルそのものではなく親ディレクトリを監視し、置き換えや削除も拾えるようにする
+    dir = checked_malloc(strlen(file->fspath) + 2);
+    strcpy(dir, file->fspath);
+    p = strrchr(dir, '/');
+    file->name = checked_malloc(strlen(p + 1) + 1);
+    strcpy(file->name, p + 1);
+    if (file->sidecar) {
+        // 圧縮済みのファイルも元のファイルの名前で監視する
+        file->name[strlen(file->name) - strlen(content_encodings[file->encoding].suffix)] = '\0';
+    }
+    p[1] = '\0';
+    wd = inotify_add_watch(file_cache.inotify_fd, dir,
+                           IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
+                           IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    free(dir);
+    if (wd < 0) {
+        log_error("inotify_add_watch(2) failed: %s", strerror(errno));
+        return;
+    }
+    for (w = file_cache.watches; w; w = w->next) {
+        if (w->wd == wd) {
+            break;
+        }
+    }
+    if (!w) {
+        w = checked_malloc(sizeof(struct CacheWatch));
+        w->wd = wd;
+        w->files = NULL;
+        w->next = file_cache.watches;
+        file_cache.watches = w;
+    }
+    file->watch = w;
+    file->wnext = w->files;
+    w->files = file;
+
+    file->refcount++;
+    file->hnext = file_cache.buckets[file->hash & (file_cache.nbuckets - 1)];
+    file_cache.buckets[file->hash & (file_cache.nbuckets - 1)] = file;
+    file->lru_prev = NULL;
+    file->lru_next = file_cache.lru_head;
+    if (file_cache.lru_head) {
+        file_cache.lru_head->lru_prev = file;
+    } else {
+        file_cache.lru_tail = file;
+    }
+    file_cache.lru_head = file;
+    if (++file_cache.nentries > file_cache.max_entries) {
+        file_cache_evict(file_cache.lru_tail);
+    }
+}
+
+static void
+file_cache_evict(struct CachedFile *file)
+{
+    struct CachedFile **fp;
+    struct CacheWatch **wp, *w;
+
+    for (fp = &file_cache.buckets[file->hash & (file_cache.nbuckets - 1)]; *fp != file; fp = &(*fp)->hnext)
+        ;
+    *fp = file->hnext;
+    if (file->lru_prev) {
+        file->lru_prev->lru_next = file->lru_next;
+    } else {
+        file_cache.lru_head = file->lru_next;
+    }
+    if (file->lru_next) {
+        file->lru_next->lru_prev = file->lru_prev;
+    } else {
+        file_cache.lru_tail = file->lru_prev;
+    }
+    if (file->response) {
+        if (file->content_prev) {
+            file->content_prev->content_next = file->content_next;
+        } else {
+            file_cache.content_head = file->content_next;
+        }
+        if (file->content_next) {
+            file->content_next->content_prev = file->content_prev;
+        } else {
+            file_cache.content_tail = file->content_prev;
+        }
+        // 送信中の接続が参照しているかもしれないので、メモリはrelease_cached_fileで解放する
+        file_cache.content_bytes -= file->header_len + file->size;
+    }
+    w = file->watch;
+    for (fp = &w->files; *fp != file; fp = &(*fp)->wnext)
+        ;
+    *fp = file->wnext;
+    if (!w->files) {
+        // 監視するファイルがなくなったディレクトリの監視をやめる
+        inotify_rm_watch(file_cache.inotify_fd, w->wd);
+        for (wp = &file_cache.watches; *wp != w; wp = &(*wp)->next)
+            ;
+        *wp = w->next;
+        free(w);
+    }
+    file_cache.nentries--;
+    release_cached_file(file);
+}
+
+static void
+handle_inotify_events(void)
+{
+    char buf[INOTIFY_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    struct CacheWatch *w;
+    struct CachedFile *file, *next;
+    ssize_t n;
+    char *p;
+
+    for (;;) {
+        n = read(file_cache.inotify_fd, buf, sizeof buf);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event*)p;
+            if (ev->mask & (IN_ISDIR | IN_DELETE_SELF | IN_MOVE_SELF | IN_Q_OVERFLOW)) {
+                // ディレクトリが置き換わったかもしれないので、開いておいたものは使わない
+                flush_dir_cache();
+            }
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // 取りこぼした変更がわからないので全部捨てる
+                while (file_cache.lru_head) {
+                    file_cache_evict(file_cache.lru_head);
+                }
+                continue;
+            }
+            for (w = file_cache.watches; w; w = w->next) {
+                if (w->wd == ev->wd) {
+                    break;
+                }
+            }
+            if (!w) {
+                continue;
+            }
+            // file_cache_evictが最後のエントリでwを解放するので、先に次を覚えておく
+            // 名前の前方一致で比べ、圧縮済みのファイル（foo.gzなど）の変更でもfooのエントリを捨てる
+            for (file = w->files; file; file = next) {
+                next = file->wnext;
+                if (ev->len == 0 || (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+                    || strncmp(file->name, ev->name, strlen(file->name)) == 0) {
+                    file_cache_evict(file);
+                }
+            }
+        }
+    }
+}
+
+static unsigned int
+hash_string(char *str)
+{
+    unsigned int h = 2166136261u;
+    unsigned char *p;
+
+    // FNV-1a
+    for (p = (unsigned char*)str; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void
+free_fileinfo(struct FileInfo *info)
+{
+    if (info->fd >= 0) {
+        close(info->fd);
+    }
+    free(info->path);
+    free(info);
+}
+
+// 拡張子とコンテンツの種別の対応表
+static struct {
+    char *ext;
+    char *type;
+} mime_types[] = {
+    { "html", "text/html" },
+    { "htm", "text/html" },
+    { "css", "text/css" },
+    { "js", "text/javascript" },
+    { "mjs", "text/javascript" },
+    { "txt", "text/plain" },
+    { "csv", "text/csv" },
+    { "md", "text/markdown" },
+    { "json", "application/json" },
+    { "xml", "application/xml" },
+    { "wasm", "application/wasm" },
+    { "pdf", "application/pdf" },
+    { "zip", "application/zip" },
+    { "gz", "application/gzip" },
+    { "br", "application/octet-stream" },
+    { "zst", "application/zstd" },
+    { "tar", "application/x-tar" },
+    { "svg", "image/svg+xml" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "webp", "image/webp" },
+    { "avif", "image/avif" },
+    { "ico", "image/x-icon" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "ttf", "font/ttf" },
+    { "otf", "font/otf" },
+    { "mp3", "audio/mpeg" },
+    { "mp4", "video/mp4" },
+    { "webm", "video/webm" },
+    { NULL, NULL }
+};
+
+static char*
+guess_content_type(struct FileInfo *info)
+{
+    char *ext, *slash;
+    int i;
+
+    ext = strrchr(info->path, '.');
+    slash = strrchr(info->path, '/');
+    if (!ext || (slash && ext < slash)) {
+        return "text/plain";
+    }
+    for (i = 0; mime_types[i].ext; i++) {
+        if (strcasecmp(ext + 1, mime_types[i].ext) == 0) {
+            return mime_types[i].type;
+        }
+    }
+    return "application/octet-stream";
+}
+
+static int
+compressible_type_p(char *type)
+{
+    static char *types[] = {
+        "application/json", "application/xml", "application/wasm", "image/svg+xml",
+        "image/x-icon", "font/ttf", "font/otf", NULL
+    };
+    int i;
+
+    if (strncmp(type, "text/", strlen("text/")) == 0) {
+        return 1;
+    }
+    for (i = 0; types[i]; i++) {
+        if (strcmp(type, types[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+open_access_log(char *path, char *format)
+{
+    if (strcmp(format, "common") == 0) {
+        access_log.format = LOG_COMMON;
+    } else if (strcmp(format, "combined") == 0) {
+        access_log.format = LOG_COMBINED;
+    } else if (strcmp(format, "json") == 0) {
+        access_log.format = LOG_JSON;
+    } else {
+        log_exit("unknown log format: %s", format);
+    }
+    // 各ワーカーは記録を行単位でまとめて書くので、O_APPENDなら行が混ざらない
+    access_log.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (access_log.fd < 0) {
+        log_exit("failed to open %s: %s", path, strerror(errno));
+    }
+    access_log.path = path;
+    tzset();
+}
+
+static void
+start_access_log(void)
+{
+    sigset_t all, old;
+    int err;
+
+    if (access_log.fd < 0 || access_log.running) {
+        return;
+    }
+    access_log.records = checked_malloc(sizeof(struct AccessLogRecord) * ACCESS_LOG_RING_SIZE);
+    access_log.head = access_log.tail = 0;
+    // シグナルはイベントループの側で受けるので、書き出しスレッドでは全て止めておく
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&access_log.thread, NULL, access_log_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        log_exit("pthread_create(3) failed: %s", strerror(err));
+    }
+    access_log.running = 1;
+}
+
+static void
+finish_access_log(void)
+{
+    if (!access_log.running) {
+        return;
+    }
+    __atomic_store_n(&access_log.stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(access_log.thread, NULL);
+    access_log.running = 0;
+}
+
+static void
+lookup_peer_address(struct Connection *conn)
+{
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof ss;
+
+    if (conn->peer_family >= 0) {
+        return;
+    }
+    conn->peer_family = 0;
+    if (getpeername(conn->fd, (struct sockaddr*)&ss, &len) == 0) {
+        if (ss.ss_family == AF_INET) {
+            conn->peer_family = AF_INET;
+            memcpy(conn->peer_addr, &((struct sockaddr_in*)&ss)->sin_addr, 4);
+        } else if (ss.ss_family == AF_INET6) {
+            conn->peer_family = AF_INET6;
+            memcpy(conn->peer_addr, &((struct sockaddr_in6*)&ss)->sin6_addr, 16);
+        }
+    }
+}
+
+static void
+log_access(struct HTTPRequest *req, struct Connection *conn)
+{
+    struct AccessLogRecord *rec, one;
+    unsigned long tail = 0;
+    char *val, line[ACCESS_LOG_MAX_LINE];
+    size_t n;
+
+    if (access_log.fd < 0) {
+        return;
+    }
+    if (access_log.running) {
+        tail = access_log.tail;
+        if (tail - __atomic_load_n(&access_log.head, __ATOMIC_ACQUIRE) == ACCESS_LOG_RING_SIZE) {
+            STAT_ADD(stats->log_dropped, 1);
+            return;
+        }
+        rec = &access_log.records[tail & (ACCESS_LOG_RING_SIZE - 1)];
+    } else {
+        // 1接続だけを扱うときはスレッドを置かず、その場で書く
+        rec = &one;
+    }
+    lookup_peer_address(conn);
+    clock_gettime(CLOCK_REALTIME_COARSE, &rec->time);
+    rec->status = conn->status;
+    rec->bytes = conn->body_bytes;
+    rec->peer_family = conn->peer_family;
+    memcpy(rec->peer_addr, conn->peer_addr, 16);
+    if (req) {
+        rec->protocol_major_version = conn->h2 ? 2 : 1;
+        rec->protocol_minor_version = conn->h2 ? 0 : req->protocol_minor_version;
+        rec->method_len = copy_log_string(rec->method, req->method, LOG_METHOD_LEN);
+        rec->path_len = copy_log_string(rec->path, req->path, LOG_PATH_LEN);
+        if (req->query && rec->path_len < LOG_PATH_LEN) {
+            rec->path[rec->path_len++] = '?';
+            rec->path_len += copy_log_string(rec->path + rec->path_len, req->query, LOG_PATH_LEN - rec->path_len);
+        }
+        val = lookup_known_header(req, HDR_REFERER);
+        rec->referer_len = val ? copy_log_string(rec->referer, val, LOG_REFERER_LEN) : 0;
+        val = lookup_known_header(req, HDR_USER_AGENT);
+        rec->agent_len = val ? copy_log_string(rec->agent, val, LOG_AGENT_LEN) : 0;
+    } else {
+        rec->protocol_major_version = 1;
+        rec->protocol_minor_version = 0;
+        rec->method_len = rec->path_len = rec->referer_len = rec->agent_len = 0;
+    }
+    if (!access_log.running) {
+        n = format_access_log(line, rec);
+        write_fully(access_log.fd, line, n);
+        return;
+    }
+    __atomic_store_n(&access_log.tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void*
+access_log_writer(void *arg)
+{
+    struct AccessLogRecord *rec;
+    unsigned long head, tail, dropped;
+    char *buf;
+    size_t len = 0;
+
+    buf = checked_malloc(ACCESS_LOG_BUF_SIZE);
+    for (;;) {
+        head = access_log.head;
+        tail = __atomic_load_n(&access_log.tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            // 溜まった分を書いてから、リクエストの側を邪魔しないよう眠って待つ
+            if (len > 0) {
+                write_fully(access_log.fd, buf, len);
+                len = 0;
+            }
+            dropped = __atomic_load_n(&stats->log_dropped, __ATOMIC_RELAXED);
+            if (dropped != access_log.reported) {
+                log_error("access log: %lu records dropped", dropped - access_log.reported);
+                access_log.reported = dropped;
+            }
+            // 止めるよう言われた後にもう一度tailを見て、その前に積まれた記録を書き漏らさない
+            if (__atomic_load_n(&access_log.stopping, __ATOMIC_ACQUIRE)
+                && __atomic_load_n(&access_log.tail, __ATOMIC_ACQUIRE) == head) {
+                break;
+            }
+            usleep(ACCESS_LOG_FLUSH_USEC);
+            continue;
+        }
+        while (head != tail) {
+            if (len + ACCESS_LOG_MAX_LINE > ACCESS_LOG_BUF_SIZE) {
+                write_fully(access_log.fd, buf, len);
+                len = 0;
+            }
+            rec = &access_log.records[head & (ACCESS_LOG_RING_SIZE - 1)];
+            len += format_access_log(buf + len, rec);
+            head++;
+            __atomic_store_n(&access_log.head, head, __ATOMIC_RELEASE);
+        }
+    }
+    free(buf);
+    return arg;
+}
+
+static size_t
+format_access_log(char *buf, struct AccessLogRecord *rec)
+{
+    static __thread time_t cached_sec = -1;
+    static __thread char clf_time[TIME_BUF_SIZE], iso_time[TIME_BUF_SIZE];
+    char addr[INET6_ADDRSTRLEN];
+    struct tm tm;
+    char *p = buf;
+    int json = access_log.format == LOG_JSON;
+
+    if (rec->time.tv_sec != cached_sec) {
+        localtime_r(&rec->time.tv_sec, &tm);
+        strftime(clf_time, sizeof clf_time, "%d/%b/%Y:%H:%M:%S %z", &tm);
+        strftime(iso_time, sizeof iso_time, "%Y-%m-%dT%H:%M:%S%z", &tm);
+        // ISO 8601の時差は時と分をコロンで区切る
+        memmove(iso_time + strlen(iso_time) - 1, iso_time + strlen(iso_time) - 2, 3);
+        iso_time[strlen(iso_time) - 3] = ':';
+        cached_sec = rec->time.tv_sec;
+    }
+    if (!rec->peer_family || !inet_ntop(rec->peer_family, rec->peer_addr, addr, sizeof addr)) {
+        strcpy(addr, "-");
+    }
+    if (json) {
+        p += sprintf(p, "{\"time\":\"%s\",\"remote_addr\":\"%s\",\"method\":\"", iso_time, addr);
+        p = escape_log_string(p, rec->method, rec->method_len, 1);
+        p += sprintf(p, "\",\"path\":\"");
+        p = escape_log_string(p, rec->path, rec->path_len, 1);
+        p += sprintf(p, rec->method_len ? "\",\"protocol\":\"HTTP/%d.%d" : "\",\"protocol\":\"",
+                     rec->protocol_major_version, rec->protocol_minor_version);
+        p += sprintf(p, "\",\"status\":%d,\"bytes\":%lld,\"referer\":\"", rec->status, rec->bytes);
+        p = escape_log_string(p, rec->referer, rec->referer_len, 1);
+        p += sprintf(p, "\",\"user_agent\":\"");
+        p = escape_log_string(p, rec->agent, rec->agent_len, 1);
+        p += sprintf(p, "\"}\n");
+        return p - buf;
+    }
+    p += sprintf(p, "%s - - [%s] \"", addr, clf_time);
+    if (rec->method_len) {
+        p = escape_log_string(p, rec->method, rec->method_len, 0);
+        *p++ = ' ';
+        p = escape_log_string(p, rec->path, rec->path_len, 0);
+        p += sprintf(p, " HTTP/%d.%d", rec->protocol_major_version, rec->protocol_minor_version);
+    } else {
+        *p++ = '-';
+    }
+    if (rec->bytes > 0) {
+        p += sprintf(p, "\" %d %lld", rec->status, rec->bytes);
+    } else {
+        p += sprintf(p, "\" %d -", rec->status);
+    }
+    if (access_log.format == LOG_COMBINED) {
+        p += sprintf(p, " \"");
+        if (rec->referer_len) {
+            p = escape_log_string(p, rec->referer, rec->referer_len, 0);
+        } else {
+            *p++ = '-';
+        }
+        p += sprintf(p, "\" \"");
+        if (rec->agent_len) {
+            p = escape_log_string(p, rec->agent, rec->agent_len, 0);
+        } else {
+            *p++ = '-';
+        }
+        *p++ = '"';
+    }
+    *p++ = '\n';
+    return p - buf;
+}
+
+static char*
+escape_log_string(char *dst, const char *src, size_t len, int json)
+{
+    unsigned char c;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        c = src[i];
+        if (c == '"' || c == '\\') {
+            *dst++ = '\\';
+            *dst++ = c;
+        } else if (c < 0x20 || c >= 0x7f) {
+            // 制御文字やバイト列のままではログを読む側で解釈できないものは、16進で書く
+            dst += sprintf(dst, json ? "\\u%04x" : "\\x%02x", c);
+        } else {
+            *dst++ = c;
+        }
+    }
+    return dst;
+}
+
+static size_t
+copy_log_string(char *dst, const char *src, size_t max)
+{
+    size_t len;
+
+    len = strnlen(src, max);
+    memcpy(dst, src, len);
+    return len;
+}
+
+static int
+write_fully(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("failed to write access log: %s", strerror(errno));
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int
+status_code(const char *status)
+{
+    // "HTTP/1.x NNN ..."の形をしている
+    return (status[9] - '0') * 100 + (status[10] - '0') * 10 + (status[11] - '0');
+}
+
+static void
+init_stats(int n)
+{
+    all_stats = mmap(NULL, sizeof(struct WorkerStats) * n, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (all_stats == MAP_FAILED) {
+        log_exit("mmap(2) failed: %s", strerror(errno));
+    }
+    nstats = n;
+    stats = &all_stats[0];
+}
+
+static void
+count_request(struct HTTPRequest *req, struct Connection *conn)
+{
+    int method;
+
+    if (!req || conn->status < MIN_STATUS_CODE || conn->status > MAX_STATUS_CODE) {
+        STAT_ADD(stats->bad_requests, 1);
+        return;
+    }
+    if (strcmp(req->method, "GET") == 0) {
+        method = METHOD_GET;
+    } else if (strcmp(req->method, "HEAD") == 0) {
+        method = METHOD_HEAD;
+    } else if (strcmp(req->method, "POST") == 0) {
+        method = METHOD_POST;
+    } else {
+        method = METHOD_OTHER;
+    }
+    STAT_ADD(stats->requests[method][conn->status - MIN_STATUS_CODE], 1);
+}
+
+static void
+record_send_time(struct Connection *conn)
+{
+    if (!conn->send_start) {
+        return;
+    }
+    record_histogram(&stats->phases[PHASE_SEND], current_usec() - conn->send_start);
+    conn->send_start = 0;
+}
+
+static void
+record_histogram(struct Histogram *hist, long long usec)
+{
+    unsigned long v;
+    int e, idx;
+
+    v = usec > 0 ? usec : 0;
+    if (v < HIST_SUB_BUCKETS) {
+        idx = v;
+    } else {
+        e = 63 - __builtin_clzl(v);
+        if (e > HIST_MAX_EXP) {
+            idx = HIST_BUCKETS - 1;
+        } else {
+            idx = (e - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+        }
+    }
+    STAT_ADD(hist->counts[idx], 1);
+    STAT_ADD(hist->count, 1);
+    STAT_ADD(hist->sum, v);
+}
+
+static unsigned long
+histogram_bucket_limit(int idx)
+{
+    int e, sub;
+
+    if (idx < HIST_SUB_BUCKETS) {
+        return idx + 1;
+    }
+    e = idx / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    sub = idx % HIST_SUB_BUCKETS;
+    return (unsigned long)(HIST_SUB_BUCKETS + sub + 1) << (e - HIST_SUB_BITS);
+}
+
+#define STAT_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static void
+do_stats_response(struct HTTPRequest *req, struct Connection *conn)
+{
+    static const char content_type[] = "Content-Type: text/plain; version=0.0.4\r\n\r\n";
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    static struct WorkerStats sum;
+    struct WorkerStats *w;
+    unsigned long cumulative, limit;
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    int i, j, k, q;
+
+    // 足し合わせる間にも各ワーカーは数え続けるので、値どうしが少しずれることはある
+    memset(&sum, 0, sizeof sum);
+    for (i = 0; i < nstats; i++) {
+        w = &all_stats[i];
+        for (j = 0; j < NUM_METHODS; j++) {
+            for (k = 0; k <= MAX_STATUS_CODE - MIN_STATUS_CODE; k++) {
+                sum.requests[j][k] += STAT_LOAD(w->requests[j][k]);
+            }
+        }
+        sum.bad_requests += STAT_LOAD(w->bad_requests);
+        sum.sent_bytes += STAT_LOAD(w->sent_bytes);
+        sum.accepted += STAT_LOAD(w->accepted);
+        sum.open_connections += STAT_LOAD(w->open_connections);
+        sum.file_cache_hits += STAT_LOAD(w->file_cache_hits);
+        sum.file_cache_misses += STAT_LOAD(w->file_cache_misses);
+        sum.content_cache_hits += STAT_LOAD(w->content_cache_hits);
+        sum.log_dropped += STAT_LOAD(w->log_dropped);
+        sum.upstream_connects += STAT_LOAD(w->upstream_connects);
+        sum.upstream_reused += STAT_LOAD(w->upstream_reused);
+        sum.upstream_errors += STAT_LOAD(w->upstream_errors);
+        sum.throttled += STAT_LOAD(w->throttled);
+        for (j = 0; j < NUM_PHASES; j++) {
+            for (k = 0; k < HIST_BUCKETS; k++) {
+                sum.phases[j].counts[k] += STAT_LOAD(w->phases[j].counts[k]);
+            }
+            sum.phases[j].count += STAT_LOAD(w->phases[j].count);
+            sum.phases[j].sum += STAT_LOAD(w->phases[j].sum);
+        }
+    }
+    buf_printf(&buf, &len, &cap, "# HELP httpd_requests_total Requests answered, by method and status code.\n"
+               "# TYPE httpd_requests_total counter\n");
+    for (j = 0; j < NUM_METHODS; j++) {
+        for (k = 0; k <= MAX_STATUS_CODE - MIN_STATUS_CODE; k++) {
+            if (sum.requests[j][k]) {
+                buf_printf(&buf, &len, &cap, "httpd_requests_total{method=\"%s\",code=\"%d\"} %lu\n",
+                           method_names[j], k + MIN_STATUS_CODE, sum.requests[j][k]);
+            }
+        }
+    }
+    buf_printf(&buf, &len, &cap, "# HELP httpd_bad_requests_total Requests that could not be parsed.\n"
+               "# TYPE httpd_bad_requests_total counter\nhttpd_bad_requests_total %lu\n", sum.bad_requests);
+    buf_printf(&buf, &len, &cap, "# HELP httpd_sent_bytes_total Response bytes handed to the kernel.\n"
+               "# TYPE httpd_sent_bytes_total counter\nhttpd_sent_bytes_total %lu\n", sum.sent_bytes);
+    buf_printf(&buf, &len, &cap, "# HELP httpd_accepted_connections_total Connections accepted.\n"
+               "# TYPE httpd_accepted_connections_total counter\nhttpd_accepted_connections_total %lu\n",
+               sum.accepted);
+    buf_printf(&buf, &len, &cap, "# HELP httpd_open_connections Connections currently open.\n"
+               "# TYPE httpd_open_connections gauge\nhttpd_open_connections %ld\n", sum.open_connections);
+    buf_printf(&buf, &len, &cap, "# HELP httpd_file_cache_hits_total File cache lookups that found a valid entry.\n"
+               "# TYPE httpd_file_cache_hits_total counter\nhttpd_file_cache_hits_total %lu\n", sum.file_cache_hits);
+    buf_printf(&buf, &len, &cap, "# HELP httpd_file_cache_misses_total File cache lookups that had to open the file.\n"
+               "# TYPE httpd_file_cache_misses_total counter\nhttpd_file_cache_misses_total %lu\n",
+               sum.file_cache_misses);
+    buf_printf(&buf, &len, &cap, "# HELP httpd_content_cache_hits_total Responses served from cached file content.\n"
+               "# TYPE httpd_content_cache_hits_total counter\nhttpd_content_cache_hits_total %lu\n",
+               sum.content_cache_hits);
+    buf_printf(&buf, &len, &cap, "# HELP httpd_access_log_dropped_total Access log records dropped on a full ring.\n"
+               "# TYPE httpd_access_log_dropped_total counter\nhttpd_access_log_dropped_total %lu\n",
+               sum.log_dropped);
+    buf_printf(&buf, &len, &cap, "# HELP httpd_upstream_connects_total Connections opened to proxy upstreams.\n"
+               "# TYPE httpd_upstream_connects_total counter\nhttpd_upstream_connects_total %lu\n",
+               sum.upstream_connects);
+    buf_printf(&buf, &len, &cap, "# HELP httpd_upstream_reused_total Proxied requests sent on a pooled upstream connection.\n"
+               "# TYPE httpd_upstream_reused_total counter\nhttpd_upstream_reused_total %lu\n",
+               sum.upstream_reused);
+    buf_printf(&buf, &len, &cap, "# HELP httpd_upstream_errors_total Failed exchanges with proxy upstreams.\n"
+               "# TYPE httpd_upstream_errors_total counter\nhttpd_upstream_errors_total %lu\n",
+               sum.upstream_errors);
+    buf_printf(&buf, &len, &cap, "# HELP httpd_throttled_total Times a response was paused by a bandwidth limit.\n"
+               "# TYPE httpd_throttled_total counter\nhttpd_throttled_total %lu\n",
+               sum.throttled);
+    // Prometheusのバケットは2の冪マイクロ秒ごとにまとめ、分位数は細かいバケットから求める
+    buf_printf(&buf, &len, &cap, "# HELP httpd_phase_duration_seconds Time spent in each phase of a request.\n"
+               "# TYPE httpd_phase_duration_seconds histogram\n");
+    for (j = 0; j < NUM_PHASES; j++) {
+        cumulative = 0;
+        k = 0;
+        for (i = 0; i <= HIST_MAX_EXP; i++) {
+            limit = 1UL << i;
+            while (k < HIST_BUCKETS && histogram_bucket_limit(k) <= limit) {
+                cumulative += sum.phases[j].counts[k++];
+            }
+            buf_printf(&buf, &len, &cap, "httpd_phase_duration_seconds_bucket{phase=\"%s\",le=\"%g\"} %lu\n",
+                       phase_names[j], limit / 1e6, cumulative);
+        }
+        buf_printf(&buf, &len, &cap, "httpd_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n"
+                   "httpd_phase_duration_seconds_sum{phase=\"%s\"} %.6f\n"
+                   "httpd_phase_duration_seconds_count{phase=\"%s\"} %lu\n",
+                   phase_names[j], sum.phases[j].count, phase_names[j], sum.phases[j].sum / 1e6,
+                   phase_names[j], sum.phases[j].count);
+    }
+    buf_printf(&buf, &len, &cap, "# HELP httpd_phase_duration_quantile_seconds Upper bound of each quantile "
+               "of the phase durations.\n# TYPE httpd_phase_duration_quantile_seconds gauge\n");
+    for (j = 0; j < NUM_PHASES; j++) {
+        for (q = 0; q < (int)(sizeof quantiles / sizeof quantiles[0]); q++) {
+            cumulative = 0;
+            for (k = 0; k < HIST_BUCKETS - 1; k++) {
+                cumulative += sum.phases[j].counts[k];
+                if (cumulative >= quantiles[q] * sum.phases[j].count) {
+                    break;
+                }
+            }
+            buf_printf(&buf, &len, &cap, "httpd_phase_duration_quantile_seconds{phase=\"%s\",quantile=\"%g\"} %g\n",
+                       phase_names[j], quantiles[q],
+                       sum.phases[j].count ? histogram_bucket_limit(k) / 1e6 : 0.0);
+        }
+    }
+    output_common_header_fields(conn, STATUS_200);
+    conn_printf(conn, "Content-Length: %ld\r\n", (long)len);
+    conn_write(conn, content_type, sizeof content_type - 1);
+    // HEADにはボディを付けない。ヘッダはGETのときと同じにしておく
+    if (strcmp(req->method, "HEAD") != 0) {
+        conn_write(conn, buf, len);
+        conn->body_bytes += len;
+    }
+    free(buf);
+}
+
+static int
+h2_preface_p(struct Connection *conn)
+{
+    size_t n = conn->ilen - conn->ihead;
+
+    if (n > H2_PREFACE_LEN) {
+        n = H2_PREFACE_LEN;
+    }
+    if (memcmp(conn->ibuf + conn->ihead, H2_PREFACE, n) != 0) {
+        return -1;
+    }
+    return n == H2_PREFACE_LEN;
+}
+
+static int
+h2c_upgrade_p(struct HTTPRequest *req)
+{
+    char *p;
+    size_t n;
+
+    // ボディのあるリクエストはHTTP/1のまま読み終えなければならないので、切り替えない
+    if (!http2_enabled || req->protocol_minor_version < 1 || req->chunked || req->length > 0
+        || !lookup_known_header(req, HDR_HTTP2_SETTINGS)) {
+        return 0;
+    }
+    p = lookup_known_header(req, HDR_UPGRADE);
+    if (!p) {
+        return 0;
+    }
+    for (;;) {
+        p += strspn(p, ", \t");
+        if (!*p) {
+            return 0;
+        }
+        n = strcspn(p, ", \t");
+        if (n == 3 && strncasecmp(p, "h2c", 3) == 0) {
+            return 1;
+        }
+        p += n;
+    }
+}
+
+static void
+start_h2(struct Connection *conn, struct HTTPRequest *req, char *docroot)
+{
+    static const char upgrade[] = "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    static const char *skip[] = { "connection", "upgrade", "http2-settings", "keep-alive",
+                                  "proxy-connection", "transfer-encoding", "te", NULL };
+    struct H2Session *h2;
+    struct H2Stream *st;
+    struct HTTPHeaderField *h;
+    unsigned char settings[H2_MAX_UPGRADE_SETTINGS];
+    char *name, *path;
+    long n;
+    int i, j, one = 1;
+
+    h2 = checked_malloc(sizeof(struct H2Session));
+    memset(h2, 0, sizeof(struct H2Session));
+    h2->window = H2_DEFAULT_WINDOW;
+    h2->initial_window = H2_DEFAULT_WINDOW;
+    h2->max_frame_size = H2_DEFAULT_FRAME_SIZE;
+    h2->decoder.max_size = HPACK_TABLE_SIZE;
+    h2->encoder.max_size = HPACK_TABLE_SIZE;
+    conn->h2 = h2;
+    conn->keep_alive = 1;
+    if (conn->out_type == OUT_SOCKET) {
+        // 小さなフレームが前のフレームのACKを待たされないよう、Nagleのアルゴリズムを止める
+        setsockopt(conn->outfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    }
+    if (req) {
+        conn_write(conn, STATUS_101, strlen(STATUS_101));
+        conn_write(conn, upgrade, sizeof upgrade - 1);
+    }
+    // サーバのコネクションプリフェイス
+    h2_frame_header(conn, 6, H2_SETTINGS, 0, 0);
+    conn_write(conn, "\0\3", 2);
+    h2_write32(conn, H2_MAX_STREAMS);
+    if (!req) {
+        conn->ihead += H2_PREFACE_LEN;
+        h2->preface = 1;
+        return;
+    }
+    // HTTP2-Settingsは相手の最初のSETTINGSの代わりで、ACKは返さない
+    n = base64url_decode(lookup_known_header(req, HDR_HTTP2_SETTINGS), settings, sizeof settings);
+    if (n < 0 || n % 6 != 0 || h2_apply_settings(h2, settings, n) != 0) {
+        log_error("invalid HTTP2-Settings header field");
+    }
+    // Upgradeしたリクエストは、半分閉じたストリーム1のリクエストとして応答する
+    st = new_h2_stream(1, h2->initial_window);
+    st->end_stream = 1;
+    h2->last_stream_id = 1;
+    h2_request_field(st, ":method", strlen(":method"), req->method, strlen(req->method));
+    path = checked_malloc(strlen(req->path) + (req->query ? strlen(req->query) + 1 : 0) + 1);
+    sprintf(path, req->query ? "%s?%s" : "%s", req->path, req->query);
+    h2_request_field(st, ":path", strlen(":path"), path, strlen(path));
+    free(path);
+    h2_request_field(st, ":scheme", strlen(":scheme"), "http", strlen("http"));
+    for (i = 0; i < req->nheaders; i++) {
+        h = &req->header[i];
+        name = req->buf + h->name.off;
+        for (j = 0; skip[j] && strcasecmp(name, skip[j]) != 0; j++)
+            ;
+        if (skip[j]) {
+            continue;
+        }
+        for (j = 0; name[j]; j++) {
+            name[j] = (char)tolower((int)name[j]);
+        }
+        h2_request_field(st, name, h->name.len, req->buf + h->value.off, h->value.len);
+    }
+    conn->ihead += req->header_len;
+    reset_request(req);
+    h2_respond(conn, st, docroot);
+}
+
+static int
+process_h2_frames(struct Connection *conn, char *docroot)
+{
+    struct H2Session *h2 = conn->h2;
+    unsigned char *p;
+    size_t len;
+    unsigned int id;
+    int ret;
+
+    if (h2->head) {
+        h2_poll_input(conn);
+    }
+    if (!h2->preface) {
+        ret = h2_preface_p(conn);
+        if (ret < 0) {
+            log_error("invalid HTTP/2 connection preface");
+            h2_goaway(conn, H2_PROTOCOL_ERROR);
+            return 1;
+        }
+        if (ret > 0) {
+            conn->ihead += H2_PREFACE_LEN;
+            h2->preface = 1;
+        }
+    }
+    // 送信待ちが溜まりすぎたら、先に送ってから続きを処理する
+    while (h2->preface && conn->olen < MAX_PIPELINED_OUTPUT
+           && conn->ilen - conn->ihead >= H2_FRAME_HEADER_SIZE) {
+        p = (unsigned char*)conn->ibuf + conn->ihead;
+        len = (p[0] << 16) | (p[1] << 8) | p[2];
+        if (len > H2_DEFAULT_FRAME_SIZE) {
+            // SETTINGS_MAX_FRAME_SIZEを広げていないので、これより大きなフレームは来てはならない
+            log_error("HTTP/2 frame is too large: %lu", (unsigned long)len);
+            h2_goaway(conn, H2_FRAME_SIZE_ERROR);
+            return 1;
+        }
+        if (conn->ilen - conn->ihead < H2_FRAME_HEADER_SIZE + len) {
+            break;
+        }
+        id = ((unsigned int)(p[5] & 0x7f) << 24) | (p[6] << 16) | (p[7] << 8) | p[8];
+        ret = h2_handle_frame(conn, p[3], p[4], id, p + H2_FRAME_HEADER_SIZE, len, docroot);
+        conn->ihead += H2_FRAME_HEADER_SIZE + len;
+        if (ret) {
+            log_error("HTTP/2 connection error: %d", ret);
+            h2_goaway(conn, ret);
+            return 1;
+        }
+    }
+    if (conn->ihead == conn->ilen) {
+        conn->ihead = conn->ilen = 0;
+    }
+    // 受け取ったDATAの分は、ウィンドウが半分に減ったところでまとめて返す
+    if (h2->unacked >= H2_DEFAULT_WINDOW / 2) {
+        h2_window_update(conn, 0, h2->unacked);
+        h2->unacked = 0;
+    }
+    if (draining && h2->preface && !h2->goaway) {
+        // 終わろうとしているので、新しいストリームを開かないよう相手に伝える
+        h2_goaway(conn, H2_NO_ERROR);
+    }
+    h2_send_data(conn);
+    if (h2->goaway && !h2->head) {
+        // 相手がGOAWAYを送ってきたので、応答し終えたら閉じる
+        conn->keep_alive = 0;
+        return 1;
+    }
+    return output_pending_p(conn);
+}
+
+static void
+h2_poll_input(struct Connection *conn)
+{
+    ssize_t n;
+
+    if (conn->eof || conn->ilen - conn->ihead >= H2_MAX_INPUT_BACKLOG) {
+        return;
+    }
+    reserve_input(conn);
+    n = recv(conn->fd, conn->ibuf + conn->ilen, conn->icap - conn->ilen, MSG_DONTWAIT);
+    if (n > 0) {
+        conn->ilen += n;
+    } else if (n == 0) {
+        conn->eof = 1;
+    }
+}
+
+static int
+h2_handle_frame(struct Connection *conn, int type, int flags, unsigned int id,
+                unsigned char *p, size_t len, char *docroot)
+{
+    struct H2Session *h2 = conn->h2;
+    struct H2Stream *st;
+    size_t pad = 0;
+    unsigned long v;
+
+    // ヘッダブロックの途中には、同じストリームのCONTINUATIONしか挟まらない
+    if (h2->hstream && (type != H2_CONTINUATION || id != h2->hstream)) {
+        return H2_PROTOCOL_ERROR;
+    }
+    switch (type) {
+    case H2_DATA:
+        if (id == 0 || id > h2->last_stream_id) {
+            return H2_PROTOCOL_ERROR;
+        }
+        if ((flags & H2_FLAG_PADDED) && (len == 0 || p[0] >= len)) {
+            return H2_PROTOCOL_ERROR;
+        }
+        // ボディを受け取るハンドラはないので、フロー制御に数えて読み捨てる
+        h2->unacked += len;
+        st = h2_find_stream(h2, id, 0);
+        if (st && (flags & H2_FLAG_END_STREAM)) {
+            st->end_stream = 1;
+        }
+        return 0;
+    case H2_HEADERS:
+        if (id == 0 || !(id & 1)) {
+            return H2_PROTOCOL_ERROR;
+        }
+        if (flags & H2_FLAG_PADDED) {
+            if (len == 0) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+            pad = p[0];
+            p++;
+            len--;
+        }
+        if (flags & H2_FLAG_PRIORITY) {
+            if (len < 5) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+            p += 5;
+            len -= 5;
+        }
+        if (pad > len) {
+            return H2_PROTOCOL_ERROR;
+        }
+        len -= pad;
+        if (flags & H2_FLAG_END_HEADERS) {
+            return h2_end_headers(conn, id, flags & H2_FLAG_END_STREAM, p, len, docroot);
+        }
+        h2->hstream = id;
+        h2->hflags = flags;
+        h2->hblock_len = 0;
+        // fall through
+    case H2_CONTINUATION:
+        if (!h2->hstream) {
+            return H2_PROTOCOL_ERROR;
+        }
+        if (h2->hblock_len + len > MAX_REQUEST_HEADER_LENGTH) {
+            return H2_ENHANCE_YOUR_CALM;
+        }
+        grow_buffer(&h2->hblock, &h2->hblock_cap, h2->hblock_len + len);
+        memcpy(h2->hblock + h2->hblock_len, p, len);
+        h2->hblock_len += len;
+        if (type == H2_HEADERS || !(flags & H2_FLAG_END_HEADERS)) {
+            return 0;
+        }
+        h2->hstream = 0;
+        return h2_end_headers(conn, id, h2->hflags & H2_FLAG_END_STREAM,
+                              (unsigned char*)h2->hblock, h2->hblock_len, docroot);
+    case H2_PRIORITY:
+        if (id == 0) {
+            return H2_PROTOCOL_ERROR;
+        }
+        // 優先度は使わず、どのストリームにも同じだけ送る
+        return len == 5 ? 0 : H2_FRAME_SIZE_ERROR;
+    case H2_RST_STREAM:
+        if (id == 0 || id > h2->last_stream_id) {
+            return H2_PROTOCOL_ERROR;
+        }
+        if (len != 4) {
+            return H2_FRAME_SIZE_ERROR;
+        }
+        st = h2_find_stream(h2, id, 1);
+        if (st) {
+            free_h2_stream(st);
+        }
+        return 0;
+    case H2_SETTINGS:
+        if (id != 0) {
+            return H2_PROTOCOL_ERROR;
+        }
+        if (flags & H2_FLAG_ACK) {
+            return len == 0 ? 0 : H2_FRAME_SIZE_ERROR;
+        }
+        if (len % 6 != 0) {
+            return H2_FRAME_SIZE_ERROR;
+        }
+        v = h2_apply_settings(h2, p, len);
+        if (v) {
+            return v;
+        }
+        h2_frame_header(conn, 0, H2_SETTINGS, H2_FLAG_ACK, 0);
+        return 0;
+    case H2_PING:
+        if (id != 0) {
+            return H2_PROTOCOL_ERROR;
+        }
+        if (len != 8) {
+            return H2_FRAME_SIZE_ERROR;
+        }
+        if (!(flags & H2_FLAG_ACK)) {
+            h2_frame_header(conn, 8, H2_PING, H2_FLAG_ACK, 0);
+            conn_write(conn, (char*)p, 8);
+        }
+        return 0;
+    case H2_GOAWAY:
+        if (id != 0) {
+            return H2_PROTOCOL_ERROR;
+        }
+        // 新しいストリームはもう来ないが、始めたストリームは送り終える
+        h2->goaway = 1;
+        return 0;
+    case H2_WINDOW_UPDATE:
+        if (len != 4) {
+            return H2_FRAME_SIZE_ERROR;
+        }
+        v = ((unsigned long)(p[0] & 0x7f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        if (id == 0) {
+            if (v == 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if (h2->window + (long)v > H2_MAX_WINDOW) {
+                return H2_FLOW_CONTROL_ERROR;
+            }
+            h2->window += v;
+            return 0;
+        }
+        if (id > h2->last_stream_id) {
+            return H2_PROTOCOL_ERROR;
+        }
+        st = h2_find_stream(h2, id, 0);
+        if (!st) {
+            // 送り終えたストリームへのWINDOW_UPDATEは行き違いなので無視する
+            return 0;
+        }
+        if (v == 0 || st->window + (long)v > H2_MAX_WINDOW) {
+            h2_find_stream(h2, id, 1);
+            h2_rst_stream(conn, id, v == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            free_h2_stream(st);
+            return 0;
+        }
+        st->window += v;
+        return 0;
+    case H2_PUSH_PROMISE:
+        // クライアントはプッシュできない
+        return H2_PROTOCOL_ERROR;
+    default:
+        // 知らない種類のフレームは無視する
+        return 0;
+    }
+}
+
+static int
+h2_end_headers(struct Connection *conn, unsigned int id, int end_stream,
+               unsigned char *block, size_t len, char *docroot)
+{
+    struct H2Session *h2 = conn->h2;
+    struct H2Stream *st;
+
+    if (id <= h2->last_stream_id) {
+        // 応答中のストリームのトレイラー。中身は使わないが、動的テーブルを合わせるため解く
+        // 送り終えて閉じたストリームへのものは行き違いなので無視する
+        if (hpack_decode(h2, block, len, NULL) < 0) {
+            return H2_COMPRESSION_ERROR;
+        }
+        st = h2_find_stream(h2, id, 0);
+        if (st && end_stream) {
+            st->end_stream = 1;
+        }
+        return 0;
+    }
+    h2->last_stream_id = id;
+    if (h2->goaway || h2->nstreams >= H2_MAX_STREAMS) {
+        if (hpack_decode(h2, block, len, NULL) < 0) {
+            return H2_COMPRESSION_ERROR;
+        }
+        if (!h2->goaway) {
+            h2_rst_stream(conn, id, H2_REFUSED_STREAM);
+        }
+        return 0;
+    }
+    st = new_h2_stream(id, h2->initial_window);
+    st->end_stream = end_stream;
+    if (hpack_decode(h2, block, len, st) < 0) {
+        free_h2_stream(st);
+        return H2_COMPRESSION_ERROR;
+    }
+    if (st->malformed || !st->pseudo[PSEUDO_METHOD] || !st->pseudo[PSEUDO_PATH] || !st->pseudo[PSEUDO_SCHEME]) {
+        log_error("malformed HTTP/2 request on stream %u", id);
+        h2_rst_stream(conn, id, H2_PROTOCOL_ERROR);
+        free_h2_stream(st);
+        return 0;
+    }
+    h2_respond(conn, st, docroot);
+    return 0;
+}
+
+static int
+h2_apply_settings(struct H2Session *h2, unsigned char *p, size_t len)
+{
+    struct H2Stream *st;
+    unsigned long v;
+    size_t i;
+    int id;
+
+    for (i = 0; i + 6 <= len; i += 6) {
+        id = (p[i] << 8) | p[i + 1];
+        v = ((unsigned long)p[i + 2] << 24) | (p[i + 3] << 16) | (p[i + 4] << 8) | p[i + 5];
+        switch (id) {
+        case H2_SETTINGS_HEADER_TABLE_SIZE:
+            // 符号化の動的テーブルは相手の許す大きさとHPACK_TABLE_SIZEの小さい方にする
+            if (v > HPACK_TABLE_SIZE) {
+                v = HPACK_TABLE_SIZE;
+            }
+            if (v != h2->encoder.max_size) {
+                hpack_resize(&h2->encoder, v);
+                h2->table_size_update = 1;
+            }
+            break;
+        case H2_SETTINGS_ENABLE_PUSH:
+            if (v > 1) {
+                return H2_PROTOCOL_ERROR;
+            }
+            break;
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+            if (v > H2_MAX_WINDOW) {
+                return H2_FLOW_CONTROL_ERROR;
+            }
+            // 開いているストリームのウィンドウも、初期値の差だけずらす
+            for (st = h2->head; st; st = st->next) {
+                st->window += (long)v - h2->initial_window;
+                if (st->window > H2_MAX_WINDOW) {
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+            }
+            h2->initial_window = v;
+            break;
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if (v < H2_DEFAULT_FRAME_SIZE || v > H2_MAX_FRAME_SIZE) {
+                return H2_PROTOCOL_ERROR;
+            }
+            h2->max_frame_size = v;
+            break;
+        }
+    }
+    return 0;
+}
+
+static void
+h2_respond(struct Connection *conn, struct H2Stream *st, char *docroot)
+{
+    struct H2Session *h2 = conn->h2;
+    struct HTTPRequest *req = &st->req;
+    char *hdr;
+    size_t len;
+    int i, j, end_stream;
+
+    cancel_timer(&conn->timer);
+    conn->nrequests++;
+    swap_h2_output(conn, st);
+    conn->status = 0;
+    conn->body_bytes = 0;
+    if (h2_build_request(st) == 0) {
+        respond_to(req, conn, docroot);
+        log_access(req, conn);
+        count_request(req, conn);
+    } else {
+        bad_request(conn);
+        log_access(NULL, conn);
+        count_request(NULL, conn);
+    }
+    // ストリームの出力にはHTTP/1のレスポンスが積まれているので、ヘッダとボディに分ける
+    hdr = take_response_header(conn, &len);
+    swap_h2_output(conn, st);
+    // GOAWAYの後でも、閉じるのはprocess_h2_framesが残りのストリームを送り終えたのを見てから
+    conn->keep_alive = 1;
+    // 長さ0の断片があるとEND_STREAMを付ける位置がずれるので、ここで除いておく
+    for (i = j = st->seghead; i < st->nsegs; i++) {
+        if (st->segs[i].len > 0) {
+            st->segs[j++] = st->segs[i];
+        } else if (st->segs[i].file) {
+            release_cached_file(st->segs[i].file);
+        }
+    }
+    st->nsegs = j;
+    end_stream = st->seghead == st->nsegs;
+    h2_output_headers(conn, st, hdr, len, end_stream);
+    free(hdr);
+    if (end_stream) {
+        if (!st->end_stream) {
+            // リクエストのボディは要らないので、送るのをやめさせる
+            h2_rst_stream(conn, st->id, H2_NO_ERROR);
+        }
+        free_h2_stream(st);
+        return;
+    }
+    if (h2->tail) {
+        h2->tail->next = st;
+    } else {
+        h2->head = st;
+    }
+    h2->tail = st;
+    h2->nstreams++;
+}
+
+static void
+swap_h2_output(struct Connection *conn, struct H2Stream *st)
+{
+    struct OutputSegment *segs;
+    char *obuf;
+    size_t olen, ocap;
+    int nsegs, segcap, seghead;
+
+    obuf = conn->obuf;
+    olen = conn->olen;
+    ocap = conn->ocap;
+    segs = conn->segs;
+    nsegs = conn->nsegs;
+    segcap = conn->segcap;
+    seghead = conn->seghead;
+    conn->obuf = st->obuf;
+    conn->olen = st->olen;
+    conn->ocap = st->ocap;
+    conn->segs = st->segs;
+    conn->nsegs = st->nsegs;
+    conn->segcap = st->segcap;
+    conn->seghead = st->seghead;
+    st->obuf = obuf;
+    st->olen = olen;
+    st->ocap = ocap;
+    st->segs = segs;
+    st->nsegs = nsegs;
+    st->segcap = segcap;
+    st->seghead = seghead;
+}
+
+static char*
+take_response_header(struct Connection *conn, size_t *len)
+{
+    struct OutputSegment *seg;
+    char *hdr = NULL, *data, *end;
+    size_t n = 0, cap = 0, start, used;
+
+    // ヘッダはobufに書かれるか、キャッシュしたレスポンスの先頭にあり、ファイルの断片より前で終わる
+    while (output_pending_p(conn) && conn->segs[conn->seghead].type != SEG_FILE) {
+        seg = &conn->segs[conn->seghead];
+        data = (seg->type == SEG_BUF ? conn->obuf : seg->data) + seg->offset;
+        grow_buffer(&hdr, &cap, n + seg->len + 1);
+        memcpy(hdr + n, data, seg->len);
+        start = n >= 3 ? n - 3 : 0;
+        n += seg->len;
+        hdr[n] = '\0';
+        end = memmem(hdr + start, n - start, "\r\n\r\n", 4);
+        if (end) {
+            used = seg->len - (n - (end + 4 - hdr));
+            n = end + 4 - hdr;
+            hdr[n] = '\0';
+            seg->offset += used;
+            seg->len -= used;
+            if (seg->len == 0) {
+                pop_segment(conn);
+            }
+            break;
+        }
+        pop_segment(conn);
+    }
+    *len = n;
+    return hdr;
+}
 
-// respond_toのヘルパー関数
-static void do_file_response(struct HTTPRequest *req, FILE *out, char *docroot);
-static void method_not_allowed(struct HTTPRequest *req, FILE *out);
-static void not_implemented(struct HTTPRequest *req, FILE *out);
-static void not_found(struct HTTPRequest *req, FILE *out);
+static void
+h2_output_headers(struct Connection *conn, struct H2Stream *st, char *hdr, size_t len, int end_stream)
+{
+    static const char *skip[] = { "connection", "keep-alive", "transfer-encoding", "upgrade",
+                                  "proxy-connection", NULL };
+    // 値がレスポンスごとに変わり、動的テーブルに入れても次に当たらないヘッダ
+    static const char *unindexed[] = { "content-length", "etag", "last-modified", "content-range",
+                                       "location", NULL };
+    struct H2Session *h2 = conn->h2;
+    char *block = NULL, *p, *eol, *colon, *v, *end = hdr + len;
+    size_t blen = 0, bcap = 0, off, n;
+    char status[4];
+    int i, j, flags;
 
-// ヘッダーフィールドの雛形を出力するヘルパー関数
-static void output_common_header_fields(struct HTTPRequest *req, FILE *out, char *status);
+    if (h2->table_size_update) {
+        hpack_put_int(&block, &blen, &bcap, 5, 0x20, h2->encoder.max_size);
+        h2->table_size_update = 0;
+    }
+    // ステータス行は"HTTP/1.1 200 OK"の形
+    memcpy(status, len > 12 ? hdr + 9 : "500", 3);
+    status[3] = '\0';
+    hpack_encode_field(&h2->encoder, &block, &blen, &bcap, ":status", strlen(":status"), status, 3, 1);
+    p = len > 0 ? strstr(hdr, "\r\n") : NULL;
+    for (p = p ? p + 2 : end; p < end && (eol = strstr(p, "\r\n")) && eol > p; p = eol + 2) {
+        colon = memchr(p, ':', eol - p);
+        if (!colon) {
+            continue;
+        }
+        for (i = 0; p + i < colon; i++) {
+            p[i] = (char)tolower((int)p[i]);
+        }
+        *colon = '\0';
+        for (j = 0; skip[j] && strcmp(p, skip[j]) != 0; j++)
+            ;
+        if (skip[j]) {
+            continue;
+        }
+        for (j = 0; unindexed[j] && strcmp(p, unindexed[j]) != 0; j++)
+            ;
+        for (v = colon + 1; v < eol && (*v == ' ' || *v == '\t'); v++)
+            ;
+        hpack_encode_field(&h2->encoder, &block, &blen, &bcap, p, colon - p, v, eol - v, !unindexed[j]);
+    }
+    // 相手のフレームの大きさに収まらなければCONTINUATIONに分ける
+    off = 0;
+    do {
+        n = blen - off < h2->max_frame_size ? blen - off : h2->max_frame_size;
+        flags = off + n == blen ? H2_FLAG_END_HEADERS : 0;
+        if (off == 0 && end_stream) {
+            flags |= H2_FLAG_END_STREAM;
+        }
+        h2_frame_header(conn, n, off == 0 ? H2_HEADERS : H2_CONTINUATION, flags, st->id);
+        conn_write(conn, block + off, n);
+        off += n;
+    } while (off < blen);
+    free(block);
+}
 
-// docrotを頂点とするディレクトリツリーにおいてpathによって特定されるファイルについてのFleInfo構造体を構築しそれへのポインタを返す関数
-static struct FileInfo* get_fileinfo(char *docroot, char *path);
+static void
+h2_send_data(struct Connection *conn)
+{
+    struct H2Session *h2 = conn->h2;
+    struct H2Stream *st;
+    size_t budget = H2_SEND_QUANTUM, n;
+    int stalled = 0;
 
-// docrootを頂点とするディレクトリツリーにおいてpathで特定されるファイルの、システム上のフルパスを意味する文字列を構築し返すヘルパー関数
-static char* build_fspath(char *docroot, char *path);
+    // 1回の送信で積む量をbudgetまでに抑え、各ストリームに1フレームずつ順に送らせる
+    // 大きなファイルの後ろで小さなファイルが待たされず、読み込みの合間に新しいフレームも処理できる
+    while (h2->head && budget > 0 && h2->window > 0 && stalled < h2->nstreams) {
+        st = h2->head;
+        h2->head = st->next;
+        if (!h2->head) {
+            h2->tail = NULL;
+        }
+        st->next = NULL;
+        n = h2_send_frame(conn, st, budget);
+        if (st->seghead == st->nsegs) {
+            h2->nstreams--;
+            if (!st->end_stream) {
+                h2_rst_stream(conn, st->id, H2_NO_ERROR);
+            }
+            free_h2_stream(st);
+            stalled = 0;
+            continue;
+        }
+        if (h2->tail) {
+            h2->tail->next = st;
+        } else {
+            h2->head = st;
+        }
+        h2->tail = st;
+        if (n == 0) {
+            // ウィンドウの開くのを待つストリームばかりなら、一巡したところでやめる
+            stalled++;
+        } else {
+            stalled = 0;
+            budget -= n;
+        }
+    }
+}
 
-// infoで指し示されるFileInfo構造体インスタンスを解放するヘルパー関数
-static void free_fileinfo(struct FileInfo *info);
+static size_t
+h2_send_frame(struct Connection *conn, struct H2Stream *st, size_t max)
+{
+    struct H2Session *h2 = conn->h2;
+    struct OutputSegment *seg = &st->segs[st->seghead];
+    size_t len = seg->len;
+    int flags;
 
-// infoで指し示されるFileInfo構造体インスタンスを元に、そのファイルのコンテンツの種別を返すヘルパー関数
-static char* guess_content_type(struct FileInfo *info);
+    if (len > h2->max_frame_size) {
+        len = h2->max_frame_size;
+    }
+    if (len > max) {
+        len = max;
+    }
+    if (st->window <= 0 || h2->window <= 0) {
+        return 0;
+    }
+    if ((long)len > st->window) {
+        len = st->window;
+    }
+    if ((long)len > h2->window) {
+        len = h2->window;
+    }
+    flags = len == (size_t)seg->len && st->seghead + 1 == st->nsegs ? H2_FLAG_END_STREAM : 0;
+    h2_frame_header(conn, len, H2_DATA, flags, st->id);
+    switch (seg->type) {
+    case SEG_BUF:
+        conn_write(conn, st->obuf + seg->offset, len);
+        break;
+    case SEG_MEM:
+        if (seg->file) {
+            seg->file->refcount++;
+        }
+        queue_segment(conn, SEG_MEM, seg->data, -1, seg->offset, len, seg->file);
+        break;
+    case SEG_FILE:
+        if (seg->file) {
+            seg->file->refcount++;
+        }
+        queue_segment(conn, SEG_FILE, NULL, seg->fd, seg->offset, len, seg->file);
+        break;
+    }
+    seg->offset += len;
+    seg->len -= len;
+    if (seg->len == 0) {
+        h2_pop_segment(st);
+    }
+    st->window -= len;
+    h2->window -= len;
+    return len;
+}
 
-// メモリ割り当ての成否を確認することを含めたmalloc
-static void* checked_malloc(size_t sz);
+static void
+h2_frame_header(struct Connection *conn, size_t len, int type, int flags, unsigned int id)
+{
+    unsigned char h[H2_FRAME_HEADER_SIZE];
 
-// メッセージを出力するとともに強制終了するヘルパー関数
-static void log_exit(char *fmt, ...);
+    h[0] = len >> 16;
+    h[1] = len >> 8;
+    h[2] = len;
+    h[3] = type;
+    h[4] = flags;
+    h[5] = (id >> 24) & 0x7f;
+    h[6] = id >> 16;
+    h[7] = id >> 8;
+    h[8] = id;
+    conn_write(conn, (char*)h, sizeof h);
+}
 
-int
-main(int argc, char *argv[])
+static void
+h2_write32(struct Connection *conn, unsigned long v)
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <docroot>\n", argv[0]);
-        exit(1);
-    }
-    install_signal_handlers();
-    service(stdin, stdout, argv[1]);
-    exit(0);
+    unsigned char b[4];
+
+    b[0] = v >> 24;
+    b[1] = v >> 16;
+    b[2] = v >> 8;
+    b[3] = v;
+    conn_write(conn, (char*)b, sizeof b);
 }
 
 static void
-install_signal_handlers(void)
+h2_rst_stream(struct Connection *conn, unsigned int id, int code)
 {
-    trap_signal(SIGPIPE, signal_exit);
+    h2_frame_header(conn, 4, H2_RST_STREAM, 0, id);
+    h2_write32(conn, code);
 }
 
 static void
-trap_signal(int sig, sighandler_t handler)
+h2_goaway(struct Connection *conn, int code)
 {
-    struct sigaction act;
-    act.sa_handler = handler;
-    sigemptyset(&act.sa_mask);
-    act.sa_flags = SA_RESTART;
-    if(sigaction(sig, &act, NULL) < 0) {
-        log_exit("sigaction() failded: %s", strerror(errno));
+    h2_frame_header(conn, 8, H2_GOAWAY, 0, 0);
+    h2_write32(conn, conn->h2->last_stream_id);
+    h2_write32(conn, code);
+    conn->h2->goaway = 1;
+    // エラーでなければ、受け付け済みのストリームを送り終えてから閉じる
+    if (code != H2_NO_ERROR) {
+        conn->keep_alive = 0;
     }
 }
 
 static void
-signal_exit(int sig)
+h2_window_update(struct Connection *conn, unsigned int id, unsigned long inc)
 {
-    log_exit("exit by signal %d", sig);
+    h2_frame_header(conn, 4, H2_WINDOW_UPDATE, 0, id);
+    h2_write32(conn, inc);
 }
 
-static void
-service(FILE *in, FILE *out, char *docroot)
+static struct H2Stream*
+new_h2_stream(unsigned int id, long window)
 {
-    struct HTTPRequest *req;
-    req = read_request(in);
-    respond_to(req, out, docroot);
-    free_request(req);
+    struct H2Stream *st;
+
+    st = checked_malloc(sizeof(struct H2Stream));
+    memset(st, 0, sizeof(struct H2Stream));
+    st->id = id;
+    st->window = window;
+    reset_request(&st->req);
+    st->segcap = 8;
+    st->segs = checked_malloc(sizeof(struct OutputSegment) * st->segcap);
+    return st;
 }
 
-static struct HTTPRequest*
-read_request(FILE *in)
+static void
+free_h2_stream(struct H2Stream *st)
 {
-    struct HTTPRequest *req;
-    struct HTTPHeaderField *h;
-    req = checked_malloc(sizeof(struct HTTPRequest));
-    read_request_line(req, in);
-    req->header = NULL;
-    while ((h = read_header_field(in)) != NULL) {
-        h->next = req->header;
-        req->header = h;
+    int i;
+
+    while (st->seghead < st->nsegs) {
+        h2_pop_segment(st);
     }
-    req->length = content_length(req);
-    if (req->length != 0) {
-        if (req->length > MAX_REQUEST_BODY_LENGTH) {
-            log_exit("request body is too long");
-        }
-        req->body = checked_malloc(req->length);
-        if (fread(req->body, req->length, 1, in) < 1) {
-            log_exit("failed to read request body");
-        }
-    } else {
-        req->body = NULL;
+    for (i = 0; i < NUM_PSEUDO_HEADERS; i++) {
+        free(st->pseudo[i]);
     }
-    return req;
+    free(st->hbuf);
+    free(st->obuf);
+    free(st->segs);
+    free(st);
 }
 
 static void
-read_request_line(struct HTTPRequest *req, FILE *in)
+free_h2_session(struct H2Session *h2)
 {
-    char buf[LINE_BUF_SIZE];
-    char *path, *p;
-    if (!fgets(buf, LINE_BUF_SIZE, in)) {
-        log_exit("no request line found");
+    struct H2Stream *st;
+
+    while (h2->head) {
+        st = h2->head;
+        h2->head = st->next;
+        free_h2_stream(st);
     }
-    p = strchr(buf, ' ');
-    if (!p) {
-        log_exit("parse error on request line (1): %s", buf);
-    }
-    *p++ = '\0';
-    req->method = checked_malloc(p - buf);
-    strcpy(req->method, buf);
-    upcase(req->method);
-    path = p;
-    p = strchr(path, ' ');
-    if (!p) {
-        log_exit("parse error on request line (2): %s", buf);
+    while (h2->decoder.count > 0) {
+        hpack_evict(&h2->decoder);
     }
-    *p++ = '\0';
-    req->path = checked_malloc(p - path);
-    strcpy(req->path, path);
-    if(strncasecmp(p, "HTTP/1.", strlen("HTTP/1.")) != 0) {
-        log_exit("parse error on request line (3): %s", buf);
+    while (h2->encoder.count > 0) {
+        hpack_evict(&h2->encoder);
     }
-    p += strlen("HTTP/1.");
-    req->protocol_minor_version = atoi(p);
+    free(h2->hblock);
+    free(h2->scratch[0]);
+    free(h2->scratch[1]);
+    free(h2);
 }
 
-static struct HTTPHeaderField*
-read_header_field(FILE *in)
+static struct H2Stream*
+h2_find_stream(struct H2Session *h2, unsigned int id, int unlink)
 {
-    struct HTTPHeaderField *h;
-    char buf[LINE_BUF_SIZE];
-    char *p;
-    if (!fgets(buf, LINE_BUF_SIZE, in)) {
-        log_exit("failed to read request header field: %s", strerror(errno));
+    struct H2Stream *st, *prev = NULL;
+
+    for (st = h2->head; st && st->id != id; st = st->next) {
+        prev = st;
     }
-    if ((buf[0] == '\n') || (strcmp(buf, "\r\n") == 0)) {
-        return NULL;
+    if (!st || !unlink) {
+        return st;
     }
-    p = strchr(buf, ':');
-    if (!p) {
-        log_exit("parse error on request header field: %s", buf);
-    }
-    *p++ = '\0';
-    h = checked_malloc(sizeof(struct HTTPHeaderField));
-    h->name = checked_malloc(p - buf);
-    strcpy(h->name, buf);
-    p += strspn(p, " \t");
-    h->value = checked_malloc(strlen(p) + 1);
-    strcpy(h->value, p);
-    return h;
+    if (prev) {
+        prev->next = st->next;
+    } else {
+        h2->head = st->next;
+    }
+    if (h2->tail == st) {
+        h2->tail = prev;
+    }
+    st->next = NULL;
+    h2->nstreams--;
+    return st;
 }
 
 static void
-upcase(char *str)
+h2_pop_segment(struct H2Stream *st)
 {
-    char *p;
-    for (p = str; *p; p++) {
-        *p = (char)toupper((int)*p);
+    struct OutputSegment *seg = &st->segs[st->seghead++];
+
+    if (seg->file) {
+        release_cached_file(seg->file);
     }
 }
 
 static void
-free_request(struct HTTPRequest *req)
+h2_request_field(struct H2Stream *st, const char *name, size_t nlen, const char *value, size_t vlen)
 {
-    struct HTTPHeaderField *h, *head;
-    head = req->header;
-    while (head) {
-        h = head;
-        head = head->next;
-        free(h->name);
-        free(h->value);
-        free(h);
+    // HTTP/2では使えない、接続についてのヘッダ
+    static const char *connection_specific[] = { "connection", "keep-alive", "proxy-connection",
+                                                 "transfer-encoding", "upgrade", NULL };
+    size_t i;
+    int c, j;
+
+    if (!st || st->malformed) {
+        return;
+    }
+    // 名前は小文字のトークンで、値に改行やNULは書けない
+    for (i = 0; i < nlen; i++) {
+        c = (unsigned char)name[i];
+        if (c <= ' ' || c >= 0x7f || (c >= 'A' && c <= 'Z') || (c == ':' && i > 0)) {
+            st->malformed = 1;
+            return;
+        }
+    }
+    if (nlen == 0 || memchr(value, '\r', vlen) || memchr(value, '\n', vlen) || memchr(value, '\0', vlen)) {
+        st->malformed = 1;
+        return;
+    }
+    if (name[0] == ':') {
+        // 擬似ヘッダは普通のヘッダより前に1つずつしか書けない
+        for (j = 0; j < NUM_PSEUDO_HEADERS; j++) {
+            if (strlen(pseudo_header_names[j]) == nlen && memcmp(pseudo_header_names[j], name, nlen) == 0) {
+                break;
+            }
+        }
+        if (st->regular || j == NUM_PSEUDO_HEADERS || st->pseudo[j]) {
+            st->malformed = 1;
+            return;
+        }
+        st->pseudo[j] = checked_malloc(vlen + 1);
+        memcpy(st->pseudo[j], value, vlen);
+        st->pseudo[j][vlen] = '\0';
+        return;
+    }
+    st->regular = 1;
+    for (j = 0; connection_specific[j]; j++) {
+        if (strlen(connection_specific[j]) == nlen && memcmp(connection_specific[j], name, nlen) == 0) {
+            st->malformed = 1;
+            return;
+        }
+    }
+    if (nlen == 2 && memcmp(name, "te", 2) == 0 && (vlen != 8 || memcmp(value, "trailers", 8) != 0)) {
+        st->malformed = 1;
+        return;
+    }
+    if (nlen == 4 && memcmp(name, "host", 4) == 0) {
+        st->has_host = 1;
     }
-    free(req->method);
-    free(req->path);
-    free(req->body);
-    free(req);
+    if (st->hlen + nlen + vlen + 4 > MAX_REQUEST_HEADER_LENGTH) {
+        st->malformed = 1;
+        return;
+    }
+    grow_buffer(&st->hbuf, &st->hcap, st->hlen + nlen + vlen + 4);
+    memcpy(st->hbuf + st->hlen, name, nlen);
+    st->hlen += nlen;
+    memcpy(st->hbuf + st->hlen, ": ", 2);
+    st->hlen += 2;
+    memcpy(st->hbuf + st->hlen, value, vlen);
+    st->hlen += vlen;
+    memcpy(st->hbuf + st->hlen, "\r\n", 2);
+    st->hlen += 2;
 }
 
-static long
-content_length(struct HTTPRequest *req)
+static int
+h2_build_request(struct H2Stream *st)
 {
-    char *val;
-    long len;
-    val = lookup_header_field_value(req, "Content-Length");
-    if (!val) {
-        return 0;
+    struct HTTPRequest *req = &st->req;
+    char *text = NULL, *p, *eol;
+    size_t len = 0, cap = 0;
+
+    buf_printf(&text, &len, &cap, "%s %s HTTP/1.1\r\n", st->pseudo[PSEUDO_METHOD], st->pseudo[PSEUDO_PATH]);
+    if (st->pseudo[PSEUDO_AUTHORITY] && !st->has_host) {
+        buf_printf(&text, &len, &cap, "host: %s\r\n", st->pseudo[PSEUDO_AUTHORITY]);
     }
-    len = atol(val);
-    if (len < 0) {
-        log_exit("negative Content-Length value found");
+    grow_buffer(&text, &cap, len + st->hlen + 3);
+    if (st->hlen > 0) {
+        memcpy(text + len, st->hbuf, st->hlen);
+        len += st->hlen;
     }
-    return len;
+    memcpy(text + len, "\r\n", 3);
+    len += 2;
+    free(st->hbuf);
+    st->hbuf = text;
+    st->hlen = len;
+    st->hcap = cap;
+    // HTTP/1のリクエストと同じ関数で解析し、同じように応答する
+    req->buf = text;
+    eol = strstr(text, "\r\n");
+    if (parse_request_line(req, text, eol - text) < 0) {
+        return -1;
+    }
+    for (p = eol + 2; (eol = strstr(p, "\r\n")) != p; p = eol + 2) {
+        if (parse_header_field(req, p, eol - p) < 0) {
+            return -1;
+        }
+    }
+    req->header_len = len;
+    if (finish_header(req) < 0) {
+        return -1;
+    }
+    req->state = PARSE_BODY;
+    req->method = req->buf + req->method_range.off;
+    req->path = req->buf + req->path_range.off;
+    req->query = req->query_range.off ? req->buf + req->query_range.off : NULL;
+    return 0;
 }
 
-static char*
-lookup_header_field_value(struct HTTPRequest *req, char *name)
+static long
+base64url_decode(const char *src, unsigned char *dst, size_t max)
 {
-    struct HTTPHeaderField *h;
-    for (h = req->header; h; h = h->next) {
-        if (strcasecmp(h->name, name) == 0) {
-            return h->value;
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    unsigned long bits = 0;
+    size_t n = 0;
+    int nbits = 0;
+    char *d;
+
+    for (; *src && *src != '='; src++) {
+        d = strchr(digits, *src);
+        if (!d) {
+            return -1;
+        }
+        bits = (bits << 6) | (d - digits);
+        nbits += 6;
+        if (nbits >= 8) {
+            if (n == max) {
+                return -1;
+            }
+            nbits -= 8;
+            dst[n++] = (bits >> nbits) & 0xff;
         }
     }
-    return NULL;
+    return n;
 }
 
-static void
-respond_to(struct HTTPRequest *req, FILE *out, char *docroot)
+static int
+hpack_decode(struct H2Session *h2, unsigned char *p, size_t len, struct H2Stream *st)
 {
-    if (strcmp(req->method, "GET") == 0) {
-        do_file_response(req, out, docroot);
-    } else if (strcmp(req->method, "HEAD") == 0) {
-        do_file_response(req, out, docroot);
-    } else if (strcmp(req->method, "POST") == 0) {
-        method_not_allowed(req, out);
-    } else {
-        not_implemented(req, out);
+    struct HpackTable *t = &h2->decoder;
+    const struct HpackField *f;
+    unsigned char *end = p + len;
+    char *name, *value;
+    size_t index, nlen, vlen;
+    int b;
+
+    while (p < end) {
+        b = *p;
+        if (b & 0x80) {
+            // 表の項目をそのまま使う
+            if (hpack_decode_int(&p, end, 7, &index) < 0 || !(f = hpack_lookup(t, index))) {
+                return -1;
+            }
+            h2_request_field(st, f->name, f->name_len, f->value, f->value_len);
+            continue;
+        }
+        if ((b & 0xe0) == 0x20) {
+            // 動的テーブルの大きさの変更。SETTINGSで許した大きさまで
+            if (hpack_decode_int(&p, end, 5, &index) < 0 || index > HPACK_TABLE_SIZE) {
+                return -1;
+            }
+            hpack_resize(t, index);
+            continue;
+        }
+        // リテラル。0x40なら動的テーブルに加え、0x00と0x10なら加えない
+        if (hpack_decode_int(&p, end, (b & 0x40) ? 6 : 4, &index) < 0) {
+            return -1;
+        }
+        if (index) {
+            if (!(f = hpack_lookup(t, index))) {
+                return -1;
+            }
+            name = f->name;
+            nlen = f->name_len;
+        } else if (hpack_decode_string(h2, 0, &p, end, &name, &nlen) < 0) {
+            return -1;
+        }
+        if (hpack_decode_string(h2, 1, &p, end, &value, &vlen) < 0) {
+            return -1;
+        }
+        // 表に加えると名前を借りた項目が追い出されるかもしれないので、先にストリームへ写す
+        h2_request_field(st, name, nlen, value, vlen);
+        if (b & 0x40) {
+            hpack_add(t, name, nlen, value, vlen);
+        }
     }
+    return 0;
 }
 
-static void
-do_file_response(struct HTTPRequest *req, FILE *out, char *docroot)
+static int
+hpack_decode_int(unsigned char **p, unsigned char *end, int prefix, size_t *value)
 {
-    struct FileInfo *info;
-    info = get_fileinfo(docroot, req->path);
-    if (!info->ok) {
-        free_fileinfo(info);
-        not_found(req, out);
-        return;
+    size_t max = (1 << prefix) - 1, v;
+    int b, shift = 0;
+
+    if (*p >= end) {
+        return -1;
     }
-    output_common_header_fields(req, out, "200 OK");
-    fprintf(out, "Content-Length: %ld\r\n", info->size);
-    fprintf(out, "Content-Type: %s\r\n", guess_content_type(info));
-    fprintf(out, "\r\n");
-    if (strcmp(req->method, "HEAD") != 0) {
-        int fd;
-        char buf[BLOCK_BUF_SIZE];
-        ssize_t n;
-        fd = open(info->path, O_RDONLY);
-        if (fd < 0) {
-            log_exit("failed to open %s: %s", info->path, strerror(errno));
+    v = *(*p)++ & max;
+    if (v < max) {
+        *value = v;
+        return 0;
+    }
+    do {
+        if (*p >= end || shift > 28) {
+            return -1;
         }
-        for (;;) {
-            n = read(fd, buf, BLOCK_BUF_SIZE);
-            if (n < 0) {
-                log_exit("failed to read %s: %s", info->path, strerror(errno));
-            }
-            if (n == 0) {
-                break;
-            }
-            if (fwrite(buf, 1, n, out) < n) {
-                log_exit("failed to write to socket");
+        b = *(*p)++;
+        v += (size_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    *value = v;
+    return 0;
+}
+
+static int
+hpack_decode_string(struct H2Session *h2, int slot, unsigned char **p, unsigned char *end,
+                    char **str, size_t *len)
+{
+    size_t n;
+    int huffman;
+
+    if (*p >= end) {
+        return -1;
+    }
+    huffman = **p & 0x80;
+    if (hpack_decode_int(p, end, 7, &n) < 0 || n > (size_t)(end - *p)) {
+        return -1;
+    }
+    if (!huffman) {
+        *str = (char*)*p;
+        *len = n;
+        *p += n;
+        return 0;
+    }
+    // 符号は最短5ビットなので、解くと最大で8/5倍に伸びる
+    grow_buffer(&h2->scratch[slot], &h2->scratch_cap[slot], n * 8 / 5 + 1);
+    if (huffman_decode(*p, n, h2->scratch[slot], len) < 0) {
+        return -1;
+    }
+    *str = h2->scratch[slot];
+    *p += n;
+    return 0;
+}
+
+static int
+huffman_decode(unsigned char *src, size_t len, char *dst, size_t *outlen)
+{
+    size_t i, n = 0;
+    int bit, node = 0, c, pad = 0, ones = 1;
+
+    if (!huffman_tree_built) {
+        build_huffman_tree();
+    }
+    for (i = 0; i < len; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            c = huffman_tree[node][(src[i] >> bit) & 1];
+            if (c < 0) {
+                if (-c - 1 == HUFFMAN_EOS) {
+                    return -1;
+                }
+                dst[n++] = -c - 1;
+                node = 0;
+                pad = 0;
+                ones = 1;
+            } else if (c == 0) {
+                return -1;
+            } else {
+                node = c;
+                pad++;
+                ones &= (src[i] >> bit) & 1;
             }
         }
-        close(fd);
     }
-    fflush(out);
-    free_fileinfo(info);
+    // 最後の記号の後ろは、EOSの先頭の7ビット以下の1で埋められていなければならない
+    if (pad > 7 || !ones) {
+        return -1;
+    }
+    *outlen = n;
+    return 0;
 }
 
 static void
-method_not_allowed(struct HTTPRequest *req, FILE *out)
+build_huffman_tree(void)
 {
-    output_common_header_fields(req, out, "405 Method Not Allowed");
-    fprintf(out, "Content-Type: text/html\r\n");
-    fprintf(out, "\r\n");
-    fprintf(out, "<html>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<title>405 Method Not Allowed</title>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<body>\r\n");
-    fprintf(out, "<p>The request method %s is not allowed</p>\r\n", req->method);
-    fprintf(out, "</body>\r\n");
-    fprintf(out, "</html>\r\n");
-    fflush(out);
+    int sym, bit, b, node, nnodes = 0;
+
+    for (sym = 0; sym < HUFFMAN_SYMBOLS; sym++) {
+        node = 0;
+        for (bit = huffman_code_lengths[sym] - 1; bit > 0; bit--) {
+            b = (huffman_codes[sym] >> bit) & 1;
+            if (!huffman_tree[node][b]) {
+                huffman_tree[node][b] = ++nnodes;
+            }
+            node = huffman_tree[node][b];
+        }
+        huffman_tree[node][huffman_codes[sym] & 1] = -(sym + 1);
+    }
+    huffman_tree_built = 1;
 }
 
-static void
-not_implemented(struct HTTPRequest *req, FILE *out)
+static const struct HpackField*
+hpack_lookup(struct HpackTable *t, size_t index)
 {
-    output_common_header_fields(req, out, "501 Not Implemented");
-    fprintf(out, "Content-Type: text/html\r\n");
-    fprintf(out, "\r\n");
-    fprintf(out, "<html>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<title>501 Not Implemented</title>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<body>\r\n");
-    fprintf(out, "<p>The request method %s is not implemented</p>\r\n", req->method);
-    fprintf(out, "</body>\r\n");
-    fprintf(out, "</html>\r\n");
-    fflush(out);
+    if (index == 0) {
+        return NULL;
+    }
+    if (index <= HPACK_STATIC_ENTRIES) {
+        return &hpack_static_table[index];
+    }
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if (index >= (size_t)t->count) {
+        return NULL;
+    }
+    return &t->entries[(t->head + index) % HPACK_TABLE_ENTRIES];
 }
 
 static void
-not_found(struct HTTPRequest *req, FILE *out)
+hpack_add(struct HpackTable *t, const char *name, size_t nlen, const char *value, size_t vlen)
 {
-    output_common_header_fields(req, out, "404 Not Found");
-    fprintf(out, "Content-Type: text/html\r\n");
-    fprintf(out, "\r\n");
-    if (strcmp(req->method, "HEAD") != 0) {
-        fprintf(out, "<html>\r\n");
-        fprintf(out, "<header><title>Not Found</title><header>\r\n");
-        fprintf(out, "<body><p>File not found</p></body>\r\n");
-        fprintf(out, "</html>\r\n");
+    struct HpackField *e;
+    size_t size = nlen + vlen + HPACK_ENTRY_OVERHEAD;
+    char *p;
+
+    // nameとvalueが追い出す項目を指していることもあるので、先に写してから追い出す
+    p = checked_malloc(nlen + vlen + 2);
+    memcpy(p, name, nlen);
+    p[nlen] = '\0';
+    memcpy(p + nlen + 1, value, vlen);
+    p[nlen + 1 + vlen] = '\0';
+    while (t->count > 0 && t->size + size > t->max_size) {
+        hpack_evict(t);
+    }
+    if (size > t->max_size) {
+        // 表より大きな項目は、表を空にするだけで加えない
+        free(p);
+        return;
     }
-    fflush(out);
+    t->head = (t->head + HPACK_TABLE_ENTRIES - 1) % HPACK_TABLE_ENTRIES;
+    e = &t->entries[t->head];
+    e->name = p;
+    e->name_len = nlen;
+    e->value = p + nlen + 1;
+    e->value_len = vlen;
+    t->count++;
+    t->size += size;
 }
 
-#define TIME_BUF_SIZE 64
-
 static void
-output_common_header_fields(struct HTTPRequest *req, FILE *out, char *status)
+hpack_resize(struct HpackTable *t, size_t max)
 {
-    time_t t;
-    struct tm *tm;
-    char buf[TIME_BUF_SIZE];
-    t = time(NULL);
-    tm = gmtime(&t);
-    if (!tm) {
-        log_exit("gmtime() failed: %s", strerror(errno));
+    t->max_size = max;
+    while (t->count > 0 && t->size > max) {
+        hpack_evict(t);
     }
-    strftime(buf, TIME_BUF_SIZE, "%a, %d %b %Y %H:%M:%S GMT", tm);
-    fprintf(out, "HTTP/1.%d %s\r\n", HTTP_MINOR_VERSION, status);
-    fprintf(out, "Date: %s\r\n", buf);
-    fprintf(out, "Server: %s/%s\r\n", SERVER_NAME, SERVER_VERSION);
-    fprintf(out, "Connection: close\r\n");
 }
 
-static struct FileInfo*
-get_fileinfo(char *docroot, char *urlpath)
+static void
+hpack_evict(struct HpackTable *t)
 {
-    struct FileInfo *info;
-    struct stat st;
-    info = checked_malloc(sizeof(struct FileInfo));
-    info->path = build_fspath(docroot, urlpath);
-    info->ok = 0;
-    if (lstat(info->path, &st) < 0) {
-        return info;
+    struct HpackField *e = &t->entries[(t->head + t->count - 1) % HPACK_TABLE_ENTRIES];
+
+    t->size -= e->name_len + e->value_len + HPACK_ENTRY_OVERHEAD;
+    free(e->name);
+    t->count--;
+}
+
+static void
+hpack_encode_field(struct HpackTable *t, char **buf, size_t *len, size_t *cap,
+                   const char *name, size_t nlen, const char *value, size_t vlen, int index)
+{
+    const struct HpackField *f;
+    size_t i, name_index = 0;
+
+    for (i = 1; i <= HPACK_STATIC_ENTRIES + (size_t)t->count; i++) {
+        f = hpack_lookup(t, i);
+        if (f->name_len != nlen || memcmp(f->name, name, nlen) != 0) {
+            continue;
+        }
+        if (f->value_len == vlen && memcmp(f->value, value, vlen) == 0) {
+            hpack_put_int(buf, len, cap, 7, 0x80, i);
+            return;
+        }
+        if (!name_index) {
+            name_index = i;
+        }
     }
-    if (!S_ISREG(st.st_mode)) {
-        return info;
+    hpack_put_int(buf, len, cap, index ? 6 : 4, index ? 0x40 : 0x00, name_index);
+    if (!name_index) {
+        hpack_put_string(buf, len, cap, name, nlen);
+    }
+    hpack_put_string(buf, len, cap, value, vlen);
+    if (index) {
+        hpack_add(t, name, nlen, value, vlen);
     }
-    info->ok = 1;
-    info->size = st.st_size;
-    return info;
 }
 
-static char*
-build_fspath(char *docroot, char *urlpath)
+static void
+hpack_put_int(char **buf, size_t *len, size_t *cap, int prefix, int flags, size_t value)
 {
-    char *path;
-    path = checked_malloc(strlen(docroot) + 1 + strlen(urlpath) + 1);
-    sprintf(path, "%s/%s", docroot, urlpath);
-    return path;
+    size_t max = (1 << prefix) - 1;
+
+    grow_buffer(buf, cap, *len + 16);
+    if (value < max) {
+        (*buf)[(*len)++] = flags | value;
+        return;
+    }
+    (*buf)[(*len)++] = flags | max;
+    for (value -= max; value >= 0x80; value >>= 7) {
+        (*buf)[(*len)++] = 0x80 | (value & 0x7f);
+    }
+    (*buf)[(*len)++] = value;
 }
 
 static void
-free_fileinfo(struct FileInfo *info)
+hpack_put_string(char **buf, size_t *len, size_t *cap, const char *str, size_t slen)
 {
-    free(info->path);
-    free(info);
+    hpack_put_int(buf, len, cap, 7, 0x00, slen);
+    grow_buffer(buf, cap, *len + slen);
+    memcpy(*buf + *len, str, slen);
+    *len += slen;
 }
 
-static char*
-guess_content_type(struct FileInfo *info)
+static void
+buf_printf(char **buf, size_t *len, size_t *cap, char *fmt, ...)
 {
-    return "text/plain";
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(*buf + *len, *cap - *len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            log_exit("vsnprintf(3) failed");
+        }
+        if (*len + n < *cap) {
+            *len += n;
+            return;
+        }
+        grow_buffer(buf, cap, *len + n + 1);
+    }
 }
 
 static void*
@@ -467,6 +9362,16 @@ checked_malloc(size_t sz)
     return p;
 }
 
+static void
+log_error(char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
 static void
 log_exit(char *fmt, ...)
 {
@@ -477,6 +9382,3 @@ log_exit(char *fmt, ...)
     va_end(ap);
     exit(1);
 }
-
-
-
@@ -0,0 +1,42 @@
+#!/bin/sh
+# httpbenchで使うドキュメントルートを作る
+# small/N.html は256バイトから4KiBのHTML、large/N.bin は1MiBの乱数、index.html は小さなページ
+#
+# Usage: mkdocroot.sh DIR [SMALL_FILES] [LARGE_FILES]
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 DIR [SMALL_FILES] [LARGE_FILES]" >&2
+    exit 1
+fi
+dir=$1
+nsmall=${2:-100}
+nlarge=${3:-10}
+
+mkdir -p "$dir/small" "$dir/large"
+echo '<html><body><p>httpbench</p></body></html>' > "$dir/index.html"
+
+i=0
+while [ $i -lt "$nsmall" ]; do
+    # 大きさがばらつくよう、ファイルごとに段落の数を変える
+    n=$((i % 16 + 1))
+    {
+        echo "<html><head><title>small $i</title></head><body>"
+        j=0
+        while [ $j -lt $n ]; do
+            echo "<p>Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor $i-$j.</p>"
+            j=$((j + 1))
+        done
+        echo "</body></html>"
+    } > "$dir/small/$i.html"
+    i=$((i + 1))
+done
+
+i=0
+while [ $i -lt "$nlarge" ]; do
+    head -c 1048576 /dev/urandom > "$dir/large/$i.bin"
+    i=$((i + 1))
+done
+
+echo "created $nsmall small and $nlarge large files in $dir"